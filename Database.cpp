@@ -4,22 +4,123 @@
  */
 
 #include <utility>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <filesystem>
 #include "sqlite/sqlite3.h"
 #include <stdlib.h>
+#include <string.h>
 #include "Database.h"
 #include "stringtools.h"
 #include "DatabaseLogger.h"
 #include "DatabaseQuery.h"
+#include "DatabaseCarray.h"
 
 using namespace sqlgen;
 
 namespace
 {
+	const char* c_bulk_load_backup_suffix = "-bulkload";
+	const char* c_bulk_load_lock_suffix = "-bulkload.lock";
+
+	/**
+	* Takes an exclusive SQLite lock on <file>-bulkload.lock. The connection
+	* doing a crash safe bulk load holds it until endBulkLoad(). The OS
+	* releases it if the process exits. The lock file is not removed, so all
+	* connections lock the same file. Returns nullptr if the lock is held.
+	*/
+	sqlite3* lockBulkLoad(const std::string& file)
+	{
+		sqlite3* lock_db = nullptr;
+		if (sqlite3_open_v2((file + c_bulk_load_lock_suffix).c_str(), &lock_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK
+			|| sqlite3_exec(lock_db, "PRAGMA journal_mode=OFF; BEGIN EXCLUSIVE", nullptr, nullptr, nullptr) != SQLITE_OK)
+		{
+			sqlite3_close(lock_db);
+			return nullptr;
+		}
+		return lock_db;
+	}
+
+	//Swaps back the copy of a database whose bulk load did not finish
+	void restoreBulkLoadBackup(const std::string& file)
+	{
+		if (file.empty() || file == ":memory:" || file.find("file:") == 0)
+			return;
+
+		std::error_code ec;
+		std::string backup_file = file + c_bulk_load_backup_suffix;
+		if (!std::filesystem::exists(backup_file, ec))
+			return;
+
+		sqlite3* lock_db = lockBulkLoad(file);
+		if (lock_db == nullptr)
+		{
+			getDatabaseLogger()->Log("Bulk load of db [" + file + "] is running", LL_DEBUG);
+			return;
+		}
+
+		//The bulk load may have finished before it released the lock
+		if (!std::filesystem::exists(backup_file, ec))
+		{
+			sqlite3_close(lock_db);
+			return;
+		}
+
+		getDatabaseLogger()->Log("Bulk load of db [" + file + "] did not finish. Restoring previous state", LL_WARNING);
+
+		for (const char* suffix : { "-journal", "-wal", "-shm" })
+		{
+			std::filesystem::remove(file + suffix, ec);
+		}
+
+		std::filesystem::rename(backup_file, file, ec);
+		sqlite3_close(lock_db);
+		if (ec)
+		{
+			throw DatabaseOpenError("Could not restore db [" + file + "] from [" + backup_file + "]: " + ec.message());
+		}
+	}
+
 	size_t get_sqlite_cache_size()
 	{
 		return 2*1024; //2MB
 	}
 
+	//Settings per database (main and attached)
+	const char* c_schema_settings[] = { "journal_mode", "synchronous", "cache_size", "mmap_size" };
+	//Settings of the connection
+	const char* c_connection_settings[] = { "temp_store", "cache_spill", "threads", "wal_autocheckpoint" };
+
+	const char* c_tuning_settings[] = { "journal_mode", "synchronous", "cache_size", "mmap_size",
+		"temp_store", "cache_spill", "threads", "wal_autocheckpoint" };
+
+	const std::map<std::string, str_map>& getTuningProfiles()
+	{
+		static const std::map<std::string, str_map> profiles = {
+			//Many small write transactions and point reads. Same as the defaults plus WAL
+			{ "oltp", { { "journal_mode", "WAL" }, { "synchronous", "NORMAL" }, { "cache_size", "-2048" },
+				{ "mmap_size", "0" }, { "temp_store", "DEFAULT" }, { "cache_spill", "1" },
+				{ "threads", "2" }, { "wal_autocheckpoint", "1000" } } },
+			//Large write transactions. Not durable on power loss until switched back
+			{ "bulk_load", { { "journal_mode", "WAL" }, { "synchronous", "OFF" }, { "cache_size", "-65536" },
+				{ "mmap_size", "0" }, { "temp_store", "MEMORY" }, { "cache_spill", "0" },
+				{ "threads", "4" }, { "wal_autocheckpoint", "10000" } } },
+			{ "read_mostly", { { "journal_mode", "WAL" }, { "synchronous", "NORMAL" }, { "cache_size", "-16384" },
+				{ "mmap_size", "268435456" }, { "temp_store", "MEMORY" }, { "cache_spill", "1" },
+				{ "threads", "2" }, { "wal_autocheckpoint", "1000" } } },
+			//Large scans and sorts
+			{ "analytics", { { "journal_mode", "WAL" }, { "synchronous", "NORMAL" }, { "cache_size", "-131072" },
+				{ "mmap_size", "1073741824" }, { "temp_store", "FILE" }, { "cache_spill", "1" },
+				{ "threads", "8" }, { "wal_autocheckpoint", "1000" } } },
+			{ "low_memory", { { "journal_mode", "WAL" }, { "synchronous", "NORMAL" }, { "cache_size", "-256" },
+				{ "mmap_size", "0" }, { "temp_store", "FILE" }, { "cache_spill", "1" },
+				{ "threads", "0" }, { "wal_autocheckpoint", "250" } } }
+		};
+		return profiles;
+	}
+
 	void errorLogCallback(void *pArg, int iErrCode, const char *zMsg)
 	{
 		switch (iErrCode)
@@ -39,8 +140,121 @@ namespace
 	}
 }
 
+namespace sqlgen
+{
+	struct ReaderPool
+	{
+		std::vector<std::unique_ptr<Database> > readers;
+		//Free reader slots (index into readers + 1)
+		std::vector<size_t> free_slots;
+		std::mutex mutex;
+		std::condition_variable cond;
+	};
+
+	struct BulkLoadState
+	{
+		//Settings to restore in endBulkLoad()
+		std::string journal_mode;
+		std::string synchronous;
+		std::string cache_size;
+		//Dropped indexes (name, sql)
+		std::vector<std::pair<std::string, std::string> > indexes;
+		std::string backup_file;
+		//Lock held while the backup file exists, see lockBulkLoad()
+		sqlite3* owner_lock = nullptr;
+
+		~BulkLoadState() {
+			sqlite3_close(owner_lock);
+		}
+	};
+
+	//Shared by all connections to one database file in this process
+	struct BusySignal
+	{
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::atomic<uint64_t> waits{ 0 };
+	};
+
+	struct BusyState
+	{
+		int timeout_ms = c_sqlite_busy_timeout_default;
+		std::shared_ptr<BusySignal> signal;
+		//Start of the current wait (count 0)
+		std::chrono::steady_clock::time_point wait_start;
+	};
+
+	struct BusyHandler
+	{
+		//Same delays as SQLite's default busy handler
+		static int handle(void* p, int count)
+		{
+			static const int delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+			const int ndelay = static_cast<int>(sizeof(delays) / sizeof(delays[0]));
+
+			BusyState* state = static_cast<BusyState*>(p);
+			auto now = std::chrono::steady_clock::now();
+			if (count == 0)
+				state->wait_start = now;
+
+			//Waits can end early when woken up, so the timeout uses the time actually waited
+			int elapsed = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(now - state->wait_start).count());
+			int delay = delays[(std::min)(count, ndelay - 1)];
+			if (elapsed + delay > state->timeout_ms)
+			{
+				delay = state->timeout_ms - elapsed;
+				if (delay <= 0)
+					return 0;
+			}
+
+			if (state->signal)
+			{
+				if (count == 0)
+					++state->signal->waits;
+				std::unique_lock<std::mutex> lock(state->signal->mutex);
+				state->signal->cond.wait_for(lock, std::chrono::milliseconds(delay));
+			}
+			else
+			{
+				sqlite3_sleep(delay);
+			}
+			return 1;
+		}
+	};
+}
+
+namespace
+{
+	std::shared_ptr<BusySignal> getBusySignal(const std::string& file)
+	{
+		static std::mutex mutex;
+		static std::map<std::string, std::weak_ptr<BusySignal> > signals;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto it = signals.begin(); it != signals.end();)
+		{
+			if (it->second.expired())
+				it = signals.erase(it);
+			else
+				++it;
+		}
+
+		std::shared_ptr<BusySignal> ret = signals[file].lock();
+		if (!ret)
+		{
+			ret = std::make_shared<BusySignal>();
+			signals[file] = ret;
+		}
+		return ret;
+	}
+}
+
 Database::~Database()
 {
+	if (bulk_load && !bulk_load->backup_file.empty())
+	{
+		getDatabaseLogger()->Log("Database closed during bulk load. Changes are discarded when it is opened again", LL_WARNING);
+	}
 	sqlite3_close(db);
 }
 
@@ -52,9 +266,24 @@ Database::Database(Database&& other)
 Database& Database::operator=(Database &&other)
 {
 	db = std::exchange(other.db, nullptr),
-	in_transaction = other.in_transaction,
+	transaction_depth = other.transaction_depth,
 	attached_dbs = std::move(other.attached_dbs);
 	params = std::move(other.params);
+	change_listeners = std::move(other.change_listeners);
+	next_change_listener_id = other.next_change_listener_id;
+	reported_changes = other.reported_changes;
+	checked_total_changes = other.checked_total_changes;
+	checked_reported_changes = other.checked_reported_changes;
+	reader_pool = std::move(other.reader_pool);
+	settings = std::move(other.settings);
+	profile = std::move(other.profile);
+	attach_pending = other.attach_pending;
+	bulk_load = std::move(other.bulk_load);
+	transaction_stats = other.transaction_stats;
+	busy_state = std::move(other.busy_state);
+	open_duration = other.open_duration;
+	if (!change_listeners.empty())
+		installHooks();
 	return *this;
 }
 
@@ -68,61 +297,94 @@ Database::Database(const std::string& pFile, std::vector<std::pair<std::string,s
 	size_t allocation_chunk_size, str_map p_params)
 	: params(std::move(p_params)), attached_dbs(std::move(attach))
 {
+	auto open_start = std::chrono::steady_clock::now();
+
 	static auto initRes = initLogging();
 	if(!initRes)
 	{
 		throw DatabaseOpenError("Static init failed");
 	}
 
-	if( sqlite3_open(pFile.c_str(), &db) )
+	str_map::const_iterator profile_it = params.find("profile");
+	if (profile_it != params.end())
+	{
+		auto profile_settings = getTuningProfiles().find(profile_it->second);
+		if (profile_settings == getTuningProfiles().end())
+		{
+			throw ProfileError("Unknown tuning profile [" + profile_it->second + "]");
+		}
+		profile = profile_it->second;
+		settings = profile_settings->second;
+	}
+	else
+	{
+		static size_t sqlite_cache_size = get_sqlite_cache_size();
+		settings["synchronous"] = "NORMAL";
+		settings["cache_size"] = "-" + std::to_string(sqlite_cache_size);
+		settings["threads"] = "2";
+	}
+
+	int open_flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	str_map::const_iterator ro_it = params.find("read_only");
+	if (ro_it != params.end() && ro_it->second == "1")
+	{
+		open_flags = SQLITE_OPEN_READONLY;
+	}
+	else
+	{
+		restoreBulkLoadBackup(pFile);
+	}
+
+	if( sqlite3_open_v2(pFile.c_str(), &db, open_flags, nullptr) )
 	{
 		getDatabaseLogger()->Log("Could not open db ["+pFile+"]");
 		throw DatabaseOpenError("Could not open db ["+pFile+"]");
 	}
 	else
 	{
-		str_map::const_iterator it = params.find("synchronous");
-		if (it != params.end())
-		{
-			write("PRAGMA synchronous="+it->second);
-		}
-		else
-		{
-			write("PRAGMA synchronous=NORMAL");
-		}
-		write("PRAGMA foreign_keys = ON");
-		write("PRAGMA threads = 2");
+		busy_state.reset(new BusyState);
+		const char* fn = sqlite3_db_filename(db, "main");
+		if (fn != nullptr && *fn != 0)
+			busy_state->signal = getBusySignal(fn);
+		setBusyTimeout(c_sqlite_busy_timeout_default);
 
-		it = params.find("wal_autocheckpoint");
-		if (it != params.end())
-		{
-			write("PRAGMA wal_autocheckpoint=" + it->second);
+		//Runs all setup statements in one go instead of one DatabaseQuery per PRAGMA
+		std::string script;
+		str_map::const_iterator it = params.find("page_size");
+		script += "PRAGMA page_size=" + (it != params.end() ? it->second : std::string("4096")) + ";\n";
+		script += "PRAGMA foreign_keys = ON;\n";
 
-			if (atoi(it->second.c_str())<=0)
-			{
-				int enable = 1;
-				sqlite3_file_control(db, NULL, SQLITE_FCNTL_PERSIST_WAL, &enable);
-#ifdef SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE
-				int was_enabled = 0;
-				sqlite3_db_config(db, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE, 1, &was_enabled);
-#endif
-			}
+		//Explicit parameters override settings of the profile
+		for (const char* key : c_tuning_settings)
+		{
+			it = params.find(key);
+			if (it != params.end())
+				settings[key] = it->second;
 		}
 
-		it = params.find("page_size");
-		if (it != params.end())
+		script += getSettingsScript("main", true, true);
+
+		it = params.find("lazy_attach");
+		if (it != params.end() && it->second == "1")
 		{
-			write("PRAGMA page_size=" + it->second);
+			attach_pending = !attached_dbs.empty();
 		}
 		else
 		{
-			write("PRAGMA page_size=4096");
+			script += getAttachScript();
 		}
 
-		it = params.find("mmap_size");
-		if (it != params.end())
+		execScript(script);
+
+		it = params.find("wal_autocheckpoint");
+		if (it != params.end() && atoi(it->second.c_str())<=0)
 		{
-			write("PRAGMA mmap_size=" + it->second);
+			int enable = 1;
+			sqlite3_file_control(db, NULL, SQLITE_FCNTL_PERSIST_WAL, &enable);
+#ifdef SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE
+			int was_enabled = 0;
+			sqlite3_db_config(db, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE, 1, &was_enabled);
+#endif
 		}
 
 		if(allocation_chunk_size!=std::string::npos)
@@ -131,12 +393,12 @@ Database::Database(const std::string& pFile, std::vector<std::pair<std::string,s
 			sqlite3_file_control(db, NULL, SQLITE_FCNTL_CHUNK_SIZE, &chunk_size);
 		}
 
-		static size_t sqlite_cache_size = get_sqlite_cache_size();
-		write("PRAGMA cache_size = -"+std::to_string(sqlite_cache_size));	
-
-		sqlite3_busy_timeout(db, c_sqlite_busy_timeout_default);
+		if (registerCarrayModule(db) != SQLITE_OK)
+		{
+			getDatabaseLogger()->Log("Could not register carray module", LL_WARNING);
+		}
 
-		attachDBs();
+		open_duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - open_start);
 	}
 }
 
@@ -152,31 +414,174 @@ void Database::write(const std::string& query)
 }
 
 
+bool Database::beginNestedTransaction()
+{
+	if (transaction_depth == 0)
+		return false;
+
+	if (sqlite3_get_autocommit(db))
+	{
+		//E.g. rolled back by SQLite after an error, or ended without endTransaction()
+		getDatabaseLogger()->Log("Transaction of depth " + std::to_string(transaction_depth) + " is not active anymore. Starting a new one", LL_WARNING);
+		transaction_depth = 0;
+		return false;
+	}
+
+	write("SAVEPOINT sqlgen_sp" + std::to_string(transaction_depth));
+	++transaction_depth;
+	return true;
+}
+
 void Database::beginReadTransaction()
 {
+	if (beginNestedTransaction())
+		return;
+
 	write("BEGIN");
-	in_transaction = true;
+	transaction_depth = 1;
 }
 
 void Database::beginWriteTransaction()
 {
+	if (beginNestedTransaction())
+		return;
+
 	write("BEGIN IMMEDIATE");
-	in_transaction = true;
+	transaction_depth = 1;
 }
 
 void Database::endTransaction()
 {
+	if (transaction_depth > 1)
+	{
+		--transaction_depth;
+		write("RELEASE sqlgen_sp" + std::to_string(transaction_depth));
+		return;
+	}
+
 	write("END;");
-	in_transaction=false;
+	transaction_depth = 0;
+	notifyLockReleased();
 }
 
 void Database::rollbackTransaction()
 {
-	write("ROLLBACK");
+	if (transaction_depth > 1 && !sqlite3_get_autocommit(db))
+	{
+		--transaction_depth;
+		std::string savepoint = "sqlgen_sp" + std::to_string(transaction_depth);
+		write("ROLLBACK TO " + savepoint);
+		write("RELEASE " + savepoint);
+		//The rollback hook is only called for the whole transaction
+		notifyChange(nullptr, nullptr);
+		return;
+	}
+
+	//SQLite rolls back by itself after some errors. The savepoints are gone then as well
+	if (!sqlite3_get_autocommit(db))
+		write("ROLLBACK");
+	transaction_depth = 0;
+	notifyLockReleased();
+}
+
+void Database::runTransaction(const std::function<void()>& f, const TransactionPolicy& policy)
+{
+	if (transaction_depth > 0)
+	{
+		beginWriteTransaction();
+		try
+		{
+			f();
+		}
+		catch (...)
+		{
+			rollbackTransaction();
+			throw;
+		}
+		endTransaction();
+		return;
+	}
+
+	size_t conflicts = 0;
+	std::chrono::milliseconds backoff = policy.initial_backoff;
+	while (true)
+	{
+		auto attempt_start = std::chrono::steady_clock::now();
+		if (conflicts >= policy.immediate_after)
+		{
+			++transaction_stats.immediate;
+			beginWriteTransaction();
+		}
+		else
+		{
+			beginReadTransaction();
+		}
+
+		retryable_transaction = true;
+		try
+		{
+			f();
+		}
+		catch (TransactionConflict&)
+		{
+			retryable_transaction = false;
+			rollbackTransaction();
+			++conflicts;
+			++transaction_stats.conflicts;
+
+			if (conflicts > policy.max_retries)
+			{
+				++transaction_stats.failures;
+				transaction_stats.wasted += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - attempt_start);
+				throw TransactionConflict("Transaction did not succeed after " + std::to_string(conflicts) + " attempts");
+			}
+
+			if (backoff.count() > 0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1 + rand() % backoff.count()));
+				backoff = (std::min)(backoff * 2, policy.max_backoff);
+			}
+			transaction_stats.wasted += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - attempt_start);
+			continue;
+		}
+		catch (...)
+		{
+			retryable_transaction = false;
+			rollbackTransaction();
+			throw;
+		}
+		retryable_transaction = false;
+
+		//A busy commit can be retried without running f again
+		endTransaction();
+		++transaction_stats.commits;
+		return;
+	}
+}
+
+TransactionStats Database::getTransactionStats()
+{
+	return transaction_stats;
 }
 
 DatabaseQuery Database::prepare(std::string pQuery)
 {
+	return prepare(std::move(pQuery), PrepareFlag_None);
+}
+
+DatabaseQuery Database::prepare(std::string pQuery, int flags)
+{
+	if (attach_pending)
+	{
+		attachDBs();
+	}
+
+	unsigned int prep_flags = 0;
+	if (flags & PrepareFlag_Persistent)
+		prep_flags |= SQLITE_PREPARE_PERSISTENT;
+	if (flags & PrepareFlag_NoVtab)
+		prep_flags |= SQLITE_PREPARE_NO_VTAB;
+
 	int prepare_tries = 0;
 #ifdef SQLITE_PREPARE_RETRIES
 	prepare_tries = SQLITE_PREPARE_RETRIES;
@@ -186,7 +591,7 @@ DatabaseQuery Database::prepare(std::string pQuery)
 	const char* tail;
 	int err;
 	bool reset_busy = false;
-	while((err=sqlite3_prepare_v2(db, pQuery.c_str(), (int)pQuery.size(), &prepared_statement, &tail) )==SQLITE_LOCKED 
+	while((err=sqlite3_prepare_v3(db, pQuery.c_str(), (int)pQuery.size(), prep_flags, &prepared_statement, &tail) )==SQLITE_LOCKED 
 		|| err==SQLITE_BUSY
 		|| err==SQLITE_PROTOCOL
 		|| (err!=SQLITE_OK && prepare_tries>0) )
@@ -200,7 +605,7 @@ DatabaseQuery Database::prepare(std::string pQuery)
 		else if(err== SQLITE_BUSY
 			|| err==SQLITE_PROTOCOL)
 		{
-			sqlite3_busy_timeout(db, 10000);
+			setBusyTimeout(10000);
 			reset_busy = true;
 		}
 		else
@@ -211,7 +616,13 @@ DatabaseQuery Database::prepare(std::string pQuery)
 
 	if(reset_busy)
 	{
-		sqlite3_busy_timeout(db, 50);
+		setBusyTimeout(50);
+	}
+
+	if( err!=SQLITE_OK && (flags & PrepareFlag_Optional) )
+	{
+		getDatabaseLogger()->Log("Could not prepare Query ["+pQuery+"] yet: "+sqlite3_errmsg(db), LL_DEBUG);
+		return DatabaseQuery();
 	}
 
 	if( err!=SQLITE_OK )
@@ -236,7 +647,12 @@ sqlite3 *Database::getDatabase(void)
 
 bool Database::isInTransaction(void)
 {
-	return in_transaction;
+	return transaction_depth > 0;
+}
+
+size_t Database::getTransactionDepth()
+{
+	return transaction_depth;
 }
 
 std::string Database::getEngineName(void)
@@ -246,24 +662,29 @@ std::string Database::getEngineName(void)
 
 void Database::attachDBs(void)
 {
+	attach_pending = false;
+	execScript(getAttachScript());
+}
+
+std::string Database::getAttachScript()
+{
+	std::string ret;
 	for(size_t i=0;i<attached_dbs.size();++i)
 	{
-		write("ATTACH DATABASE '"+attached_dbs[i].first+"' AS "+attached_dbs[i].second);
-
-		str_map::const_iterator it = params.find("synchronous");
-		if (it != params.end())
-		{
-			write("PRAGMA "+ attached_dbs[i].second+".synchronous=" + it->second);
-		}
-		else
-		{
-			write("PRAGMA "+ attached_dbs[i].second+".synchronous=NORMAL");
-		}
+		ret += "ATTACH DATABASE '"+attached_dbs[i].first+"' AS "+attached_dbs[i].second+";\n";
+		ret += getSettingsScript(attached_dbs[i].second, true, false);
 	}
+	return ret;
 }
 
 void Database::detachDBs(void)
 {
+	if (attach_pending)
+	{
+		attach_pending = false;
+		return;
+	}
+
 	for(size_t i=0;i<attached_dbs.size();++i)
 	{
 		write("DETACH DATABASE "+attached_dbs[i].second);
@@ -280,6 +701,509 @@ int Database::getLastChanges()
 	return sqlite3_changes(db);
 }
 
+void Database::setBusyTimeout(int timeout_ms)
+{
+	busy_state->timeout_ms = timeout_ms;
+	sqlite3_busy_handler(db, BusyHandler::handle, busy_state.get());
+}
+
+uint64_t Database::getBusyWaits()
+{
+	if (!busy_state || !busy_state->signal)
+		return 0;
+	return busy_state->signal->waits;
+}
+
+void Database::notifyLockReleased()
+{
+	if (busy_state && busy_state->signal)
+		busy_state->signal->cond.notify_all();
+}
+
+namespace sqlgen
+{
+	struct DatabaseHooks
+	{
+		static void update(void* p, int op, const char* db_name, const char* table, sqlite3_int64 rowid)
+		{
+			Database* db = static_cast<Database*>(p);
+			++db->reported_changes;
+			db->notifyChange(db_name, table);
+		}
+
+		static void rollback(void* p)
+		{
+			static_cast<Database*>(p)->notifyChange(nullptr, nullptr);
+		}
+	};
+}
+
+size_t Database::addChangeListener(ChangeCallback callback)
+{
+	if (change_listeners.empty())
+		installHooks();
+
+	size_t id = next_change_listener_id++;
+	change_listeners.push_back(std::make_pair(id, std::move(callback)));
+	return id;
+}
+
+void Database::removeChangeListener(size_t id)
+{
+	for (auto it = change_listeners.begin(); it != change_listeners.end(); ++it)
+	{
+		if (it->first == id)
+		{
+			change_listeners.erase(it);
+			break;
+		}
+	}
+
+	if (change_listeners.empty() && db != nullptr)
+	{
+		sqlite3_update_hook(db, nullptr, nullptr);
+		sqlite3_rollback_hook(db, nullptr, nullptr);
+	}
+}
+
+void Database::installHooks()
+{
+	sqlite3_update_hook(db, DatabaseHooks::update, this);
+	sqlite3_rollback_hook(db, DatabaseHooks::rollback, this);
+	checked_total_changes = sqlite3_total_changes64(db);
+	checked_reported_changes = reported_changes;
+}
+
+void Database::checkUnreportedChanges()
+{
+	int64_t total_changes = sqlite3_total_changes64(db);
+	//Both count changes by triggers but not rows deleted by REPLACE. A failed statement may have reported rows it did not count
+	bool unreported = total_changes - checked_total_changes != reported_changes - checked_reported_changes;
+	checked_total_changes = total_changes;
+	checked_reported_changes = reported_changes;
+	if (unreported)
+		notifyChange(nullptr, nullptr);
+}
+
+void Database::notifyChange(const char* db_name, const char* table)
+{
+	for (auto& it : change_listeners)
+	{
+		it.second(db_name, table);
+	}
+}
+
+void Database::addReaders(size_t n)
+{
+	if (bulk_load)
+		throw BulkLoadError("Cannot add readers during bulk load");
+
+	const char* fn = sqlite3_db_filename(db, "main");
+	if (fn == nullptr || *fn == 0)
+	{
+		throw DatabaseOpenError("Cannot add readers to in-memory or temporary database");
+	}
+	std::string file = fn;
+
+	if (!reader_pool)
+		reader_pool.reset(new ReaderPool);
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		std::unique_ptr<Database> reader(new Database(file, attached_dbs, std::string::npos, params));
+		reader->write("PRAGMA query_only=1");
+		if (reader->settings != settings)
+		{
+			reader->profile = profile;
+			reader->settings = settings;
+			reader->execScript(reader->getSettingsScript("main", false, true));
+		}
+
+		std::lock_guard<std::mutex> lock(reader_pool->mutex);
+		reader_pool->readers.push_back(std::move(reader));
+		reader_pool->free_slots.push_back(reader_pool->readers.size());
+	}
+	reader_pool->cond.notify_all();
+}
+
+size_t Database::getReaderCount()
+{
+	if (!reader_pool)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(reader_pool->mutex);
+	return reader_pool->readers.size();
+}
+
+Database& Database::getReader(size_t idx)
+{
+	std::lock_guard<std::mutex> lock(reader_pool->mutex);
+	return *reader_pool->readers.at(idx);
+}
+
+void Database::updateTransactionOwner()
+{
+	if (!sqlite3_get_autocommit(db)
+		&& transaction_thread.load(std::memory_order_relaxed) != std::this_thread::get_id())
+	{
+		transaction_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+	}
+}
+
+ReadConnection Database::acquireReader()
+{
+	//Reads in a transaction of the thread (also one started with write("BEGIN")) have to see its changes
+	if (!reader_pool
+		|| (!sqlite3_get_autocommit(db) && transaction_thread.load(std::memory_order_relaxed) == std::this_thread::get_id()) )
+	{
+		return ReadConnection(*this, 0, nullptr);
+	}
+
+	std::unique_lock<std::mutex> lock(reader_pool->mutex);
+	if (reader_pool->readers.empty())
+	{
+		return ReadConnection(*this, 0, nullptr);
+	}
+
+	while (reader_pool->free_slots.empty())
+	{
+		reader_pool->cond.wait(lock);
+	}
+
+	size_t slot = reader_pool->free_slots.back();
+	reader_pool->free_slots.pop_back();
+	return ReadConnection(*reader_pool->readers[slot - 1], slot, this);
+}
+
+void Database::releaseReader(size_t slot)
+{
+	{
+		std::lock_guard<std::mutex> lock(reader_pool->mutex);
+		reader_pool->free_slots.push_back(slot);
+	}
+	reader_pool->cond.notify_one();
+}
+
+std::vector<std::string> Database::getProfileNames()
+{
+	std::vector<std::string> ret;
+	for (auto& it : getTuningProfiles())
+	{
+		ret.push_back(it.first);
+	}
+	return ret;
+}
+
+void Database::setProfile(const std::string& name)
+{
+	auto profile_settings = getTuningProfiles().find(name);
+	if (profile_settings == getTuningProfiles().end())
+	{
+		throw ProfileError("Unknown tuning profile [" + name + "]");
+	}
+
+	profile = name;
+	settings = profile_settings->second;
+	execScript(getProfileScript(true));
+
+	//Readers share the journal mode of the writer
+	for (size_t i = 0; i < getReaderCount(); ++i)
+	{
+		Database& reader = getReader(i);
+		reader.profile = profile;
+		reader.settings = settings;
+		reader.execScript(reader.getProfileScript(false));
+	}
+}
+
+std::string Database::getProfileScript(bool set_journal_mode)
+{
+	std::string ret = getSettingsScript("main", set_journal_mode, true);
+	if (!attach_pending)
+	{
+		for (size_t i = 0; i < attached_dbs.size(); ++i)
+		{
+			ret += getSettingsScript(attached_dbs[i].second, set_journal_mode, false);
+		}
+	}
+	return ret;
+}
+
+std::string Database::getProfile()
+{
+	return profile;
+}
+
+str_map Database::getEffectiveSettings()
+{
+	str_map ret;
+	ret["profile"] = profile;
+
+	db_results dbs = read("PRAGMA database_list");
+	for (auto& it : dbs)
+	{
+		const std::string& name = it["name"];
+		if (name == "temp")
+			continue;
+
+		for (const char* key : { "journal_mode", "synchronous", "cache_size", "mmap_size", "page_size" })
+		{
+			db_results res = read("PRAGMA \"" + name + "\"." + key);
+			if (!res.empty() && !res[0].empty())
+				ret[name + "." + key] = res[0].begin()->second;
+		}
+	}
+
+	for (const char* key : c_connection_settings)
+	{
+		db_results res = read(std::string("PRAGMA ") + key);
+		if (!res.empty() && !res[0].empty())
+			ret[key] = res[0].begin()->second;
+	}
+	return ret;
+}
+
+std::string Database::getSettingsScript(const std::string& schema, bool set_journal_mode, bool connection_settings)
+{
+	std::string ret;
+	for (const char* key : c_schema_settings)
+	{
+		auto it = settings.find(key);
+		if (it == settings.end()
+			|| (!set_journal_mode && std::string(key) == "journal_mode") )
+			continue;
+
+		ret += "PRAGMA " + schema + "." + key + "=" + it->second + ";\n";
+	}
+
+	if (connection_settings)
+	{
+		for (const char* key : c_connection_settings)
+		{
+			auto it = settings.find(key);
+			if (it != settings.end())
+				ret += std::string("PRAGMA ") + key + "=" + it->second + ";\n";
+		}
+	}
+	return ret;
+}
+
+void Database::execScript(const std::string& script)
+{
+	const char* tail = script.c_str();
+	while (*tail != 0)
+	{
+		while (*tail == '\n' || *tail == ' ')
+			++tail;
+
+		const char* start = tail;
+		sqlite3_stmt* stmt = nullptr;
+		if (sqlite3_prepare_v2(db, start, -1, &stmt, &tail) != SQLITE_OK)
+		{
+			const char* end = strchr(start, ';');
+			getDatabaseLogger()->Log("Error preparing Query [" + (end != nullptr ? std::string(start, end) : std::string(start))
+				+ "]: " + sqlite3_errmsg(db), LL_ERROR);
+			if (end == nullptr)
+				return;
+			tail = end + 1;
+			continue;
+		}
+
+		if (stmt == nullptr)
+			continue;
+
+		int rc;
+		while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		{
+			if (sqlite3_column_count(stmt) != 1
+				|| std::string(sqlite3_column_name(stmt, 0)) != "journal_mode")
+				continue;
+
+			const char* journal_mode = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+			std::string curr = journal_mode != nullptr ? journal_mode : "";
+			if (strlower(curr) != strlower(settings["journal_mode"]) && curr != "memory")
+			{
+				getDatabaseLogger()->Log("Could not set journal mode to " + settings["journal_mode"]
+					+ ". Journal mode is " + curr + " Stmt: [" + sqlite3_sql(stmt) + "]", LL_WARNING);
+			}
+		}
+
+		if (rc != SQLITE_DONE)
+		{
+			getDatabaseLogger()->Log("Error in Database::execScript - " + std::string(sqlite3_errmsg(db)) + " Stmt: [" + sqlite3_sql(stmt) + "]", LL_ERROR);
+		}
+		sqlite3_finalize(stmt);
+	}
+}
+
+std::chrono::microseconds Database::getOpenDuration()
+{
+	return open_duration;
+}
+
+void Database::beginBulkLoad(const BulkLoadOptions& options)
+{
+	if (bulk_load)
+		throw BulkLoadError("Bulk load already started");
+	if (!sqlite3_get_autocommit(db))
+		throw BulkLoadError("Cannot start bulk load in a transaction");
+	if (getReaderCount() > 0)
+		throw BulkLoadError("Cannot start bulk load with open readers");
+
+	std::string journal_mode = strlower(options.journal_mode);
+	if (journal_mode != "off" && journal_mode != "memory")
+		throw BulkLoadError("Invalid bulk load journal mode [" + options.journal_mode + "]");
+
+	std::unique_ptr<BulkLoadState> state(new BulkLoadState);
+	state->journal_mode = read("PRAGMA main.journal_mode")[0]["journal_mode"];
+	state->synchronous = read("PRAGMA main.synchronous")[0]["synchronous"];
+	state->cache_size = read("PRAGMA main.cache_size")[0]["cache_size"];
+
+	db_results res = read("PRAGMA main.journal_mode=" + journal_mode);
+	if (res.empty() || strlower(res[0]["journal_mode"]) != journal_mode)
+	{
+		throw BulkLoadError("Could not switch to journal mode " + journal_mode
+			+ (res.empty() ? std::string() : ". Journal mode is " + res[0]["journal_mode"]));
+	}
+
+	if (options.crash_safe)
+	{
+		const char* fn = sqlite3_db_filename(db, "main");
+		if (fn == nullptr || *fn == 0)
+		{
+			write("PRAGMA main.journal_mode=" + state->journal_mode);
+			throw BulkLoadError("Crash safe bulk load needs a file database");
+		}
+
+		//Other connections must not restore the copy while this one is loading
+		state->owner_lock = lockBulkLoad(fn);
+		if (state->owner_lock == nullptr)
+		{
+			write("PRAGMA main.journal_mode=" + state->journal_mode);
+			throw BulkLoadError("Bulk load of [" + std::string(fn) + "] is already running");
+		}
+
+		//Copy with the backup API, so the copy is consistent. Visible under its final name only once complete
+		state->backup_file = std::string(fn) + c_bulk_load_backup_suffix;
+		std::string tmp_file = state->backup_file + ".new";
+		sqlite3* backup_db = nullptr;
+		int rc = sqlite3_open_v2(tmp_file.c_str(), &backup_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+		if (rc == SQLITE_OK)
+		{
+			sqlite3_backup* backup = sqlite3_backup_init(backup_db, "main", db, "main");
+			if (backup != nullptr)
+			{
+				sqlite3_backup_step(backup, -1);
+				sqlite3_backup_finish(backup);
+			}
+			rc = sqlite3_errcode(backup_db);
+		}
+		std::string errmsg = backup_db != nullptr ? sqlite3_errmsg(backup_db) : "out of memory";
+		sqlite3_close(backup_db);
+
+		std::error_code ec;
+		if (rc == SQLITE_OK)
+			std::filesystem::rename(tmp_file, state->backup_file, ec);
+
+		if (rc != SQLITE_OK || ec)
+		{
+			std::filesystem::remove(tmp_file, ec);
+			write("PRAGMA main.journal_mode=" + state->journal_mode);
+			throw BulkLoadError("Could not copy db to [" + state->backup_file + "]: " + (rc != SQLITE_OK ? errmsg : ec.message()));
+		}
+	}
+
+	write("PRAGMA main.synchronous=OFF");
+	write("PRAGMA main.cache_size=-" + std::to_string(options.cache_size_kib));
+
+	if (options.drop_indexes)
+	{
+		//Indexes without sql are created for UNIQUE and PRIMARY KEY constraints and cannot be dropped
+		db_results indexes = read("SELECT name, tbl_name, sql FROM main.sqlite_master WHERE type='index' AND sql IS NOT NULL");
+		for (db_single_result& index : indexes)
+		{
+			if (!options.index_tables.empty()
+				&& std::find(options.index_tables.begin(), options.index_tables.end(), index["tbl_name"]) == options.index_tables.end())
+				continue;
+
+			write("DROP INDEX main.\"" + index["name"] + "\"");
+			state->indexes.push_back(std::make_pair(index["name"], index["sql"]));
+		}
+	}
+
+	bulk_load = std::move(state);
+}
+
+void Database::endBulkLoad()
+{
+	if (!bulk_load)
+		throw BulkLoadError("No bulk load started");
+
+	for (auto& index : bulk_load->indexes)
+	{
+		write(index.second);
+	}
+
+	write("PRAGMA main.cache_size=" + bulk_load->cache_size);
+	write("PRAGMA main.journal_mode=" + bulk_load->journal_mode);
+
+	//Data written with synchronous=OFF is synced by the next commit (fsync covers the whole file)
+	write("PRAGMA main.synchronous=FULL");
+	std::string user_version = read("PRAGMA main.user_version")[0]["user_version"];
+	write("PRAGMA main.user_version=" + user_version);
+	read("PRAGMA main.wal_checkpoint(TRUNCATE)");
+	write("PRAGMA main.synchronous=" + bulk_load->synchronous);
+
+	if (!bulk_load->backup_file.empty())
+	{
+		std::error_code ec;
+		std::filesystem::remove(bulk_load->backup_file, ec);
+		if (ec)
+		{
+			getDatabaseLogger()->Log("Could not remove bulk load copy [" + bulk_load->backup_file + "]: " + ec.message(), LL_ERROR);
+		}
+	}
+
+	bulk_load.reset();
+}
+
+bool Database::isInBulkLoad()
+{
+	return bulk_load != nullptr;
+}
+
+void Database::createFunction(const std::string& name, int nargs, int flags, void* user_data,
+	FunctionCallback func, FunctionCallback step, FunctionFinalCallback final,
+	FunctionFinalCallback value, FunctionCallback inverse, void (*destroy)(void*))
+{
+	int text_rep = SQLITE_UTF8;
+	if (flags & FunctionFlag_Deterministic)
+		text_rep |= SQLITE_DETERMINISTIC;
+	if (flags & FunctionFlag_Innocuous)
+		text_rep |= SQLITE_INNOCUOUS;
+	if (flags & FunctionFlag_DirectOnly)
+		text_rep |= SQLITE_DIRECTONLY;
+
+	int rc;
+	if (value != nullptr)
+	{
+		rc = sqlite3_create_window_function(db, name.c_str(), nargs, text_rep, user_data,
+			step, final, value, inverse, destroy);
+	}
+	else
+	{
+		rc = sqlite3_create_function_v2(db, name.c_str(), nargs, text_rep, user_data,
+			func, step, final, destroy);
+	}
+
+	if (rc != SQLITE_OK)
+	{
+		const auto msg = "Error registering function [" + name + "]: " + sqlite3_errmsg(db);
+		getDatabaseLogger()->Log(msg, LL_ERROR);
+		throw FunctionError(msg);
+	}
+}
+
 std::string Database::getTempDirectoryPath()
 {
 	char* tmpfn = NULL;
@@ -293,4 +1217,84 @@ std::string Database::getTempDirectoryPath()
 	{
 		return std::string();
 	}
-}
\ No newline at end of file
+}
+
+ChunkedWriteTransaction::ChunkedWriteTransaction(Database& db, ChunkedTransactionOptions options)
+	: db(&db), options(options)
+{
+	begin();
+}
+
+ChunkedWriteTransaction::~ChunkedWriteTransaction()
+{
+	end();
+}
+
+void ChunkedWriteTransaction::begin()
+{
+	db->beginWriteTransaction();
+	rows = 0;
+	bytes = 0;
+	busy_waits = db->getBusyWaits();
+	chunk_start = std::chrono::steady_clock::now();
+}
+
+bool ChunkedWriteTransaction::add(size_t row_bytes)
+{
+	if (db == nullptr)
+		return false;
+
+	++rows;
+	bytes += row_bytes;
+
+	if (options.yield_to_waiters && db->getBusyWaits() != busy_waits)
+	{
+		++yields;
+		commitChunk(true, true);
+		return true;
+	}
+
+	if ((options.max_rows > 0 && rows >= options.max_rows)
+		|| (options.max_bytes > 0 && bytes >= options.max_bytes)
+		|| (options.max_duration.count() > 0 && std::chrono::steady_clock::now() - chunk_start >= options.max_duration))
+	{
+		commitChunk(true, false);
+		return true;
+	}
+	return false;
+}
+
+void ChunkedWriteTransaction::commit()
+{
+	if (db != nullptr)
+		commitChunk(true, false);
+}
+
+void ChunkedWriteTransaction::rollback()
+{
+	if (db != nullptr)
+		db->rollbackTransaction();
+	db = nullptr;
+}
+
+void ChunkedWriteTransaction::end()
+{
+	if (db != nullptr)
+		commitChunk(false, false);
+	db = nullptr;
+}
+
+void ChunkedWriteTransaction::commitChunk(bool restart, bool yield)
+{
+	auto start = std::chrono::steady_clock::now();
+	db->endTransaction();
+	commit_latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+
+	if (!restart)
+		return;
+
+	if (yield && options.yield_time.count() > 0)
+		std::this_thread::sleep_for(options.yield_time);
+
+	begin();
+}
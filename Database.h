@@ -1,17 +1,31 @@
 #pragma once
 
 #include <stdexcept>
+#include <algorithm>
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <map>
 #include <memory>
 #include <optional>
+#include <type_traits>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <utility>
+#include "DatabaseFunction.h"
 
 struct sqlite3;
 
 namespace sqlgen
 {
 	class DatabaseQuery;
+	class ReadConnection;
+	struct DatabaseHooks;
+	struct ReaderPool;
+	struct BulkLoadState;
+	struct BusyState;
 
 	const int c_sqlite_busy_timeout_default = 10000; //10 seconds
 
@@ -31,6 +45,80 @@ namespace sqlgen
 		using std::runtime_error::runtime_error;
 	};
 
+	class FunctionError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	class ProfileError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	class BulkLoadError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	//Statement in Database::transact() got SQLITE_BUSY, or transact() gave up retrying
+	class TransactionConflict : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	struct TransactionPolicy
+	{
+		//Give up and throw TransactionConflict after this many conflicts
+		size_t max_retries = 20;
+		//Start the transaction with BEGIN IMMEDIATE after this many conflicts
+		size_t immediate_after = 3;
+		//Randomized exponential backoff between attempts
+		std::chrono::milliseconds initial_backoff{ 1 };
+		std::chrono::milliseconds max_backoff{ 100 };
+	};
+
+	struct TransactionStats
+	{
+		uint64_t commits = 0;
+		//Attempts rolled back because of SQLITE_BUSY/SQLITE_BUSY_SNAPSHOT
+		uint64_t conflicts = 0;
+		//Attempts started with BEGIN IMMEDIATE
+		uint64_t immediate = 0;
+		//transact() calls that gave up
+		uint64_t failures = 0;
+		//Time spent in rolled back attempts and backoff
+		std::chrono::microseconds wasted{ 0 };
+	};
+
+	struct BulkLoadOptions
+	{
+		//Journal mode during the load, "OFF" or "MEMORY"
+		std::string journal_mode = "OFF";
+		//Page cache size during the load in KiB
+		int64_t cache_size_kib = 256 * 1024;
+		//Drop secondary indexes and recreate them in endBulkLoad()
+		bool drop_indexes = false;
+		//Only drop indexes of these tables (empty: all tables of the main database)
+		std::vector<std::string> index_tables;
+		//Keep a copy of the database file that is swapped back if the load does not finish
+		bool crash_safe = true;
+	};
+
+	enum PrepareFlags
+	{
+		PrepareFlag_None = 0,
+		//Statement is long lived. SQLite does not use lookaside memory for it
+		PrepareFlag_Persistent = 1,
+		//Fail if statement uses virtual tables
+		PrepareFlag_NoVtab = 2,
+		//Return unprepared query instead of throwing PrepareError
+		PrepareFlag_Optional = 4
+	};
+
 	class Database
 	{
 	public:
@@ -45,18 +133,27 @@ namespace sqlgen
 		virtual db_results read(const std::string& query);
 		virtual void write(const std::string& query);
 
+		/**
+		* Transactions nest. Only the outermost begin starts a transaction,
+		* inner ones create a SAVEPOINT which endTransaction() releases and
+		* rollbackTransaction() rolls back, without committing or rolling back
+		* the outer transaction.
+		*/
 		virtual void beginReadTransaction();
 		virtual void beginWriteTransaction();
 		virtual void endTransaction();
 		virtual void rollbackTransaction();
 
 		virtual DatabaseQuery prepare(std::string pQuery);
+		virtual DatabaseQuery prepare(std::string pQuery, int flags);
 
 		virtual long long int getLastInsertID();
 
 		sqlite3* getDatabase();
 
 		bool isInTransaction();
+		//Number of nested begin*Transaction() calls without end or rollback
+		size_t getTransactionDepth();
 
 		virtual std::string getEngineName();
 
@@ -67,17 +164,294 @@ namespace sqlgen
 
 		virtual int getLastChanges();
 
+		/**
+		* Waits up to timeout_ms for locks held by other connections. Replaces
+		* sqlite3_busy_timeout(): connections to the same file in this process
+		* are woken up as soon as one of them ends a transaction instead of
+		* sleeping until their next retry, and waits are counted.
+		*/
+		void setBusyTimeout(int timeout_ms);
+
+		//Number of times a connection to the same database file in this process started waiting for a lock
+		uint64_t getBusyWaits();
+
 		virtual std::string getTempDirectoryPath();
 
+		/**
+		* Registers a C++ callable as SQL scalar function. Argument and
+		* result types are deduced from the callable (int, int64_t, bool,
+		* double, std::string, std::string_view, BlobView or std::optional
+		* of those for NULL). std::string_view and BlobView arguments point
+		* into SQLite's memory and are only valid during the call.
+		* Exceptions are returned as SQL errors.
+		*/
+		template<typename F>
+		void registerFunction(const std::string& name, F func, int flags = FunctionFlag_None)
+		{
+			typedef function_detail::FunctionTraits<F> traits;
+			createFunction(name, traits::arity, flags, new F(std::move(func)),
+				function_detail::scalarFunc<F>, nullptr, nullptr, nullptr, nullptr,
+				function_detail::destroy<F>);
+		}
+
+		/**
+		* Registers aggregate function. A is default constructed per group
+		* and needs step(args...) and final() methods.
+		*/
+		template<typename A>
+		void registerAggregate(const std::string& name, int flags = FunctionFlag_None)
+		{
+			typedef function_detail::FunctionTraits<decltype(&A::step)> traits;
+			createFunction(name, traits::arity, flags, nullptr,
+				nullptr, function_detail::aggregateStep<A>, function_detail::aggregateFinal<A>,
+				nullptr, nullptr, nullptr);
+		}
+
+		/**
+		* Registers aggregate window function. In addition to the aggregate
+		* methods A needs value() and inverse(args...).
+		*/
+		template<typename A>
+		void registerWindow(const std::string& name, int flags = FunctionFlag_None)
+		{
+			typedef function_detail::FunctionTraits<decltype(&A::step)> traits;
+			createFunction(name, traits::arity, flags, nullptr,
+				nullptr, function_detail::aggregateStep<A>, function_detail::aggregateFinal<A>,
+				function_detail::aggregateValue<A>, function_detail::aggregateInverse<A>, nullptr);
+		}
+
+		typedef std::function<void(const char* db_name, const char* table)> ChangeCallback;
+
+		/**
+		* Calls callback after a row of a table was changed through this
+		* connection, with database and table name. After a rollback it is
+		* called with nullptr for both. Changes by other connections are not
+		* reported. Returns an id for removeChangeListener().
+		*/
+		size_t addChangeListener(ChangeCallback callback);
+		void removeChangeListener(size_t id);
+
+		/**
+		* SQLite does not report every change per row (DELETE without WHERE,
+		* WITHOUT ROWID tables, virtual tables). Compares the number of changes
+		* of the connection with the reported ones and calls the change
+		* listeners with nullptr if some were not reported.
+		*/
+		void checkUnreportedChanges();
+
+		/**
+		* Opens n additional connections to the same database file that
+		* only allow reads. Generated read-only functions run on them, while
+		* writes stay on this connection. Functions registered with
+		* registerFunction() have to be registered on getReader() as well.
+		* Throws BulkLoadError during a bulk load.
+		*/
+		void addReaders(size_t n);
+
+		size_t getReaderCount();
+		Database& getReader(size_t idx);
+
+		/**
+		* Returns a free reader connection, waiting if all are in use. Returns
+		* this connection if there are no readers or if the calling thread
+		* has a transaction open on it, so it sees its own changes.
+		*/
+		ReadConnection acquireReader();
+
+		/**
+		* Switches to a named tuning profile ("oltp", "bulk_load", "read_mostly",
+		* "analytics" or "low_memory"). Sets journal_mode, synchronous, cache_size,
+		* mmap_size, temp_store, cache_spill, threads and wal_autocheckpoint of
+		* this connection, its attached databases and readers. A profile can also
+		* be selected with the "profile" open parameter; other parameters then
+		* override its settings. Throws ProfileError for unknown profiles.
+		*/
+		void setProfile(const std::string& name);
+		std::string getProfile();
+		static std::vector<std::string> getProfileNames();
+
+		/**
+		* Returns the current value of the tuned settings (and page_size).
+		* Per-database settings are prefixed with the database name, e.g.
+		* "main.journal_mode".
+		*/
+		str_map getEffectiveSettings();
+
+		/**
+		* Time the constructor took to open and set up the connection. With
+		* the "lazy_attach" parameter set to "1" attached databases are only
+		* attached before the first statement is prepared and are not included.
+		*/
+		std::chrono::microseconds getOpenDuration();
+
+		/**
+		* Runs f in a deferred transaction and commits it. If a statement gets
+		* SQLITE_BUSY (e.g. SQLITE_BUSY_SNAPSHOT when a read transaction has to
+		* become a write transaction after another connection committed) it
+		* throws TransactionConflict instead of retrying the statement, the
+		* transaction is rolled back and f is run again after a backoff.
+		* After policy.immediate_after conflicts it starts with BEGIN IMMEDIATE.
+		* f must not have side effects outside of the database. Other
+		* exceptions roll back and are rethrown. Nested calls run in a
+		* savepoint and conflicts retry the outermost transact().
+		*/
+		template<typename F>
+		auto transact(F f, TransactionPolicy policy = TransactionPolicy()) -> decltype(f())
+		{
+			typedef decltype(f()) R;
+			if constexpr (std::is_void_v<R>)
+			{
+				runTransaction(f, policy);
+			}
+			else
+			{
+				std::optional<R> ret;
+				runTransaction([&]() { ret.emplace(f()); }, policy);
+				return std::move(*ret);
+			}
+		}
+
+		TransactionStats getTransactionStats();
+
+		//Statements throw TransactionConflict on SQLITE_BUSY (inside transact())
+		bool inRetryableTransaction() {
+			return retryable_transaction;
+		}
+
+		//Records the calling thread as owner of an open transaction after a statement ran. acquireReader() returns this connection to it
+		void updateTransactionOwner();
+
+		/**
+		* Switches the main database to a fast, non-durable mode for loading
+		* large amounts of data: journal_mode OFF or MEMORY, synchronous OFF
+		* and a large cache. With crash_safe a copy of the database file is
+		* made first; if the process exits before endBulkLoad() the copy is
+		* swapped back when the database is opened the next time. While the
+		* load runs, a lock on <file>-bulkload.lock keeps other connections
+		* from swapping it back. Needs a file database without open
+		* transaction or readers.
+		*/
+		void beginBulkLoad(const BulkLoadOptions& options = BulkLoadOptions());
+
+		/**
+		* Recreates dropped indexes, restores the previous settings, syncs the
+		* database file and removes the copy.
+		*/
+		void endBulkLoad();
+
+		bool isInBulkLoad();
+
+		/**
+		* Sorts a batch by key and inserts it in one write transaction.
+		* Inserting in primary key order appends to the table B-tree instead
+		* of splitting pages all over it.
+		*/
+		template<typename T, typename K, typename F>
+		void insertSorted(std::vector<T>& batch, K key, F insert)
+		{
+			std::sort(batch.begin(), batch.end(), [&key](const T& a, const T& b) {
+				return key(a) < key(b);
+			});
+
+			beginWriteTransaction();
+			try
+			{
+				for (T& row : batch)
+				{
+					insert(row);
+				}
+			}
+			catch (...)
+			{
+				rollbackTransaction();
+				throw;
+			}
+			endTransaction();
+		}
+
 	private:
+		friend struct DatabaseHooks;
+		friend class ReadConnection;
+
+		void releaseReader(size_t slot);
+
+		std::string getSettingsScript(const std::string& schema, bool set_journal_mode, bool connection_settings);
+		std::string getProfileScript(bool set_journal_mode);
+		std::string getAttachScript();
+		void execScript(const std::string& script);
+
+		void installHooks();
+		void notifyChange(const char* db_name, const char* table);
+		bool beginNestedTransaction();
+		void notifyLockReleased();
+		void runTransaction(const std::function<void()>& f, const TransactionPolicy& policy);
+
+		typedef void (*FunctionCallback)(sqlite3_context*, int, sqlite3_value**);
+		typedef void (*FunctionFinalCallback)(sqlite3_context*);
+
+		void createFunction(const std::string& name, int nargs, int flags, void* user_data,
+			FunctionCallback func, FunctionCallback step, FunctionFinalCallback final,
+			FunctionFinalCallback value, FunctionCallback inverse, void (*destroy)(void*));
+
 		bool openInternal(std::string pFile, std::vector<std::pair<std::string, std::string> > attach,
 			size_t allocation_chunk_size, str_map p_params);
 
 		sqlite3* db = nullptr;
-		bool in_transaction = false;
+		size_t transaction_depth = 0;
+		bool retryable_transaction = false;
+		TransactionStats transaction_stats;
+		//Thread that ran the last statement of the open transaction. Read by acquireReader() on other threads
+		std::atomic<std::thread::id> transaction_thread;
 
 		std::vector<std::pair<std::string, std::string> > attached_dbs;
 		str_map params;
+		str_map settings;
+		std::string profile;
+		bool attach_pending = false;
+		std::chrono::microseconds open_duration{ 0 };
+
+		std::vector<std::pair<size_t, ChangeCallback> > change_listeners;
+		size_t next_change_listener_id = 0;
+		int64_t reported_changes = 0;
+		int64_t checked_total_changes = 0;
+		int64_t checked_reported_changes = 0;
+
+		std::unique_ptr<ReaderPool> reader_pool;
+		std::unique_ptr<BulkLoadState> bulk_load;
+		std::unique_ptr<BusyState> busy_state;
+	};
+
+	/**
+	* Connection used by a generated read-only function. Slot 0 is the
+	* writer, 1..n are the readers. Returns the reader to the pool when
+	* destroyed.
+	*/
+	class ReadConnection
+	{
+	public:
+		ReadConnection(Database& conn, size_t slot, Database* pool)
+			: conn(&conn), slot(slot), pool(pool) {}
+		~ReadConnection() {
+			if (pool != nullptr) pool->releaseReader(slot);
+		}
+		ReadConnection(const ReadConnection&) = delete;
+		ReadConnection(ReadConnection&& other)
+			: conn(other.conn), slot(other.slot), pool(std::exchange(other.pool, nullptr)) {}
+		ReadConnection& operator=(const ReadConnection&) = delete;
+		ReadConnection& operator=(ReadConnection&&) = delete;
+
+		Database& database() {
+			return *conn;
+		}
+
+		size_t getSlot() {
+			return slot;
+		}
+
+	private:
+		Database* conn;
+		size_t slot;
+		Database* pool;
 	};
 
 	class ScopedAutoCommitWriteTransaction
@@ -166,6 +540,74 @@ namespace sqlgen
 		Database* db;
 	};
 
+	struct ChunkedTransactionOptions
+	{
+		//Commit after this many rows (0 = no limit)
+		size_t max_rows = 10000;
+		//Commit after this many bytes were passed to add() (0 = no limit)
+		size_t max_bytes = 16 * 1024 * 1024;
+		//Commit after the transaction was open this long (0 = no limit)
+		std::chrono::milliseconds max_duration{ 500 };
+		//Commit early if another connection to the database in this process waits for a lock
+		bool yield_to_waiters = true;
+		//Sleep after such a commit, so the waiting connection gets the lock
+		std::chrono::milliseconds yield_time{ 1 };
+	};
+
+	/**
+	* Write transaction for ingest loops. add() is called after each row and
+	* commits and starts a new transaction once the row, byte or time limit
+	* of the chunk is reached or another connection waits for the lock, so
+	* a long load does not block checkpoints and other writers. Commits the
+	* last chunk when destroyed. Waiting connections in other processes are
+	* not detected, use max_duration for them.
+	*/
+	class ChunkedWriteTransaction
+	{
+	public:
+		ChunkedWriteTransaction(Database& db, ChunkedTransactionOptions options = ChunkedTransactionOptions());
+		~ChunkedWriteTransaction();
+
+		ChunkedWriteTransaction(const ChunkedWriteTransaction&) = delete;
+		ChunkedWriteTransaction& operator=(const ChunkedWriteTransaction&) = delete;
+
+		//Returns true if the chunk was committed
+		bool add(size_t bytes = 0);
+
+		//Commits the current chunk and starts the next one
+		void commit();
+		//Rolls back the current chunk. Committed chunks stay
+		void rollback();
+		void end();
+
+		size_t getChunks() {
+			return commit_latencies.size();
+		}
+
+		//Number of commits caused by waiting connections
+		size_t getYields() {
+			return yields;
+		}
+
+		//Duration of the commit of each chunk
+		const std::vector<std::chrono::microseconds>& getCommitLatencies() {
+			return commit_latencies;
+		}
+
+	private:
+		void begin();
+		void commitChunk(bool restart, bool yield);
+
+		Database* db;
+		ChunkedTransactionOptions options;
+		size_t rows = 0;
+		size_t bytes = 0;
+		uint64_t busy_waits = 0;
+		std::chrono::steady_clock::time_point chunk_start;
+		size_t yields = 0;
+		std::vector<std::chrono::microseconds> commit_latencies;
+	};
+
 	class ScopedSynchronous
 	{
 	public:
@@ -0,0 +1,154 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "DatabaseBlob.h"
+#include "Database.h"
+#include "sqlite/sqlite3.h"
+#include <istream>
+#include <ostream>
+#include <utility>
+#include <algorithm>
+
+using namespace sqlgen;
+
+DatabaseBlob::DatabaseBlob()
+	: db(nullptr), blob(nullptr), rowid(0), blob_size(0)
+{
+}
+
+DatabaseBlob::DatabaseBlob(Database& db, const std::string& table, const std::string& column, int64_t rowid,
+	bool writable, const std::string& db_name)
+	: db(&db), blob(nullptr), rowid(rowid), blob_size(0)
+{
+	int rc = sqlite3_blob_open(db.getDatabase(), db_name.c_str(), table.c_str(), column.c_str(),
+		rowid, writable ? 1 : 0, &blob);
+	if (rc != SQLITE_OK)
+	{
+		std::string errmsg = sqlite3_errmsg(db.getDatabase());
+		sqlite3_blob_close(blob);
+		blob = nullptr;
+		throw BlobError("Cannot open blob " + db_name + "." + table + "." + column + " rowid " + std::to_string(rowid) + ": " + errmsg);
+	}
+	blob_size = static_cast<size_t>(sqlite3_blob_bytes(blob));
+}
+
+DatabaseBlob::~DatabaseBlob()
+{
+	close();
+}
+
+DatabaseBlob::DatabaseBlob(DatabaseBlob&& other)
+	: db(other.db), blob(other.blob), rowid(other.rowid), blob_size(other.blob_size)
+{
+	other.blob = nullptr;
+	other.blob_size = 0;
+}
+
+DatabaseBlob& DatabaseBlob::operator=(DatabaseBlob&& other)
+{
+	if (this != &other)
+	{
+		close();
+		db = other.db;
+		blob = other.blob;
+		rowid = other.rowid;
+		blob_size = other.blob_size;
+		other.blob = nullptr;
+		other.blob_size = 0;
+	}
+	return *this;
+}
+
+void DatabaseBlob::checkOpen()
+{
+	if (blob == nullptr)
+		throw BlobError("Blob is not open");
+}
+
+void DatabaseBlob::checkChunkSize(size_t chunk_size)
+{
+	if (chunk_size == 0)
+		throw BlobError("Blob chunk size must not be 0");
+}
+
+size_t DatabaseBlob::read(char* buffer, size_t bsize, size_t offset)
+{
+	checkOpen();
+	if (offset >= blob_size)
+		return 0;
+
+	size_t read_size = (std::min)(bsize, blob_size - offset);
+	int rc = sqlite3_blob_read(blob, buffer, static_cast<int>(read_size), static_cast<int>(offset));
+	if (rc != SQLITE_OK)
+		throw BlobError("Error reading blob rowid " + std::to_string(rowid) + ": " + sqlite3_errstr(rc));
+	return read_size;
+}
+
+void DatabaseBlob::write(const char* buffer, size_t bsize, size_t offset)
+{
+	checkOpen();
+	if (offset + bsize > blob_size)
+		throw BlobError("Write past end of blob rowid " + std::to_string(rowid) + " (size " + std::to_string(blob_size) + ")");
+
+	int rc = sqlite3_blob_write(blob, buffer, static_cast<int>(bsize), static_cast<int>(offset));
+	if (rc != SQLITE_OK)
+		throw BlobError("Error writing blob rowid " + std::to_string(rowid) + ": " + sqlite3_errstr(rc));
+}
+
+void DatabaseBlob::reopen(int64_t rowid)
+{
+	checkOpen();
+	int rc = sqlite3_blob_reopen(blob, rowid);
+	if (rc != SQLITE_OK)
+	{
+		//The handle is aborted and can only be closed
+		std::string errmsg = sqlite3_errmsg(db->getDatabase());
+		close();
+		throw BlobError("Cannot reopen blob with rowid " + std::to_string(rowid) + ": " + errmsg);
+	}
+	this->rowid = rowid;
+	blob_size = static_cast<size_t>(sqlite3_blob_bytes(blob));
+}
+
+void DatabaseBlob::close()
+{
+	if (blob != nullptr)
+	{
+		sqlite3_blob_close(blob);
+		blob = nullptr;
+		blob_size = 0;
+	}
+}
+
+size_t DatabaseBlob::readTo(std::ostream& out, size_t chunk_size)
+{
+	size_t written = 0;
+	readChunks([&](const char* data, size_t size) {
+		out.write(data, static_cast<std::streamsize>(size));
+		if (!out)
+			throw BlobError("Error writing blob rowid " + std::to_string(rowid) + " to stream");
+		written += size;
+	}, chunk_size);
+	return written;
+}
+
+size_t DatabaseBlob::writeFrom(std::istream& in, size_t offset, size_t chunk_size)
+{
+	checkOpen();
+	checkChunkSize(chunk_size);
+	std::vector<char> buffer(chunk_size);
+	size_t total = 0;
+	while (offset < blob_size)
+	{
+		in.read(buffer.data(), static_cast<std::streamsize>((std::min)(buffer.size(), blob_size - offset)));
+		size_t read_size = static_cast<size_t>(in.gcount());
+		if (read_size == 0)
+			break;
+		write(buffer.data(), read_size, offset);
+		offset += read_size;
+		total += read_size;
+	}
+	return total;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <iosfwd>
+#include <stdint.h>
+
+struct sqlite3_blob;
+
+namespace sqlgen
+{
+	class Database;
+
+	class BlobError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	/**
+	* Incremental I/O on one blob column value (sqlite3_blob_open). Reads and
+	* writes go directly to and from caller buffers, so large blobs do not
+	* have to be copied into a std::string. The size of a blob cannot be
+	* changed; insert a zeroblob of the final size (DatabaseQuery::bindZeroBlob,
+	* blob_stream parameter) and write it in chunks. reopen() moves the handle
+	* to another row of the same table and column without preparing again.
+	*
+	* An open blob keeps a statement active on the connection (and a read or
+	* write transaction in autocommit mode), so close it when done. Reads and
+	* writes fail with BlobError if the row was changed or deleted.
+	*/
+	class DatabaseBlob
+	{
+	public:
+		DatabaseBlob();
+		DatabaseBlob(Database& db, const std::string& table, const std::string& column, int64_t rowid,
+			bool writable = false, const std::string& db_name = "main");
+		~DatabaseBlob();
+
+		DatabaseBlob(const DatabaseBlob&) = delete;
+		DatabaseBlob& operator=(const DatabaseBlob&) = delete;
+		DatabaseBlob(DatabaseBlob&& other);
+		DatabaseBlob& operator=(DatabaseBlob&& other);
+
+		bool isOpen() const {
+			return blob != nullptr;
+		}
+
+		int64_t getRowid() const {
+			return rowid;
+		}
+
+		size_t size() const {
+			return blob_size;
+		}
+
+		//Reads up to bsize bytes at offset. Returns the number of bytes read (less at the end of the blob)
+		size_t read(char* buffer, size_t bsize, size_t offset = 0);
+
+		//Writes bsize bytes at offset. Writing past the end of the blob throws BlobError
+		void write(const char* buffer, size_t bsize, size_t offset = 0);
+
+		void reopen(int64_t rowid);
+
+		void close();
+
+		//Calls f(const char* data, size_t size) for each chunk of the blob. chunk_size must not be 0
+		template<typename F>
+		void readChunks(F f, size_t chunk_size = 64 * 1024)
+		{
+			checkChunkSize(chunk_size);
+			std::vector<char> buffer(chunk_size);
+			for (size_t offset = 0; offset < blob_size;)
+			{
+				size_t read_size = read(buffer.data(), buffer.size(), offset);
+				f(static_cast<const char*>(buffer.data()), read_size);
+				offset += read_size;
+			}
+		}
+
+		//Writes the whole blob to out. Returns the number of bytes written
+		size_t readTo(std::ostream& out, size_t chunk_size = 64 * 1024);
+
+		//Fills the blob from offset with data from in until the blob is full or in ends. Returns the number of bytes read
+		size_t writeFrom(std::istream& in, size_t offset = 0, size_t chunk_size = 64 * 1024);
+
+	private:
+		void checkOpen();
+		void checkChunkSize(size_t chunk_size);
+
+		Database* db;
+		sqlite3_blob* blob;
+		int64_t rowid;
+		size_t blob_size;
+	};
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <utility>
+#include <stdint.h>
+#include "Database.h"
+
+namespace sqlgen
+{
+	/**
+	* Bounded LRU cache for results of generated functions with @cache
+	* annotation, keyed by the bound parameters. Cleared when one of the
+	* tables ("db.table") is changed through the connection or on rollback.
+	* Changes SQLite does not report per table (DELETE without WHERE,
+	* WITHOUT ROWID tables) clear it as well, see
+	* Database::checkUnreportedChanges(). With empty tables every change
+	* clears it. Changes by other connections are only picked up after ttl
+	* (0 = no expiry).
+	* Not thread-safe, like the generated functions using it.
+	*/
+	template<typename Key, typename Value>
+	class ResultCache
+	{
+	public:
+		ResultCache(Database& db, size_t max_size, std::chrono::milliseconds ttl, const std::vector<std::string>& tables)
+			: db(db), max_size(max_size), ttl(ttl)
+		{
+			for (const std::string& table : tables)
+			{
+				size_t dot = table.find('.');
+				if (dot == std::string::npos)
+					this->tables.push_back(std::make_pair(std::string("main"), table));
+				else
+					this->tables.push_back(std::make_pair(table.substr(0, dot), table.substr(dot + 1)));
+			}
+
+			listener_id = db.addChangeListener([this](const char* db_name, const char* table) {
+				if (table == nullptr || affects(db_name, table))
+					clear();
+			});
+		}
+
+		~ResultCache()
+		{
+			db.removeChangeListener(listener_id);
+		}
+
+		ResultCache(const ResultCache&) = delete;
+		ResultCache& operator=(const ResultCache&) = delete;
+
+		template<typename F>
+		Value getOrLoad(const Key& key, F load)
+		{
+			db.checkUnreportedChanges();
+
+			auto now = std::chrono::steady_clock::now();
+			auto it = entries.find(key);
+			if (it != entries.end())
+			{
+				if (ttl.count() <= 0 || now < it->second.expires)
+				{
+					lru.splice(lru.begin(), lru, it->second.lru_it);
+					return it->second.value;
+				}
+				lru.erase(it->second.lru_it);
+				entries.erase(it);
+			}
+
+			uint64_t load_generation = generation;
+			Value value = load();
+
+			//Do not cache results that were changed while loading
+			if (load_generation != generation || max_size == 0)
+				return value;
+
+			if (entries.size() >= max_size)
+			{
+				entries.erase(lru.back());
+				lru.pop_back();
+			}
+
+			lru.push_front(key);
+			entries.emplace(key, Entry{ value, now + ttl, lru.begin() });
+			return value;
+		}
+
+		void clear()
+		{
+			++generation;
+			if (entries.empty())
+				return;
+			entries.clear();
+			lru.clear();
+		}
+
+		size_t size() {
+			return entries.size();
+		}
+
+	private:
+		bool affects(const char* db_name, const char* table)
+		{
+			if (tables.empty())
+				return true;
+
+			for (auto& it : tables)
+			{
+				if (it.second == table && it.first == db_name)
+					return true;
+			}
+			return false;
+		}
+
+		struct Entry
+		{
+			Value value;
+			std::chrono::steady_clock::time_point expires;
+			typename std::list<Key>::iterator lru_it;
+		};
+
+		Database& db;
+		size_t max_size;
+		std::chrono::milliseconds ttl;
+		std::vector<std::pair<std::string, std::string> > tables;
+		size_t listener_id;
+		uint64_t generation = 0;
+		std::map<Key, Entry> entries;
+		std::list<Key> lru;
+	};
+}
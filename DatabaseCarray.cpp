@@ -0,0 +1,183 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "DatabaseCarray.h"
+#include "sqlite/sqlite3.h"
+
+using namespace sqlgen;
+
+namespace
+{
+	enum CarrayColumn
+	{
+		CarrayColumn_Value = 0,
+		CarrayColumn_Pointer = 1
+	};
+
+	struct CarrayCursor
+	{
+		sqlite3_vtab_cursor base;
+		const CarrayBind* bind;
+		sqlite3_int64 idx;
+	};
+
+	int carrayConnect(sqlite3* db, void* pAux, int argc, const char* const* argv,
+		sqlite3_vtab** ppVtab, char** pzErr)
+	{
+		int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(value,pointer HIDDEN)");
+		if (rc != SQLITE_OK)
+			return rc;
+
+		sqlite3_vtab* vtab = static_cast<sqlite3_vtab*>(sqlite3_malloc(sizeof(sqlite3_vtab)));
+		if (vtab == nullptr)
+			return SQLITE_NOMEM;
+
+		*vtab = {};
+		*ppVtab = vtab;
+		sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+		return SQLITE_OK;
+	}
+
+	int carrayDisconnect(sqlite3_vtab* pVtab)
+	{
+		sqlite3_free(pVtab);
+		return SQLITE_OK;
+	}
+
+	int carrayOpen(sqlite3_vtab* p, sqlite3_vtab_cursor** ppCursor)
+	{
+		CarrayCursor* cur = static_cast<CarrayCursor*>(sqlite3_malloc(sizeof(CarrayCursor)));
+		if (cur == nullptr)
+			return SQLITE_NOMEM;
+
+		*cur = {};
+		*ppCursor = &cur->base;
+		return SQLITE_OK;
+	}
+
+	int carrayClose(sqlite3_vtab_cursor* cur)
+	{
+		sqlite3_free(cur);
+		return SQLITE_OK;
+	}
+
+	int carrayNext(sqlite3_vtab_cursor* cur)
+	{
+		++reinterpret_cast<CarrayCursor*>(cur)->idx;
+		return SQLITE_OK;
+	}
+
+	int carrayEof(sqlite3_vtab_cursor* cur)
+	{
+		CarrayCursor* ccur = reinterpret_cast<CarrayCursor*>(cur);
+		return ccur->bind == nullptr || ccur->idx >= ccur->bind->ndata;
+	}
+
+	int carrayColumn(sqlite3_vtab_cursor* cur, sqlite3_context* ctx, int i)
+	{
+		CarrayCursor* ccur = reinterpret_cast<CarrayCursor*>(cur);
+		if (i != CarrayColumn_Value)
+			return SQLITE_OK;
+
+		const CarrayBind* bind = ccur->bind;
+		switch (bind->flags)
+		{
+		case CarrayType_Int32:
+			sqlite3_result_int(ctx, static_cast<const int*>(bind->data)[ccur->idx]);
+			break;
+		case CarrayType_Int64:
+			sqlite3_result_int64(ctx, static_cast<const sqlite3_int64*>(bind->data)[ccur->idx]);
+			break;
+		case CarrayType_Double:
+			sqlite3_result_double(ctx, static_cast<const double*>(bind->data)[ccur->idx]);
+			break;
+		case CarrayType_Text:
+			sqlite3_result_text(ctx, static_cast<const char* const*>(bind->data)[ccur->idx], -1, SQLITE_STATIC);
+			break;
+		case CarrayType_Blob:
+		{
+			const CarrayBlob& blob = static_cast<const CarrayBlob*>(bind->data)[ccur->idx];
+			sqlite3_result_blob(ctx, blob.data, static_cast<int>(blob.size), SQLITE_STATIC);
+		} break;
+		}
+		return SQLITE_OK;
+	}
+
+	int carrayRowid(sqlite3_vtab_cursor* cur, sqlite_int64* pRowid)
+	{
+		*pRowid = reinterpret_cast<CarrayCursor*>(cur)->idx + 1;
+		return SQLITE_OK;
+	}
+
+	int carrayFilter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr,
+		int argc, sqlite3_value** argv)
+	{
+		CarrayCursor* ccur = reinterpret_cast<CarrayCursor*>(cur);
+		ccur->idx = 0;
+		ccur->bind = nullptr;
+		if (idxNum == 1 && argc == 1)
+		{
+			const CarrayBindHolder* holder = static_cast<const CarrayBindHolder*>(sqlite3_value_pointer(argv[0], c_carray_bind_type));
+			if (holder != nullptr)
+				ccur->bind = &holder->bind;
+		}
+		return SQLITE_OK;
+	}
+
+	int carrayBestIndex(sqlite3_vtab* tab, sqlite3_index_info* pIdxInfo)
+	{
+		int ptr_idx = -1;
+		for (int i = 0; i < pIdxInfo->nConstraint; ++i)
+		{
+			const auto& constraint = pIdxInfo->aConstraint[i];
+			if (constraint.usable
+				&& constraint.op == SQLITE_INDEX_CONSTRAINT_EQ
+				&& constraint.iColumn == CarrayColumn_Pointer)
+			{
+				ptr_idx = i;
+			}
+		}
+
+		if (ptr_idx >= 0)
+		{
+			pIdxInfo->aConstraintUsage[ptr_idx].argvIndex = 1;
+			pIdxInfo->aConstraintUsage[ptr_idx].omit = 1;
+			pIdxInfo->estimatedCost = 1;
+			pIdxInfo->estimatedRows = 100;
+			pIdxInfo->idxNum = 1;
+		}
+		else
+		{
+			pIdxInfo->estimatedCost = 2147483647;
+			pIdxInfo->estimatedRows = 2147483647;
+			pIdxInfo->idxNum = 0;
+		}
+		return SQLITE_OK;
+	}
+
+	sqlite3_module carrayModule = {
+		0,                 /* iVersion */
+		nullptr,           /* xCreate */
+		carrayConnect,     /* xConnect */
+		carrayBestIndex,   /* xBestIndex */
+		carrayDisconnect,  /* xDisconnect */
+		nullptr,           /* xDestroy */
+		carrayOpen,        /* xOpen */
+		carrayClose,       /* xClose */
+		carrayFilter,      /* xFilter */
+		carrayNext,        /* xNext */
+		carrayEof,         /* xEof */
+		carrayColumn,      /* xColumn */
+		carrayRowid,       /* xRowid */
+	};
+}
+
+namespace sqlgen
+{
+	int registerCarrayModule(sqlite3* db)
+	{
+		return sqlite3_create_module(db, "carray", &carrayModule, nullptr);
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+struct sqlite3;
+
+namespace sqlgen
+{
+	// Flags are the same as in SQLite's carray extension (ext/misc/carray.c)
+	enum CarrayType
+	{
+		CarrayType_Int32 = 0,
+		CarrayType_Int64 = 1,
+		CarrayType_Double = 2,
+		CarrayType_Text = 3,
+		CarrayType_Blob = 4
+	};
+
+	struct CarrayBind
+	{
+		void* data;
+		int ndata;
+		int flags;
+		void (*del)(void*);
+	};
+
+	struct CarrayBlob
+	{
+		const void* data;
+		size_t size;
+	};
+
+	// Pointer type of the CarrayBindHolder bound with sqlite3_bind_pointer()
+	const char* const c_carray_bind_type = "sqlgen-carray-bind";
+
+	// Bound to carray(?). Owns the pointer arrays of text and blob arrays
+	struct CarrayBindHolder
+	{
+		CarrayBind bind;
+		std::vector<const char*> texts;
+		std::vector<CarrayBlob> blobs;
+	};
+
+	int registerCarrayModule(sqlite3* db);
+}
@@ -121,6 +121,37 @@ bool DatabaseCursor::get(int col, double& v)
 	return col_type == SQLITE_FLOAT;
 }
 
+int DatabaseCursor::columnCount()
+{
+	return sqlite3_column_count(query->getSQliteStmt());
+}
+
+std::string DatabaseCursor::columnName(int col)
+{
+	const char* name = sqlite3_column_name(query->getSQliteStmt(), col);
+	if (name == nullptr)
+		return std::string();
+	return name;
+}
+
+ColumnType DatabaseCursor::columnType(int col)
+{
+	return static_cast<ColumnType>(sqlite3_column_type(query->getSQliteStmt(), col));
+}
+
+std::string_view DatabaseCursor::getView(int col)
+{
+	sqlite3_stmt* ps = query->getSQliteStmt();
+	const void* data;
+	if (sqlite3_column_type(ps, col) == SQLITE_BLOB)
+		data = sqlite3_column_blob(ps, col);
+	else
+		data = sqlite3_column_text(ps, col);
+	if (data == nullptr)
+		return std::string_view();
+	return std::string_view(reinterpret_cast<const char*>(data), sqlite3_column_bytes(ps, col));
+}
+
 void DatabaseCursor::init_col_names()
 {
 	int column = 0;
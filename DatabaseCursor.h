@@ -1,11 +1,22 @@
 #pragma once
 
 #include "Database.h"
+#include <string_view>
 
 namespace sqlgen
 {
 	class DatabaseQuery;
 
+	//Same values as SQLITE_INTEGER etc.
+	enum ColumnType
+	{
+		ColumnType_Integer = 1,
+		ColumnType_Float = 2,
+		ColumnType_Text = 3,
+		ColumnType_Blob = 4,
+		ColumnType_Null = 5
+	};
+
 	class DatabaseCursor
 	{
 	public:
@@ -41,6 +52,12 @@ namespace sqlgen
 		bool get(const std::string& col, int64_t& v);
 		bool get(const std::string& col, double& v);
 
+		int columnCount();
+		std::string columnName(int col);
+		ColumnType columnType(int col);
+		//Text or blob data of the column without copying. Valid until the next call to next()
+		std::string_view getView(int col);
+
 	private:
 		DatabaseQuery* query;
 
@@ -0,0 +1,97 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "DatabaseFunction.h"
+#include "sqlite/sqlite3.h"
+
+namespace sqlgen
+{
+	namespace function_detail
+	{
+		void* userData(sqlite3_context* ctx)
+		{
+			return sqlite3_user_data(ctx);
+		}
+
+		void** aggregateContext(sqlite3_context* ctx, bool alloc)
+		{
+			return static_cast<void**>(sqlite3_aggregate_context(ctx, alloc ? sizeof(void*) : 0));
+		}
+
+		void resultError(sqlite3_context* ctx, const char* msg)
+		{
+			sqlite3_result_error(ctx, msg, -1);
+		}
+
+		void resultErrorNomem(sqlite3_context* ctx)
+		{
+			sqlite3_result_error_nomem(ctx);
+		}
+
+		bool valueIsNull(sqlite3_value* val)
+		{
+			return sqlite3_value_type(val) == SQLITE_NULL;
+		}
+
+		int valueInt(sqlite3_value* val)
+		{
+			return sqlite3_value_int(val);
+		}
+
+		int64_t valueInt64(sqlite3_value* val)
+		{
+			return sqlite3_value_int64(val);
+		}
+
+		double valueDouble(sqlite3_value* val)
+		{
+			return sqlite3_value_double(val);
+		}
+
+		std::string_view valueText(sqlite3_value* val)
+		{
+			const unsigned char* data = sqlite3_value_text(val);
+			if (data == nullptr)
+				return std::string_view();
+			return std::string_view(reinterpret_cast<const char*>(data), static_cast<size_t>(sqlite3_value_bytes(val)));
+		}
+
+		BlobView valueBlob(sqlite3_value* val)
+		{
+			const void* data = sqlite3_value_blob(val);
+			return BlobView{ data, static_cast<size_t>(sqlite3_value_bytes(val)) };
+		}
+
+		void resultNull(sqlite3_context* ctx)
+		{
+			sqlite3_result_null(ctx);
+		}
+
+		void resultInt(sqlite3_context* ctx, int v)
+		{
+			sqlite3_result_int(ctx, v);
+		}
+
+		void resultInt64(sqlite3_context* ctx, int64_t v)
+		{
+			sqlite3_result_int64(ctx, v);
+		}
+
+		void resultDouble(sqlite3_context* ctx, double v)
+		{
+			sqlite3_result_double(ctx, v);
+		}
+
+		void resultText(sqlite3_context* ctx, std::string_view v)
+		{
+			sqlite3_result_text64(ctx, v.data(), v.size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+		}
+
+		void resultBlob(sqlite3_context* ctx, BlobView v)
+		{
+			sqlite3_result_blob64(ctx, v.data, v.size, SQLITE_TRANSIENT);
+		}
+	}
+}
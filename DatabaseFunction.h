@@ -0,0 +1,297 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <exception>
+#include <new>
+#include <stdint.h>
+
+struct sqlite3_context;
+struct sqlite3_value;
+
+namespace sqlgen
+{
+	enum FunctionFlags
+	{
+		FunctionFlag_None = 0,
+		//Same result for same arguments. Allows use in indexes and generated columns
+		FunctionFlag_Deterministic = 1,
+		//No side effects. Allows use in views and triggers of untrusted schemas
+		FunctionFlag_Innocuous = 2,
+		//Can only be used from top-level SQL
+		FunctionFlag_DirectOnly = 4
+	};
+
+	//Non-owning view of a blob argument or result
+	struct BlobView
+	{
+		const void* data;
+		size_t size;
+	};
+
+	namespace function_detail
+	{
+		void* userData(sqlite3_context* ctx);
+		void** aggregateContext(sqlite3_context* ctx, bool alloc);
+		void resultError(sqlite3_context* ctx, const char* msg);
+		void resultErrorNomem(sqlite3_context* ctx);
+
+		bool valueIsNull(sqlite3_value* val);
+		int valueInt(sqlite3_value* val);
+		int64_t valueInt64(sqlite3_value* val);
+		double valueDouble(sqlite3_value* val);
+		std::string_view valueText(sqlite3_value* val);
+		BlobView valueBlob(sqlite3_value* val);
+
+		void resultNull(sqlite3_context* ctx);
+		void resultInt(sqlite3_context* ctx, int v);
+		void resultInt64(sqlite3_context* ctx, int64_t v);
+		void resultDouble(sqlite3_context* ctx, double v);
+		void resultText(sqlite3_context* ctx, std::string_view v);
+		void resultBlob(sqlite3_context* ctx, BlobView v);
+
+		template<typename T>
+		struct ValueDecoder;
+
+		template<> struct ValueDecoder<int> {
+			static int get(sqlite3_value* val) { return valueInt(val); }
+		};
+		template<> struct ValueDecoder<int64_t> {
+			static int64_t get(sqlite3_value* val) { return valueInt64(val); }
+		};
+		template<> struct ValueDecoder<bool> {
+			static bool get(sqlite3_value* val) { return valueInt64(val) != 0; }
+		};
+		template<> struct ValueDecoder<double> {
+			static double get(sqlite3_value* val) { return valueDouble(val); }
+		};
+		template<> struct ValueDecoder<std::string_view> {
+			static std::string_view get(sqlite3_value* val) { return valueText(val); }
+		};
+		template<> struct ValueDecoder<std::string> {
+			static std::string get(sqlite3_value* val) { return std::string(valueText(val)); }
+		};
+		template<> struct ValueDecoder<BlobView> {
+			static BlobView get(sqlite3_value* val) { return valueBlob(val); }
+		};
+		template<typename T> struct ValueDecoder<std::optional<T> > {
+			static std::optional<T> get(sqlite3_value* val) {
+				if (valueIsNull(val))
+					return std::nullopt;
+				return ValueDecoder<T>::get(val);
+			}
+		};
+
+		inline void setResult(sqlite3_context* ctx, int v) { resultInt(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, int64_t v) { resultInt64(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, bool v) { resultInt(ctx, v ? 1 : 0); }
+		inline void setResult(sqlite3_context* ctx, double v) { resultDouble(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, std::string_view v) { resultText(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, const std::string& v) { resultText(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, const char* v) { resultText(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, BlobView v) { resultBlob(ctx, v); }
+		inline void setResult(sqlite3_context* ctx, std::nullopt_t) { resultNull(ctx); }
+
+		template<typename T>
+		void setResult(sqlite3_context* ctx, const std::optional<T>& v)
+		{
+			if (v)
+				setResult(ctx, *v);
+			else
+				resultNull(ctx);
+		}
+
+		template<typename T>
+		struct FunctionTraits : FunctionTraits<decltype(&T::operator())> {};
+
+		template<typename R, typename... A>
+		struct FunctionTraits<R(*)(A...)>
+		{
+			typedef R ret_type;
+			typedef std::tuple<std::decay_t<A>...> args_type;
+			static constexpr int arity = sizeof...(A);
+		};
+
+		template<typename C, typename R, typename... A>
+		struct FunctionTraits<R(C::*)(A...)> : FunctionTraits<R(*)(A...)> {};
+
+		template<typename C, typename R, typename... A>
+		struct FunctionTraits<R(C::*)(A...) const> : FunctionTraits<R(*)(A...)> {};
+
+		template<typename Args, typename F, size_t... I>
+		decltype(auto) callWithValues(F& f, sqlite3_value** argv, std::index_sequence<I...>)
+		{
+			return f(ValueDecoder<std::tuple_element_t<I, Args> >::get(argv[I])...);
+		}
+
+		template<typename F>
+		void scalarFunc(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+		{
+			typedef FunctionTraits<F> traits;
+			F& f = *static_cast<F*>(userData(ctx));
+			try
+			{
+				setResult(ctx, callWithValues<typename traits::args_type>(f, argv,
+					std::make_index_sequence<traits::arity>()));
+			}
+			catch (const std::bad_alloc&)
+			{
+				resultErrorNomem(ctx);
+			}
+			catch (const std::exception& e)
+			{
+				resultError(ctx, e.what());
+			}
+			catch (...)
+			{
+				resultError(ctx, "Unknown exception in function");
+			}
+		}
+
+		template<typename F>
+		void destroy(void* p)
+		{
+			delete static_cast<F*>(p);
+		}
+
+		/**
+		* Aggregate state lives on the heap. The aggregate context only
+		* holds a pointer to it, so it does not need to be trivially
+		* constructible.
+		*/
+		template<typename A>
+		A* aggregateState(sqlite3_context* ctx, bool alloc)
+		{
+			void** p = aggregateContext(ctx, alloc);
+			if (p == nullptr)
+				return nullptr;
+			if (*p == nullptr)
+				*p = new A();
+			return static_cast<A*>(*p);
+		}
+
+		template<typename A>
+		void aggregateStep(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+		{
+			typedef FunctionTraits<decltype(&A::step)> traits;
+			try
+			{
+				A* state = aggregateState<A>(ctx, true);
+				if (state == nullptr)
+				{
+					resultErrorNomem(ctx);
+					return;
+				}
+				auto step = [state](auto&&... args) { state->step(std::forward<decltype(args)>(args)...); };
+				callWithValues<typename traits::args_type>(step, argv,
+					std::make_index_sequence<traits::arity>());
+			}
+			catch (const std::bad_alloc&)
+			{
+				resultErrorNomem(ctx);
+			}
+			catch (const std::exception& e)
+			{
+				resultError(ctx, e.what());
+			}
+			catch (...)
+			{
+				resultError(ctx, "Unknown exception in function");
+			}
+		}
+
+		template<typename A>
+		void aggregateInverse(sqlite3_context* ctx, int argc, sqlite3_value** argv)
+		{
+			typedef FunctionTraits<decltype(&A::inverse)> traits;
+			try
+			{
+				A* state = aggregateState<A>(ctx, true);
+				if (state == nullptr)
+				{
+					resultErrorNomem(ctx);
+					return;
+				}
+				auto inverse = [state](auto&&... args) { state->inverse(std::forward<decltype(args)>(args)...); };
+				callWithValues<typename traits::args_type>(inverse, argv,
+					std::make_index_sequence<traits::arity>());
+			}
+			catch (const std::bad_alloc&)
+			{
+				resultErrorNomem(ctx);
+			}
+			catch (const std::exception& e)
+			{
+				resultError(ctx, e.what());
+			}
+			catch (...)
+			{
+				resultError(ctx, "Unknown exception in function");
+			}
+		}
+
+		template<typename A>
+		void aggregateValue(sqlite3_context* ctx)
+		{
+			try
+			{
+				A* state = aggregateState<A>(ctx, true);
+				if (state == nullptr)
+					resultErrorNomem(ctx);
+				else
+					setResult(ctx, state->value());
+			}
+			catch (const std::bad_alloc&)
+			{
+				resultErrorNomem(ctx);
+			}
+			catch (const std::exception& e)
+			{
+				resultError(ctx, e.what());
+			}
+			catch (...)
+			{
+				resultError(ctx, "Unknown exception in function");
+			}
+		}
+
+		template<typename A>
+		void aggregateFinal(sqlite3_context* ctx)
+		{
+			void** p = aggregateContext(ctx, false);
+			A* state = p != nullptr ? static_cast<A*>(*p) : nullptr;
+			try
+			{
+				if (state != nullptr)
+				{
+					setResult(ctx, state->final());
+				}
+				else
+				{
+					//No rows
+					A empty_state;
+					setResult(ctx, empty_state.final());
+				}
+			}
+			catch (const std::bad_alloc&)
+			{
+				resultErrorNomem(ctx);
+			}
+			catch (const std::exception& e)
+			{
+				resultError(ctx, e.what());
+			}
+			catch (...)
+			{
+				resultError(ctx, "Unknown exception in function");
+			}
+			delete state;
+			if (p != nullptr)
+				*p = nullptr;
+		}
+	}
+}
@@ -7,17 +7,30 @@
 #include "sqlite/sqlite3.h"
 #include "Database.h"
 #include "DatabaseCursor.h"
+#include "DatabaseCarray.h"
 #include <memory.h>
+#include <limits.h>
 #include <algorithm>
 #include <thread>
 #include <chrono>
 #include <utility>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 #include "stringtools.h"
 #include "DatabaseLogger.h"
 
 using namespace std::chrono_literals;
 using namespace sqlgen;
 
+namespace
+{
+	void deleteCarrayBindHolder(void* p)
+	{
+		delete static_cast<CarrayBindHolder*>(p);
+	}
+}
+
 DatabaseQuery::DatabaseQuery(const std::string &pStmt_str, sqlite3_stmt *prepared_statement, Database *pDB)
 	: stmt_str(pStmt_str), ps(prepared_statement), db(pDB)
 {
@@ -51,6 +64,30 @@ void DatabaseQuery::bind(const std::string &str)
 	++curr_idx;
 }
 
+void DatabaseQuery::bindView(std::string_view str)
+{
+	int err=sqlite3_bind_text64(ps, curr_idx, str.data(), str.size(), SQLITE_STATIC, SQLITE_UTF8);
+	if( err!=SQLITE_OK )
+		getDatabaseLogger()->Log("Error binding text to DatabaseQuery  Stmt: ["+stmt_str+"]", LL_ERROR);
+	++curr_idx;
+}
+
+void DatabaseQuery::bindNull()
+{
+	int err=sqlite3_bind_null(ps, curr_idx);
+	if( err!=SQLITE_OK )
+		getDatabaseLogger()->Log("Error binding null to DatabaseQuery  Stmt: ["+stmt_str+"]", LL_ERROR);
+	++curr_idx;
+}
+
+void DatabaseQuery::bindZeroBlob(int64_t size)
+{
+	int err=sqlite3_bind_zeroblob64(ps, curr_idx, static_cast<sqlite3_uint64>(size));
+	if( err!=SQLITE_OK )
+		getDatabaseLogger()->Log("Error binding zeroblob to DatabaseQuery  Stmt: ["+stmt_str+"]", LL_ERROR);
+	++curr_idx;
+}
+
 void DatabaseQuery::bind(const char* buffer, size_t bsize)
 {
 	int err=sqlite3_bind_blob(ps, curr_idx, buffer, static_cast<int>(bsize), SQLITE_TRANSIENT);
@@ -59,6 +96,58 @@ void DatabaseQuery::bind(const char* buffer, size_t bsize)
 	++curr_idx;
 }
 
+void DatabaseQuery::bindCarray(void* data, size_t n, int type, std::unique_ptr<CarrayBindHolder> holder)
+{
+	if(n > static_cast<size_t>(INT_MAX))
+		throw BindError("Cannot bind array of "+std::to_string(n)+" elements (more than INT_MAX)  Stmt: ["+stmt_str+"]");
+	if(!holder)
+		holder = std::make_unique<CarrayBindHolder>();
+	holder->bind.data = data;
+	holder->bind.ndata = static_cast<int>(n);
+	holder->bind.flags = type;
+	holder->bind.del = nullptr;
+	int err=sqlite3_bind_pointer(ps, curr_idx, holder.release(), c_carray_bind_type, deleteCarrayBindHolder);
+	if( err!=SQLITE_OK )
+		getDatabaseLogger()->Log("Error binding array to DatabaseQuery  Stmt: ["+stmt_str+"]", LL_ERROR);
+	++curr_idx;
+}
+
+void DatabaseQuery::bindArray(const int* data, size_t n)
+{
+	bindCarray(const_cast<int*>(data), n, CarrayType_Int32, nullptr);
+}
+
+void DatabaseQuery::bindArray(const int64_t* data, size_t n)
+{
+	static_assert(sizeof(int64_t)==sizeof(sqlite3_int64), "int64_t size mismatch");
+	bindCarray(const_cast<int64_t*>(data), n, CarrayType_Int64, nullptr);
+}
+
+void DatabaseQuery::bindArray(const double* data, size_t n)
+{
+	bindCarray(const_cast<double*>(data), n, CarrayType_Double, nullptr);
+}
+
+void DatabaseQuery::bindArray(const std::string* data, size_t n)
+{
+	auto holder = std::make_unique<CarrayBindHolder>();
+	holder->texts.reserve(n);
+	for(size_t i=0;i<n;++i)
+		holder->texts.push_back(data[i].c_str());
+	void* texts = holder->texts.data();
+	bindCarray(texts, n, CarrayType_Text, std::move(holder));
+}
+
+void DatabaseQuery::bindBlobArray(const std::string* data, size_t n)
+{
+	auto holder = std::make_unique<CarrayBindHolder>();
+	holder->blobs.reserve(n);
+	for(size_t i=0;i<n;++i)
+		holder->blobs.push_back(CarrayBlob{data[i].data(), data[i].size()});
+	void* blobs = holder->blobs.data();
+	bindCarray(blobs, n, CarrayType_Blob, std::move(holder));
+}
+
 void DatabaseQuery::bind(int p)
 {
 	int err=sqlite3_bind_int(ps, curr_idx, p);
@@ -116,7 +205,7 @@ bool DatabaseQuery::Execute(int timeoutms)
 	int tries=60; //10min
 	if(timeoutms>=0)
 	{
-		sqlite3_busy_timeout(db->getDatabase(), timeoutms);
+		db->setBusyTimeout(timeoutms);
 	}
 	int err=sqlite3_step(ps);
 	while( err==SQLITE_IOERR_BLOCKED 
@@ -133,6 +222,11 @@ bool DatabaseQuery::Execute(int timeoutms)
 			|| err==SQLITE_IOERR_BLOCKED
 			|| err==SQLITE_PROTOCOL )
 		{
+			if(err==SQLITE_BUSY && db->inRetryableTransaction())
+			{
+				reset();
+				throw TransactionConflict("SQLITE_BUSY in transaction  Stmt: ["+stmt_str+"]");
+			}
 			if(timeoutms>=0)
 			{
 				break;
@@ -168,9 +262,11 @@ bool DatabaseQuery::Execute(int timeoutms)
 
 	if(timeoutms>=0)
 	{
-		sqlite3_busy_timeout(db->getDatabase(), c_sqlite_busy_timeout_default);
+		db->setBusyTimeout(c_sqlite_busy_timeout_default);
 	}
 
+	db->updateTransactionOwner();
+
 	//getDatabaseLogger()->Log("Write done: "+stmt_str);
 	if( err!=SQLITE_DONE )
 	{
@@ -188,7 +284,7 @@ void DatabaseQuery::setupStepping(int timeoutms)
 {
 	if(timeoutms>=0)
 	{
-		sqlite3_busy_timeout(db->getDatabase(), timeoutms);
+		db->setBusyTimeout(timeoutms);
 	}
 }
 
@@ -196,7 +292,7 @@ void DatabaseQuery::shutdownStepping(int err, int timeoutms)
 {
 	if(timeoutms>=0)
 	{
-		sqlite3_busy_timeout(db->getDatabase(), c_sqlite_busy_timeout_default);
+		db->setBusyTimeout(c_sqlite_busy_timeout_default);
 	}
 
 	if (err == SQLITE_ROW)
@@ -263,6 +359,11 @@ int DatabaseQuery::step(db_single_result* res, int timeoutms, int& tries, bool&
 			|| err==SQLITE_PROTOCOL
 			|| err==SQLITE_IOERR_BLOCKED )
 		{
+			if(err==SQLITE_BUSY && db->inRetryableTransaction())
+			{
+				DatabaseQuery::reset();
+				throw TransactionConflict("SQLITE_BUSY in transaction  Stmt: ["+stmt_str+"]");
+			}
 			if(timeoutms>=0)
 			{
 				return SQLITE_ABORT;
@@ -348,4 +449,156 @@ std::string DatabaseQuery::getStatement(void)
 std::string DatabaseQuery::getErrMsg(void)
 {
 	return std::string(sqlite3_errmsg(db->getDatabase()));
-}
\ No newline at end of file
+}
+
+namespace sqlgen
+{
+	struct ThreadQueryState
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<DatabaseQuery> > queries;
+	};
+}
+
+namespace
+{
+	//Statements of one ThreadQuery prepared by this thread, indexed by connection slot
+	struct ThreadQuerySlots
+	{
+		std::weak_ptr<ThreadQueryState> state;
+		std::vector<DatabaseQuery*> queries;
+	};
+
+	const size_t c_thread_query_min_prune_at = 16;
+
+	struct ThreadQueryTable
+	{
+		~ThreadQueryTable()
+		{
+			for (auto& it : entries)
+			{
+				std::shared_ptr<ThreadQueryState> state = it.second.state.lock();
+				if (!state)
+					continue;
+
+				std::lock_guard<std::mutex> lock(state->mutex);
+				for (DatabaseQuery* query : it.second.queries)
+				{
+					if (query == nullptr)
+						continue;
+
+					auto query_it = std::find_if(state->queries.begin(), state->queries.end(),
+						[query](const std::unique_ptr<DatabaseQuery>& q) { return q.get() == query; });
+					if (query_it != state->queries.end())
+						state->queries.erase(query_it);
+				}
+			}
+		}
+
+		//Removes entries of destroyed ThreadQuerys. Their destructor only removes the entry of the destroying thread
+		void pruneExpired()
+		{
+			for (auto it = entries.begin(); it != entries.end();)
+			{
+				if (it->second.state.expired())
+					it = entries.erase(it);
+				else
+					++it;
+			}
+			prune_at = (std::max)(c_thread_query_min_prune_at, entries.size() * 2);
+		}
+
+		//Keyed by ThreadQuery id. Ids are not reused, so entries of destroyed ThreadQuerys are never looked up
+		std::unordered_map<uint64_t, ThreadQuerySlots> entries;
+		//Table size at which the next new entry prunes first. Doubles with the live entries, so pruning is amortized
+		size_t prune_at = c_thread_query_min_prune_at;
+	};
+
+	thread_local ThreadQueryTable thread_query_table;
+
+	std::atomic<uint64_t> thread_query_next_id(1);
+}
+
+ThreadQuery::ThreadQuery()
+	: id(thread_query_next_id++), state(std::make_shared<ThreadQueryState>())
+{
+}
+
+ThreadQuery::~ThreadQuery()
+{
+	thread_query_table.entries.erase(id);
+}
+
+DatabaseQuery& ThreadQuery::get(Database& conn, size_t slot, const std::string& sql)
+{
+	auto it = thread_query_table.entries.find(id);
+	if (it != thread_query_table.entries.end()
+		&& slot < it->second.queries.size()
+		&& it->second.queries[slot] != nullptr)
+	{
+		return *it->second.queries[slot];
+	}
+
+	return *add(slot, conn.prepare(sql));
+}
+
+void ThreadQuery::prepareAll(Database& db, const std::string& sql, int flags)
+{
+	prepareSlots(db, db.getReaderCount() + 1, sql, flags);
+}
+
+void ThreadQuery::prepareWriter(Database& db, const std::string& sql, int flags)
+{
+	prepareSlots(db, 1, sql, flags);
+}
+
+void ThreadQuery::prepareSlots(Database& db, size_t nslots, const std::string& sql, int flags)
+{
+	auto it = thread_query_table.entries.find(id);
+	for (size_t i = 0; i < nslots; ++i)
+	{
+		if (it != thread_query_table.entries.end()
+			&& i < it->second.queries.size()
+			&& it->second.queries[i] != nullptr)
+		{
+			continue;
+		}
+
+		DatabaseQuery query = (i == 0 ? db : db.getReader(i - 1)).prepare(sql, flags);
+		if (query.prepared())
+		{
+			add(i, std::move(query));
+			it = thread_query_table.entries.find(id);
+		}
+	}
+}
+
+DatabaseQuery* ThreadQuery::add(size_t slot, DatabaseQuery query)
+{
+	DatabaseQuery* ret = new DatabaseQuery(std::move(query));
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->queries.emplace_back(ret);
+	}
+
+	auto it = thread_query_table.entries.find(id);
+	if (it == thread_query_table.entries.end())
+	{
+		if (thread_query_table.entries.size() >= thread_query_table.prune_at)
+			thread_query_table.pruneExpired();
+		it = thread_query_table.entries.emplace(id, ThreadQuerySlots()).first;
+		it->second.state = state;
+	}
+
+	ThreadQuerySlots& slots = it->second;
+	if (slot >= slots.queries.size())
+		slots.queries.resize(slot + 1);
+	slots.queries[slot] = ret;
+	return ret;
+}
+
+size_t ThreadQuery::getStatementCount()
+{
+	std::lock_guard<std::mutex> lock(state->mutex);
+	return state->queries.size();
+}
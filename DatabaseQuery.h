@@ -1,6 +1,10 @@
 #pragma once
 
 #include <memory>
+#include <vector>
+#include <string_view>
+#include <stdint.h>
+#include <stdexcept>
 
 #include "Database.h"
 #include "DatabaseCursor.h"
@@ -12,6 +16,13 @@ namespace sqlgen
 {
 	class Database;
 	class DatabaseCursor;
+	struct CarrayBindHolder;
+
+	class BindError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
 
 	class DatabaseQuery
 	{
@@ -43,6 +54,20 @@ namespace sqlgen
 		virtual void bind(size_t p);
 #endif
 		virtual void bind(const char* buffer, size_t bsize);
+		virtual void bindNull();
+		// Binds a blob of size zero bytes, to be filled with DatabaseBlob
+		virtual void bindZeroBlob(int64_t size);
+
+		// Binds text without copying it. Data has to stay valid until the next bind or reset
+		virtual void bindView(std::string_view str);
+
+		// Binds an array to a carray(?) table-valued function parameter.
+		// Data is not copied and has to stay valid until the next bind or reset
+		virtual void bindArray(const int* data, size_t n);
+		virtual void bindArray(const int64_t* data, size_t n);
+		virtual void bindArray(const double* data, size_t n);
+		virtual void bindArray(const std::string* data, size_t n);
+		virtual void bindBlobArray(const std::string* data, size_t n);
 
 		virtual void reset();
 
@@ -57,6 +82,7 @@ namespace sqlgen
 
 	private:
 		bool Execute(int timeoutms);
+		void bindCarray(void* data, size_t n, int type, std::unique_ptr<CarrayBindHolder> holder);
 		int step(db_single_result* res, int timeoutms, int& tries, bool& reset);
 
 		void setupStepping(int timeoutms);
@@ -79,4 +105,111 @@ namespace sqlgen
 		friend class DatabaseCursor;
 	};
 
+	/**
+	* Statement of a generated read-only function. Prepared lazily on each
+	* connection the function is routed to.
+	*/
+	class RoutedQuery
+	{
+	public:
+		DatabaseQuery& get(ReadConnection& conn, const std::string& sql)
+		{
+			if (conn.getSlot() >= queries.size())
+				queries.resize(conn.getSlot() + 1);
+
+			std::unique_ptr<DatabaseQuery>& query = queries[conn.getSlot()];
+			if (!query)
+				query.reset(new DatabaseQuery(conn.database().prepare(sql)));
+			return *query;
+		}
+
+		//Statement on the writer connection
+		DatabaseQuery& get(Database& db, const std::string& sql)
+		{
+			ReadConnection conn(db, 0, nullptr);
+			return get(conn, sql);
+		}
+
+		//Prepares the statement on the writer and all readers
+		void prepareAll(Database& db, const std::string& sql, int flags)
+		{
+			if (queries.size() < db.getReaderCount() + 1)
+				queries.resize(db.getReaderCount() + 1);
+
+			for (size_t i = 0; i < queries.size(); ++i)
+			{
+				if (queries[i] && queries[i]->prepared())
+					continue;
+
+				DatabaseQuery query = (i == 0 ? db : db.getReader(i - 1)).prepare(sql, flags);
+				if (query.prepared())
+					queries[i].reset(new DatabaseQuery(std::move(query)));
+			}
+		}
+
+		//Prepares the statement on the writer only
+		void prepareWriter(Database& db, const std::string& sql, int flags)
+		{
+			if (queries.empty())
+				queries.resize(1);
+
+			if (queries[0] && queries[0]->prepared())
+				return;
+
+			DatabaseQuery query = db.prepare(sql, flags);
+			if (query.prepared())
+				queries[0].reset(new DatabaseQuery(std::move(query)));
+		}
+
+	private:
+		std::vector<std::unique_ptr<DatabaseQuery> > queries;
+	};
+
+	struct ThreadQueryState;
+
+	/**
+	* Statement of a generated function in a DAO that is shared between
+	* threads (@threads shared in -SQLGenConfig). Every thread gets its own
+	* prepared statement per connection, so concurrent calls do not share
+	* bindings or cursors. Lookups go through a thread_local table without
+	* locking; only the first call of a thread on a connection prepares.
+	* The statements are finalized when the ThreadQuery is destroyed or
+	* their thread exits.
+	*/
+	class ThreadQuery
+	{
+	public:
+		ThreadQuery();
+		~ThreadQuery();
+
+		ThreadQuery(const ThreadQuery&) = delete;
+		ThreadQuery& operator=(const ThreadQuery&) = delete;
+
+		DatabaseQuery& get(ReadConnection& conn, const std::string& sql) {
+			return get(conn.database(), conn.getSlot(), sql);
+		}
+
+		//Statement on the writer connection
+		DatabaseQuery& get(Database& db, const std::string& sql) {
+			return get(db, 0, sql);
+		}
+
+		//Prepares the statement of the calling thread on the writer and all readers
+		void prepareAll(Database& db, const std::string& sql, int flags);
+
+		//Prepares the statement of the calling thread on the writer only
+		void prepareWriter(Database& db, const std::string& sql, int flags);
+
+		//Number of statements prepared by all threads
+		size_t getStatementCount();
+
+	private:
+		DatabaseQuery& get(Database& conn, size_t slot, const std::string& sql);
+		DatabaseQuery* add(size_t slot, DatabaseQuery query);
+		void prepareSlots(Database& db, size_t nslots, const std::string& sql, int flags);
+
+		uint64_t id;
+		std::shared_ptr<ThreadQueryState> state;
+	};
+
 }
\ No newline at end of file
@@ -0,0 +1,416 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "Exporter.h"
+#include "DatabaseQuery.h"
+#include "DatabaseCursor.h"
+#include "stringtools.h"
+#include <string.h>
+#include <string_view>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <deque>
+#include <future>
+#include <chrono>
+
+#ifdef SQLGEN_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace sqlgen;
+
+namespace
+{
+	const char c_binary_magic[] = "SQLGENB1";
+
+	void putU32(std::string& out, uint32_t v)
+	{
+		char b[4];
+		for (size_t i = 0; i < 4; ++i)
+			b[i] = static_cast<char>((v >> (i * 8)) & 0xFF);
+		out.append(b, 4);
+	}
+
+	void putU64(std::string& out, uint64_t v)
+	{
+		char b[8];
+		for (size_t i = 0; i < 8; ++i)
+			b[i] = static_cast<char>((v >> (i * 8)) & 0xFF);
+		out.append(b, 8);
+	}
+
+	uint64_t getU64(const char* p)
+	{
+		uint64_t v = 0;
+		for (size_t i = 0; i < 8; ++i)
+			v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (i * 8);
+		return v;
+	}
+
+	uint32_t getU32(const char* p)
+	{
+		uint32_t v = 0;
+		for (size_t i = 0; i < 4; ++i)
+			v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (i * 8);
+		return v;
+	}
+
+	void putBinaryField(std::string& out, ColumnType type, std::string_view data)
+	{
+		out.push_back(static_cast<char>(type));
+		putU32(out, static_cast<uint32_t>(data.size()));
+		out.append(data.data(), data.size());
+	}
+
+	//Quoted like Importer parses it. Empty strings are quoted to distinguish them from NULL
+	void putTextField(std::string& out, std::string_view data, char delimiter)
+	{
+		bool needs_quote = false;
+		for (char ch : data)
+		{
+			if (ch == delimiter || ch == '\n' || ch == '\r' || ch == '"')
+			{
+				needs_quote = true;
+				break;
+			}
+		}
+
+		if (!needs_quote && !data.empty())
+		{
+			out.append(data.data(), data.size());
+			return;
+		}
+
+		out.push_back('"');
+		size_t start = 0;
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			if (data[i] == '"')
+			{
+				out.append(data.data() + start, i + 1 - start);
+				out.push_back('"');
+				start = i + 1;
+			}
+		}
+		out.append(data.data() + start, data.size() - start);
+		out.push_back('"');
+	}
+
+	std::string compressChunk(const std::string& data, int level)
+	{
+#ifdef SQLGEN_HAVE_ZLIB
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		//15+16: gzip header and trailer
+		if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw ExportError("Error initializing zlib");
+
+		std::string ret;
+		ret.resize(deflateBound(&zs, static_cast<uLong>(data.size())) + 32);
+		zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		zs.avail_in = static_cast<uInt>(data.size());
+		zs.next_out = reinterpret_cast<Bytef*>(&ret[0]);
+		zs.avail_out = static_cast<uInt>(ret.size());
+		int rc = deflate(&zs, Z_FINISH);
+		ret.resize(zs.total_out);
+		deflateEnd(&zs);
+		if (rc != Z_STREAM_END)
+			throw ExportError("Error compressing export chunk (zlib error " + std::to_string(rc) + ")");
+		return ret;
+#else
+		(void)data;
+		(void)level;
+		throw ExportError("Export compression is not available (built without zlib)");
+#endif
+	}
+
+	class ChunkWriter
+	{
+	public:
+		ChunkWriter(std::ostream& out, const ExportOptions& options, ExportStats& stats)
+			: out(out), options(options), stats(stats)
+		{
+#ifndef SQLGEN_HAVE_ZLIB
+			if (options.compress_threads > 0)
+				throw ExportError("Export compression is not available (built without zlib)");
+#endif
+		}
+
+		void write(std::string& chunk)
+		{
+			stats.bytes += chunk.size();
+
+			if (options.compress_threads == 0)
+			{
+				writeOut(chunk);
+				chunk.clear();
+				return;
+			}
+
+			while (pending.size() >= options.compress_threads)
+				writeFront();
+
+			int level = options.compress_level;
+			pending.push_back(std::async(std::launch::async, [level](std::string data) {
+				return compressChunk(data, level);
+			}, std::move(chunk)));
+			chunk = std::string();
+			chunk.reserve(options.buffer_size + options.buffer_size / 8);
+		}
+
+		void finish()
+		{
+			while (!pending.empty())
+				writeFront();
+			out.flush();
+			if (!out)
+				throw ExportError("Error writing export output");
+		}
+
+	private:
+		void writeFront()
+		{
+			std::string data = pending.front().get();
+			pending.pop_front();
+			writeOut(data);
+		}
+
+		void writeOut(const std::string& data)
+		{
+			out.write(data.data(), static_cast<std::streamsize>(data.size()));
+			if (!out)
+				throw ExportError("Error writing export output");
+			stats.written_bytes += data.size();
+		}
+
+		std::ostream& out;
+		const ExportOptions& options;
+		ExportStats& stats;
+		std::deque<std::future<std::string> > pending;
+	};
+}
+
+Exporter::Exporter(ExportOptions options)
+	: options(options)
+{
+	if (this->options.buffer_size == 0)
+		this->options.buffer_size = 1;
+}
+
+ExportStats Exporter::exportQuery(DatabaseQuery& query, std::ostream& out)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	ExportStats stats;
+	ChunkWriter writer(out, options, stats);
+
+	std::string chunk;
+	chunk.reserve(options.buffer_size + options.buffer_size / 8);
+
+	DatabaseCursor& cursor = query.cursor();
+	bool has_row = cursor.next();
+	int ncols = cursor.columnCount();
+	char delimiter = options.format == ExportFormat_Tsv ? '\t' : ',';
+
+	if (options.format == ExportFormat_Binary)
+	{
+		chunk.append(c_binary_magic, 8);
+		putU32(chunk, static_cast<uint32_t>(ncols));
+		for (int i = 0; i < ncols; ++i)
+		{
+			std::string name = cursor.columnName(i);
+			putU32(chunk, static_cast<uint32_t>(name.size()));
+			chunk += name;
+		}
+	}
+	else if (options.header)
+	{
+		for (int i = 0; i < ncols; ++i)
+		{
+			if (i > 0)
+				chunk.push_back(delimiter);
+			putTextField(chunk, cursor.columnName(i), delimiter);
+		}
+		chunk.push_back('\n');
+	}
+
+	for (; has_row; has_row = cursor.next())
+	{
+		if (options.format == ExportFormat_Binary)
+		{
+			size_t len_pos = chunk.size();
+			putU32(chunk, 0);
+			for (int i = 0; i < ncols; ++i)
+			{
+				ColumnType type = cursor.columnType(i);
+				switch (type)
+				{
+				case ColumnType_Integer:
+				{
+					int64_t v;
+					cursor.get(i, v);
+					chunk.push_back(static_cast<char>(type));
+					putU64(chunk, static_cast<uint64_t>(v));
+				} break;
+				case ColumnType_Float:
+				{
+					double v;
+					cursor.get(i, v);
+					uint64_t bits;
+					memcpy(&bits, &v, sizeof(bits));
+					chunk.push_back(static_cast<char>(type));
+					putU64(chunk, bits);
+				} break;
+				case ColumnType_Text:
+				case ColumnType_Blob:
+					putBinaryField(chunk, type, cursor.getView(i));
+					break;
+				default:
+					chunk.push_back(static_cast<char>(ColumnType_Null));
+					break;
+				}
+			}
+			uint32_t row_len = static_cast<uint32_t>(chunk.size() - len_pos - 4);
+			for (size_t i = 0; i < 4; ++i)
+				chunk[len_pos + i] = static_cast<char>((row_len >> (i * 8)) & 0xFF);
+		}
+		else
+		{
+			for (int i = 0; i < ncols; ++i)
+			{
+				if (i > 0)
+					chunk.push_back(delimiter);
+				ColumnType type = cursor.columnType(i);
+				if (type == ColumnType_Null)
+					continue;
+				else if (type == ColumnType_Integer || type == ColumnType_Float)
+					chunk.append(cursor.getView(i));
+				else
+					putTextField(chunk, cursor.getView(i), delimiter);
+			}
+			chunk.push_back('\n');
+		}
+
+		++stats.rows;
+
+		if (chunk.size() >= options.buffer_size)
+			writer.write(chunk);
+	}
+
+	if (cursor.hasError())
+		throw ExportError("Error reading export query: " + query.getErrMsg());
+
+	if (!chunk.empty())
+		writer.write(chunk);
+	writer.finish();
+
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	return stats;
+}
+
+ExportStats Exporter::exportQuery(DatabaseQuery& query, const std::string& file)
+{
+	std::ofstream out(file, std::ios::binary | std::ios::out | std::ios::trunc);
+	if (!out.is_open())
+		throw ExportError("Cannot open " + file + " for writing");
+	return exportQuery(query, out);
+}
+
+ExportOptions Exporter::optionsForFile(const std::string& file)
+{
+	ExportOptions options;
+	std::string name = strlower(file);
+	if (name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0)
+	{
+		options.compress_threads = 4;
+		name.resize(name.size() - 3);
+	}
+
+	if (name.size() > 4 && (name.compare(name.size() - 4, 4, ".tsv") == 0
+		|| name.compare(name.size() - 4, 4, ".tab") == 0))
+		options.format = ExportFormat_Tsv;
+	else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0)
+		options.format = ExportFormat_Binary;
+	return options;
+}
+
+BinaryRowReader::BinaryRowReader(std::istream& in)
+	: in(in)
+{
+	char header[12];
+	if (!in.read(header, sizeof(header))
+		|| memcmp(header, c_binary_magic, 8) != 0)
+		throw ExportError("Not a binary row export");
+
+	uint32_t ncols = getU32(header + 8);
+	for (uint32_t i = 0; i < ncols; ++i)
+	{
+		char len[4];
+		if (!in.read(len, sizeof(len)))
+			throw ExportError("Truncated binary row header");
+		std::string name(getU32(len), '\0');
+		if (!name.empty() && !in.read(&name[0], name.size()))
+			throw ExportError("Truncated binary row header");
+		column_names.push_back(name);
+	}
+}
+
+bool BinaryRowReader::next(std::vector<BinaryValue>& row)
+{
+	char len[4];
+	in.read(len, sizeof(len));
+	if (in.gcount() == 0)
+		return false;
+	if (in.gcount() != sizeof(len))
+		throw ExportError("Truncated binary row");
+
+	buf.resize(getU32(len));
+	if (!buf.empty() && !in.read(&buf[0], buf.size()))
+		throw ExportError("Truncated binary row");
+
+	row.resize(column_names.size());
+	size_t pos = 0;
+	for (BinaryValue& val : row)
+	{
+		if (pos >= buf.size())
+			throw ExportError("Invalid binary row");
+
+		val.type = static_cast<ColumnType>(buf[pos++]);
+		val.data.clear();
+		switch (val.type)
+		{
+		case ColumnType_Integer:
+		case ColumnType_Float:
+		{
+			if (pos + 8 > buf.size())
+				throw ExportError("Invalid binary row");
+			uint64_t bits = getU64(&buf[pos]);
+			pos += 8;
+			if (val.type == ColumnType_Integer)
+				val.i = static_cast<int64_t>(bits);
+			else
+				memcpy(&val.d, &bits, sizeof(bits));
+		} break;
+		case ColumnType_Text:
+		case ColumnType_Blob:
+		{
+			if (pos + 4 > buf.size())
+				throw ExportError("Invalid binary row");
+			uint32_t size = getU32(&buf[pos]);
+			pos += 4;
+			if (pos + size > buf.size())
+				throw ExportError("Invalid binary row");
+			val.data.assign(&buf[pos], size);
+			pos += size;
+		} break;
+		case ColumnType_Null:
+			break;
+		default:
+			throw ExportError("Invalid binary row");
+		}
+	}
+	return true;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <iosfwd>
+#include <stdint.h>
+#include "DatabaseCursor.h"
+
+namespace sqlgen
+{
+	class DatabaseQuery;
+
+	class ExportError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	enum ExportFormat
+	{
+		ExportFormat_Csv,
+		ExportFormat_Tsv,
+		//Length-prefixed binary rows. See BinaryRowReader
+		ExportFormat_Binary
+	};
+
+	struct ExportOptions
+	{
+		ExportFormat format = ExportFormat_Csv;
+		//Write the column names as first row (CSV/TSV)
+		bool header = true;
+		//Size of the output chunks written to the stream
+		size_t buffer_size = 4 * 1024 * 1024;
+		//gzip compress chunks on this many threads (0 = no compression). Needs zlib
+		size_t compress_threads = 0;
+		int compress_level = 6;
+	};
+
+	struct ExportStats
+	{
+		size_t rows = 0;
+		//Uncompressed bytes
+		size_t bytes = 0;
+		size_t written_bytes = 0;
+		double seconds = 0;
+	};
+
+	/**
+	* Streams the rows of a query into CSV, TSV or a binary row format.
+	* Rows are read from the cursor and appended to a chunk buffer which is
+	* written once it is full, so memory use does not depend on the number of
+	* rows. With compression each chunk becomes a separate gzip member
+	* compressed on a worker thread while the next chunk is filled; the
+	* members are written in order, so the output is a valid gzip file.
+	*
+	* CSV and TSV fields are quoted with '"' if they contain the delimiter,
+	* quotes or line breaks, so Importer reads them back unchanged. NULL is an
+	* empty unquoted field, empty strings are written as "" (see
+	* ImportOptions::empty_as_null).
+	*/
+	class Exporter
+	{
+	public:
+		Exporter(ExportOptions options = ExportOptions());
+
+		//Parameters have to be bound to the query before
+		ExportStats exportQuery(DatabaseQuery& query, std::ostream& out);
+		ExportStats exportQuery(DatabaseQuery& query, const std::string& file);
+
+		static ExportOptions optionsForFile(const std::string& file);
+
+	private:
+		ExportOptions options;
+	};
+
+	struct BinaryValue
+	{
+		ColumnType type = ColumnType_Null;
+		int64_t i = 0;
+		double d = 0;
+		//Text or blob
+		std::string data;
+	};
+
+	/**
+	* Reads the (uncompressed) binary row format:
+	* "SQLGENB1", u32 column count, per column u32 length + name, then per
+	* row u32 payload length + per column u8 ColumnType followed by i64
+	* (integer), f64 (float), u32 length + bytes (text/blob) or nothing
+	* (NULL). All numbers are little-endian.
+	*/
+	class BinaryRowReader
+	{
+	public:
+		BinaryRowReader(std::istream& in);
+
+		const std::vector<std::string>& columns() {
+			return column_names;
+		}
+
+		//Returns false at end of input. Throws ExportError on truncated rows
+		bool next(std::vector<BinaryValue>& row);
+
+	private:
+		std::istream& in;
+		std::vector<std::string> column_names;
+		std::string buf;
+	};
+}
@@ -0,0 +1,560 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "Importer.h"
+#include "Database.h"
+#include "DatabaseQuery.h"
+#include "stringtools.h"
+#include "sqlite/sqlite3.h"
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SQLGEN_IMPORT_SSE2
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+using namespace sqlgen;
+
+namespace
+{
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const std::string& fn)
+		{
+#ifdef _WIN32
+			file = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE)
+				throw ImportError("Could not open [" + fn + "]");
+
+			LARGE_INTEGER fsize;
+			if (!GetFileSizeEx(file, &fsize))
+			{
+				CloseHandle(file);
+				throw ImportError("Could not get size of [" + fn + "]");
+			}
+			size = static_cast<size_t>(fsize.QuadPart);
+			if (size == 0)
+				return;
+
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping != NULL)
+				addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			if (addr == nullptr)
+			{
+				if (mapping != NULL)
+					CloseHandle(mapping);
+				CloseHandle(file);
+				throw ImportError("Could not map [" + fn + "]");
+			}
+#else
+			fd = open(fn.c_str(), O_RDONLY);
+			if (fd == -1)
+				throw ImportError("Could not open [" + fn + "]");
+
+			struct stat st;
+			if (fstat(fd, &st) != 0)
+			{
+				close(fd);
+				throw ImportError("Could not get size of [" + fn + "]");
+			}
+			size = static_cast<size_t>(st.st_size);
+			if (size == 0)
+				return;
+
+			addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr == MAP_FAILED)
+			{
+				close(fd);
+				throw ImportError("Could not map [" + fn + "]");
+			}
+			madvise(addr, size, MADV_SEQUENTIAL);
+#endif
+		}
+
+		~MappedFile()
+		{
+#ifdef _WIN32
+			if (addr != nullptr)
+				UnmapViewOfFile(addr);
+			if (mapping != NULL)
+				CloseHandle(mapping);
+			CloseHandle(file);
+#else
+			if (addr != nullptr)
+				munmap(addr, size);
+			close(fd);
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		std::string_view data()
+		{
+			if (addr == nullptr)
+				return std::string_view();
+			return std::string_view(static_cast<const char*>(addr), size);
+		}
+
+	private:
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = NULL;
+#else
+		int fd = -1;
+#endif
+		void* addr = nullptr;
+		size_t size = 0;
+	};
+
+	//Returns the first delimiter, quote, \n or \r at or after p, or end
+	const char* findSpecial(const char* p, const char* end, char delim, char quote)
+	{
+#ifdef SQLGEN_IMPORT_SSE2
+		const __m128i vdelim = _mm_set1_epi8(delim);
+		const __m128i vquote = _mm_set1_epi8(quote);
+		const __m128i vlf = _mm_set1_epi8('\n');
+		const __m128i vcr = _mm_set1_epi8('\r');
+		while (end - p >= 16)
+		{
+			__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			__m128i match = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, vdelim), _mm_cmpeq_epi8(chunk, vquote)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, vlf), _mm_cmpeq_epi8(chunk, vcr)));
+			int mask = _mm_movemask_epi8(match);
+			if (mask != 0)
+			{
+#ifdef _MSC_VER
+				unsigned long idx;
+				_BitScanForward(&idx, static_cast<unsigned long>(mask));
+				return p + idx;
+#else
+				return p + __builtin_ctz(static_cast<unsigned int>(mask));
+#endif
+			}
+			p += 16;
+		}
+#endif
+		for (; p < end; ++p)
+		{
+			char c = *p;
+			if (c == delim || c == quote || c == '\n' || c == '\r')
+				return p;
+		}
+		return end;
+	}
+
+	class CsvParser
+	{
+	public:
+		CsvParser(std::string_view data, const ImportOptions& options)
+			: p(data.data()), end(data.data() + data.size()),
+			delim(options.delimiter), quote(options.quote) {}
+
+		/**
+		* Appends the fields of the next record. Returns false at the end of the data.
+		* Blank lines are records with one empty field. The line break of the last
+		* record is optional, so it does not start another record.
+		*/
+		bool nextRecord(std::vector<std::string_view>& fields, std::deque<std::string>& storage)
+		{
+			if (p >= end)
+				return false;
+
+			++record;
+
+			while (true)
+			{
+				if (quote != '\0' && p < end && *p == quote)
+				{
+					fields.push_back(parseQuoted(storage));
+				}
+				else
+				{
+					const char* start = p;
+					//Quotes within unquoted fields are literal
+					while ((p = findSpecial(p, end, delim, quote != '\0' ? quote : delim)) < end
+						&& *p == quote)
+					{
+						++p;
+					}
+					fields.push_back(p == start ? std::string_view() : std::string_view(start, p - start));
+				}
+
+				if (p >= end)
+					break;
+
+				if (*p == delim)
+				{
+					++p;
+					continue;
+				}
+
+				if (*p == '\r')
+				{
+					++p;
+					if (p < end && *p == '\n')
+						++p;
+				}
+				else
+				{
+					++p;
+				}
+				break;
+			}
+			return true;
+		}
+
+		size_t getRecord()
+		{
+			return record;
+		}
+
+	private:
+		std::string_view parseQuoted(std::deque<std::string>& storage)
+		{
+			++p;
+			const char* start = p;
+			std::string* unescaped = nullptr;
+			while (true)
+			{
+				const char* q = static_cast<const char*>(memchr(p, quote, end - p));
+				if (q == nullptr)
+					throw ImportError("Unterminated quoted field in record " + std::to_string(record));
+
+				if (q + 1 < end && q[1] == quote)
+				{
+					//Escaped quote. Only these fields are copied
+					if (unescaped == nullptr)
+					{
+						storage.emplace_back();
+						unescaped = &storage.back();
+					}
+					unescaped->append(start, q + 1);
+					p = q + 2;
+					start = p;
+					continue;
+				}
+
+				p = q + 1;
+				if (p < end && *p != delim && *p != '\n' && *p != '\r')
+					throw ImportError("Unexpected character after quoted field in record " + std::to_string(record));
+
+				if (unescaped != nullptr)
+				{
+					unescaped->append(start, q);
+					return *unescaped;
+				}
+				//Non-null data, so empty quoted fields are not bound as NULL
+				return std::string_view(start, q - start);
+			}
+		}
+
+		const char* p;
+		const char* end;
+		char delim;
+		char quote;
+		size_t record = 0;
+	};
+
+	struct ImportBatch
+	{
+		std::vector<std::string_view> fields;
+		std::deque<std::string> storage;
+		size_t rows = 0;
+		size_t first_record = 0;
+
+		void clear()
+		{
+			fields.clear();
+			storage.clear();
+			rows = 0;
+		}
+	};
+
+	//Hands parsed batches to the inserting thread and used ones back for reuse
+	class BatchQueue
+	{
+	public:
+		BatchQueue(size_t max_batches)
+			: max_batches(max_batches) {}
+
+		std::unique_ptr<ImportBatch> getFree()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (free_batches.empty())
+				return std::make_unique<ImportBatch>();
+
+			std::unique_ptr<ImportBatch> ret = std::move(free_batches.back());
+			free_batches.pop_back();
+			ret->clear();
+			return ret;
+		}
+
+		void recycle(std::unique_ptr<ImportBatch> batch)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			free_batches.push_back(std::move(batch));
+		}
+
+		bool push(std::unique_ptr<ImportBatch> batch)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (batches.size() >= max_batches && !aborted)
+				cond.wait(lock);
+
+			if (aborted)
+				return false;
+
+			batches.push_back(std::move(batch));
+			cond.notify_all();
+			return true;
+		}
+
+		//Returns nullptr after the last batch. Rethrows parse errors
+		std::unique_ptr<ImportBatch> pop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (batches.empty() && !done)
+				cond.wait(lock);
+
+			if (batches.empty())
+			{
+				if (error)
+					std::rethrow_exception(error);
+				return nullptr;
+			}
+
+			std::unique_ptr<ImportBatch> ret = std::move(batches.front());
+			batches.pop_front();
+			cond.notify_all();
+			return ret;
+		}
+
+		void finish(std::exception_ptr err)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+			error = err;
+			cond.notify_all();
+		}
+
+		void abort()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			aborted = true;
+			cond.notify_all();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<std::unique_ptr<ImportBatch> > batches;
+		std::vector<std::unique_ptr<ImportBatch> > free_batches;
+		size_t max_batches;
+		bool done = false;
+		bool aborted = false;
+		std::exception_ptr error;
+	};
+
+	std::string quoteIdentifier(const std::string& name)
+	{
+		return "\"" + greplace("\"", "\"\"", name) + "\"";
+	}
+}
+
+Importer::Importer(Database& db, ImportOptions options)
+	: db(db), options(std::move(options))
+{
+}
+
+ImportOptions Importer::optionsForFile(const std::string& file)
+{
+	ImportOptions ret;
+	std::string ext = strlower(file.size() > 4 ? file.substr(file.size() - 4) : file);
+	//Quoted like CSV, as Exporter writes it
+	if (ext == ".tsv" || ext == ".tab")
+		ret.delimiter = '\t';
+	return ret;
+}
+
+ImportStats Importer::importFile(const std::string& file, const std::string& table)
+{
+	MappedFile mapped(file);
+	return importData(mapped.data(), table);
+}
+
+ImportStats Importer::importData(std::string_view data, const std::string& table)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	CsvParser parser(data, options);
+
+	std::vector<std::string> columns = options.columns;
+	if (options.header)
+	{
+		std::vector<std::string_view> header;
+		std::deque<std::string> storage;
+		if (parser.nextRecord(header, storage) && columns.empty())
+		{
+			for (std::string_view name : header)
+				columns.push_back(trim(std::string(name)));
+		}
+	}
+
+	size_t table_columns = db.read("PRAGMA table_info(" + quoteIdentifier(table) + ")").size();
+	if (table_columns == 0)
+	{
+		if (!options.create_table || columns.empty())
+			throw ImportError("Table [" + table + "] does not exist");
+
+		std::string create = "CREATE TABLE " + quoteIdentifier(table) + " (";
+		for (size_t i = 0; i < columns.size(); ++i)
+			create += (i > 0 ? ", " : "") + quoteIdentifier(columns[i]);
+		db.write(create + ")");
+		table_columns = columns.size();
+	}
+
+	size_t n_columns = columns.empty() ? table_columns : columns.size();
+
+	std::string insert = "INSERT INTO " + quoteIdentifier(table);
+	if (!columns.empty())
+	{
+		insert += " (";
+		for (size_t i = 0; i < columns.size(); ++i)
+			insert += (i > 0 ? ", " : "") + quoteIdentifier(columns[i]);
+		insert += ")";
+	}
+	insert += " VALUES (";
+	for (size_t i = 0; i < n_columns; ++i)
+		insert += i > 0 ? ", ?" : "?";
+	insert += ")";
+
+	DatabaseQuery q = db.prepare(insert, PrepareFlag_Persistent);
+
+	BatchQueue queue(4);
+	double parse_seconds = 0;
+	size_t batch_rows = (std::max)(options.batch_rows, static_cast<size_t>(1));
+
+	std::thread parser_thread([&]() {
+		try
+		{
+			while (true)
+			{
+				std::unique_ptr<ImportBatch> batch = queue.getFree();
+				auto parse_start = std::chrono::steady_clock::now();
+				batch->first_record = parser.getRecord() + 1;
+				while (batch->rows < batch_rows)
+				{
+					size_t n_fields = batch->fields.size();
+					if (!parser.nextRecord(batch->fields, batch->storage))
+						break;
+
+					if (batch->fields.size() - n_fields != n_columns)
+					{
+						throw ImportError("Record " + std::to_string(parser.getRecord()) + " has "
+							+ std::to_string(batch->fields.size() - n_fields) + " fields. Expected "
+							+ std::to_string(n_columns));
+					}
+					++batch->rows;
+				}
+
+				parse_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - parse_start).count();
+
+				if (batch->rows == 0)
+					break;
+
+				if (!queue.push(std::move(batch)))
+					return;
+			}
+			queue.finish(nullptr);
+		}
+		catch (...)
+		{
+			queue.finish(std::current_exception());
+		}
+	});
+
+	ImportStats stats;
+	size_t chunk_rows = 0;
+	try
+	{
+		db.beginWriteTransaction();
+		std::unique_ptr<ImportBatch> batch;
+		while ((batch = queue.pop()) != nullptr)
+		{
+			const std::string_view* fields = batch->fields.data();
+			for (size_t row = 0; row < batch->rows; ++row)
+			{
+				for (size_t i = 0; i < n_columns; ++i)
+				{
+					const std::string_view& field = fields[row * n_columns + i];
+					if (field.data() != nullptr)
+						q.bindView(field);
+					else if (options.empty_as_null)
+						q.bindNull();
+					else
+						q.bindView(std::string_view("", 0));
+				}
+
+				if (!q.write())
+				{
+					std::string err = sqlite3_errmsg(db.getDatabase());
+					q.reset();
+					throw ImportError("Inserting record " + std::to_string(batch->first_record + row)
+						+ " failed: " + err);
+				}
+				q.reset();
+
+				++stats.rows;
+				if (++chunk_rows >= options.chunk_rows)
+				{
+					db.endTransaction();
+					db.beginWriteTransaction();
+					chunk_rows = 0;
+				}
+			}
+			queue.recycle(std::move(batch));
+		}
+		db.endTransaction();
+	}
+	catch (...)
+	{
+		queue.abort();
+		parser_thread.join();
+		if (!sqlite3_get_autocommit(db.getDatabase()))
+			db.rollbackTransaction();
+		throw;
+	}
+
+	parser_thread.join();
+
+	stats.bytes = data.size();
+	stats.parse_seconds = parse_seconds;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	return stats;
+}
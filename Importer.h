@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+namespace sqlgen
+{
+	class Database;
+
+	class ImportError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	struct ImportOptions
+	{
+		char delimiter = ',';
+		//Quote character. '\0' disables quoting (TSV without quotes)
+		char quote = '"';
+		//First row contains the column names
+		bool header = true;
+		//Column names. If empty, header or table column order is used
+		std::vector<std::string> columns;
+		//Bind unquoted empty fields as NULL
+		bool empty_as_null = false;
+		//Create the table with the header column names if it does not exist
+		bool create_table = false;
+		//Rows per write transaction
+		size_t chunk_rows = 100000;
+		//Rows per batch handed from the parser thread to the inserting thread
+		size_t batch_rows = 4096;
+	};
+
+	struct ImportStats
+	{
+		size_t rows = 0;
+		size_t bytes = 0;
+		double seconds = 0;
+		//Time the parser thread spent parsing (not waiting for the inserting thread)
+		double parse_seconds = 0;
+	};
+
+	/**
+	* Imports CSV/TSV data into a table. The file is memory mapped and parsed
+	* on a separate thread while the calling thread binds the fields as
+	* views into the mapping (or into unescaped copies of quoted fields) to
+	* one prepared INSERT and commits every chunk_rows rows.
+	*/
+	class Importer
+	{
+	public:
+		Importer(Database& db, ImportOptions options = ImportOptions());
+
+		ImportStats importFile(const std::string& file, const std::string& table);
+		ImportStats importData(std::string_view data, const std::string& table);
+
+		static ImportOptions optionsForFile(const std::string& file);
+
+	private:
+		Database& db;
+		ImportOptions options;
+	};
+}
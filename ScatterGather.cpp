@@ -0,0 +1,513 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "ScatterGather.h"
+#include "Database.h"
+#include "DatabaseQuery.h"
+#include "DatabaseCursor.h"
+#include "ShardedDatabase.h"
+#include "stringtools.h"
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+
+using namespace sqlgen;
+
+namespace
+{
+	//Rows a part collects before handing them to the merge
+	const size_t c_part_batch_rows = 64;
+
+	//Read-ahead buffer of one part, filled by its thread
+	struct PartChannel
+	{
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<ScatterRow> rows;
+		std::vector<std::string> columns;
+		bool has_columns = false;
+		bool done = false;
+		std::exception_ptr error;
+		size_t rows_read = 0;
+	};
+
+	struct MergeState
+	{
+		std::vector<std::unique_ptr<PartChannel> > channels;
+		std::atomic<bool> stop{ false };
+		size_t capacity = 0;
+	};
+
+	bool hasLimit(const std::string& sql)
+	{
+		//LIMIT outside of parentheses (subqueries)
+		std::string lsql = strlower(sql);
+		int depth = 0;
+		size_t limit_pos = std::string::npos;
+		for (size_t i = 0; i < lsql.size(); ++i)
+		{
+			if (lsql[i] == '(')
+				++depth;
+			else if (lsql[i] == ')')
+				--depth;
+			else if (depth == 0 && lsql.compare(i, 5, "limit") == 0
+				&& (i == 0 || !isalnum(static_cast<unsigned char>(lsql[i - 1])))
+				&& (i + 5 >= lsql.size() || !isalnum(static_cast<unsigned char>(lsql[i + 5]))))
+				limit_pos = i;
+		}
+		return limit_pos != std::string::npos;
+	}
+
+	void readValue(DatabaseCursor& cursor, int col, BinaryValue& v)
+	{
+		v.type = cursor.columnType(col);
+		switch (v.type)
+		{
+		case ColumnType_Integer:
+			cursor.get(col, v.i);
+			break;
+		case ColumnType_Float:
+			cursor.get(col, v.d);
+			break;
+		case ColumnType_Text:
+		case ColumnType_Blob:
+		{
+			std::string_view data = cursor.getView(col);
+			v.data.assign(data.data(), data.size());
+		} break;
+		default:
+			break;
+		}
+	}
+
+	void pushRows(MergeState& state, PartChannel& channel, std::vector<ScatterRow>& batch)
+	{
+		std::unique_lock<std::mutex> lock(channel.mutex);
+		while (channel.rows.size() >= state.capacity && !state.stop)
+			channel.cond.wait(lock);
+		for (ScatterRow& row : batch)
+			channel.rows.push_back(std::move(row));
+		channel.rows_read += batch.size();
+		batch.clear();
+		channel.cond.notify_all();
+	}
+
+	void runPart(MergeState& state, PartChannel& channel, Database& db, const std::string& sql,
+		const std::function<void(DatabaseQuery&)>& bind)
+	{
+		try
+		{
+			ReadConnection conn = db.acquireReader();
+			DatabaseQuery query = conn.database().prepare(sql);
+			if (bind)
+				bind(query);
+
+			DatabaseCursor& cursor = query.cursor();
+			bool has_row = cursor.next();
+			int ncols = cursor.columnCount();
+			{
+				std::lock_guard<std::mutex> lock(channel.mutex);
+				for (int i = 0; i < ncols; ++i)
+					channel.columns.push_back(cursor.columnName(i));
+				channel.has_columns = true;
+			}
+			channel.cond.notify_all();
+
+			std::vector<ScatterRow> batch;
+			for (; has_row && !state.stop; has_row = cursor.next())
+			{
+				batch.emplace_back(ncols);
+				ScatterRow& row = batch.back();
+				for (int i = 0; i < ncols; ++i)
+					readValue(cursor, i, row[i]);
+
+				if (batch.size() >= c_part_batch_rows)
+					pushRows(state, channel, batch);
+			}
+
+			if (cursor.hasError())
+				throw ScatterError("Error reading scatter query \"" + sql + "\": " + query.getErrMsg());
+
+			query.reset();
+			if (!batch.empty())
+				pushRows(state, channel, batch);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(channel.mutex);
+			channel.error = std::current_exception();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(channel.mutex);
+			channel.done = true;
+		}
+		channel.cond.notify_all();
+	}
+
+	//Rows of one part taken from its channel by the merge
+	class PartReader
+	{
+	public:
+		PartReader(PartChannel& channel)
+			: channel(channel) {}
+
+		bool next(ScatterRow& row)
+		{
+			if (pending.empty())
+			{
+				std::unique_lock<std::mutex> lock(channel.mutex);
+				while (channel.rows.empty() && !channel.done)
+					channel.cond.wait(lock);
+
+				if (channel.rows.empty())
+				{
+					if (channel.error)
+						std::rethrow_exception(channel.error);
+					return false;
+				}
+				pending.swap(channel.rows);
+				channel.cond.notify_all();
+			}
+
+			row = std::move(pending.front());
+			pending.pop_front();
+			return true;
+		}
+
+	private:
+		PartChannel& channel;
+		std::deque<ScatterRow> pending;
+	};
+
+	void checkOrderColumns(const ScatterRow& row, const std::vector<ScatterSortKey>& order_by)
+	{
+		for (const ScatterSortKey& key : order_by)
+		{
+			if (key.column < 0 || static_cast<size_t>(key.column) >= row.size())
+				throw ScatterError("order_by column " + std::to_string(key.column) + " is not in the result (" + std::to_string(row.size()) + " columns)");
+		}
+	}
+
+	int compareRows(const ScatterRow& a, const ScatterRow& b, const std::vector<ScatterSortKey>& order_by)
+	{
+		for (const ScatterSortKey& key : order_by)
+		{
+			int c = compareValues(a[key.column], b[key.column]);
+			if (c != 0)
+				return key.descending ? -c : c;
+		}
+		return 0;
+	}
+
+	void addValue(BinaryValue& sum, const BinaryValue& v)
+	{
+		if (v.type == ColumnType_Null)
+			return;
+
+		if (sum.type == ColumnType_Null)
+		{
+			sum = v;
+			return;
+		}
+
+		if (sum.type == ColumnType_Integer && v.type == ColumnType_Integer)
+		{
+			sum.i += v.i;
+			return;
+		}
+
+		double a = sum.type == ColumnType_Integer ? static_cast<double>(sum.i) : sum.d;
+		double b = v.type == ColumnType_Integer ? static_cast<double>(v.i) : v.d;
+		sum.type = ColumnType_Float;
+		sum.d = a + b;
+	}
+
+	void aggregateRow(ScatterRow& acc, const ScatterRow& row, const std::vector<ScatterAggregate>& aggregates)
+	{
+		for (size_t i = 0; i < aggregates.size() && i < row.size(); ++i)
+		{
+			switch (aggregates[i])
+			{
+			case ScatterAggregate_Count:
+			case ScatterAggregate_Sum:
+				addValue(acc[i], row[i]);
+				break;
+			case ScatterAggregate_Min:
+				if (row[i].type != ColumnType_Null
+					&& (acc[i].type == ColumnType_Null || compareValues(row[i], acc[i]) < 0))
+					acc[i] = row[i];
+				break;
+			case ScatterAggregate_Max:
+				if (row[i].type != ColumnType_Null
+					&& (acc[i].type == ColumnType_Null || compareValues(row[i], acc[i]) > 0))
+					acc[i] = row[i];
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	struct GroupKeyLess
+	{
+		bool operator()(const ScatterRow& a, const ScatterRow& b) const
+		{
+			for (size_t i = 0; i < a.size() && i < b.size(); ++i)
+			{
+				int c = compareValues(a[i], b[i]);
+				if (c != 0)
+					return c < 0;
+			}
+			return a.size() < b.size();
+		}
+	};
+}
+
+int sqlgen::compareValues(const BinaryValue& a, const BinaryValue& b)
+{
+	auto type_class = [](ColumnType type) {
+		switch (type)
+		{
+		case ColumnType_Null: return 0;
+		case ColumnType_Integer:
+		case ColumnType_Float: return 1;
+		case ColumnType_Text: return 2;
+		default: return 3;
+		}
+	};
+
+	int ca = type_class(a.type);
+	int cb = type_class(b.type);
+	if (ca != cb)
+		return ca < cb ? -1 : 1;
+
+	if (ca == 0)
+		return 0;
+
+	if (ca == 1)
+	{
+		if (a.type == ColumnType_Integer && b.type == ColumnType_Integer)
+			return a.i < b.i ? -1 : (a.i > b.i ? 1 : 0);
+
+		double da = a.type == ColumnType_Integer ? static_cast<double>(a.i) : a.d;
+		double db = b.type == ColumnType_Integer ? static_cast<double>(b.i) : b.d;
+		return da < db ? -1 : (da > db ? 1 : 0);
+	}
+
+	int c = memcmp(a.data.data(), b.data.data(), (std::min)(a.data.size(), b.data.size()));
+	if (c != 0)
+		return c < 0 ? -1 : 1;
+	return a.data.size() < b.data.size() ? -1 : (a.data.size() > b.data.size() ? 1 : 0);
+}
+
+void ScatterGather::addPart(Database& db, const std::string& schema)
+{
+	parts.push_back(Part{ &db, schema });
+}
+
+void ScatterGather::addShards(ShardedDatabase& shards)
+{
+	for (size_t i = 0; i < shards.getShardCount(); ++i)
+		addPart(shards.getShard(i));
+}
+
+ScatterStats ScatterGather::execute(const std::string& sql, const std::function<bool(const ScatterRow&)>& row,
+	const ScatterOptions& options, const std::function<void(DatabaseQuery&)>& bind)
+{
+	if (parts.empty())
+		throw ScatterError("Scatter query without parts");
+
+	//Every part holds its connection until the merge is done. Without readers
+	//a part uses the connection itself, which cannot run several statements concurrently
+	std::map<Database*, size_t> db_parts;
+	for (const Part& part : parts)
+		++db_parts[part.db];
+	for (auto& it : db_parts)
+	{
+		size_t readers = it.first->getReaderCount();
+		if (readers == 0 && it.second > 1)
+			throw ScatterError("Scatter query has " + std::to_string(it.second) + " parts on one connection"
+				" without readers. Add a reader per part with Database::addReaders");
+		if (readers > 0 && readers < it.second)
+			throw ScatterError("Scatter query has " + std::to_string(it.second) + " parts on one connection"
+				" but it only has " + std::to_string(readers) + " readers");
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	bool aggregate = !options.aggregates.empty();
+	std::string part_sql = sql;
+	if (options.limit >= 0 && !aggregate && !hasLimit(sql))
+		part_sql += " LIMIT " + std::to_string(options.limit);
+
+	MergeState state;
+	state.capacity = (std::max)(options.buffer_rows, c_part_batch_rows);
+	std::vector<std::thread> threads;
+	for (const Part& part : parts)
+	{
+		state.channels.emplace_back(new PartChannel);
+		PartChannel& channel = *state.channels.back();
+		Database& db = *part.db;
+		std::string curr_sql = greplace("{schema}", part.schema, part_sql);
+		threads.emplace_back([&state, &channel, &db, curr_sql, &bind]() {
+			runPart(state, channel, db, curr_sql, bind);
+		});
+	}
+
+	auto stopParts = [&state, &threads]() {
+		state.stop = true;
+		for (auto& channel : state.channels)
+		{
+			std::lock_guard<std::mutex> lock(channel->mutex);
+			channel->cond.notify_all();
+		}
+		for (std::thread& thread : threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+	};
+
+	ScatterStats stats;
+	stats.parts = parts.size();
+	try
+	{
+		std::vector<PartReader> readers;
+		for (auto& channel : state.channels)
+			readers.emplace_back(*channel);
+
+		size_t limit = options.limit < 0 ? std::string::npos : static_cast<size_t>(options.limit);
+		auto emit = [&](const ScatterRow& r) {
+			if (stats.rows >= limit)
+				return false;
+
+			++stats.rows;
+			return row(r) && stats.rows < limit;
+		};
+
+		if (aggregate)
+		{
+			std::map<ScatterRow, ScatterRow, GroupKeyLess> groups;
+			ScatterRow r;
+			for (PartReader& reader : readers)
+			{
+				while (reader.next(r))
+				{
+					ScatterRow key;
+					for (size_t i = 0; i < options.aggregates.size() && i < r.size(); ++i)
+					{
+						if (options.aggregates[i] == ScatterAggregate_Group)
+							key.push_back(r[i]);
+					}
+
+					auto it = groups.find(key);
+					if (it == groups.end())
+						groups.emplace(std::move(key), std::move(r));
+					else
+						aggregateRow(it->second, r, options.aggregates);
+				}
+			}
+
+			std::vector<ScatterRow> result;
+			result.reserve(groups.size());
+			for (auto& it : groups)
+				result.push_back(std::move(it.second));
+
+			if (!options.order_by.empty())
+			{
+				for (const ScatterRow& g : result)
+					checkOrderColumns(g, options.order_by);
+
+				std::stable_sort(result.begin(), result.end(), [&options](const ScatterRow& a, const ScatterRow& b) {
+					return compareRows(a, b, options.order_by) < 0;
+				});
+			}
+
+			for (const ScatterRow& g : result)
+			{
+				if (!emit(g))
+					break;
+			}
+		}
+		else if (!options.order_by.empty())
+		{
+			//k-way merge. Equal rows are taken from the part added first
+			std::vector<ScatterRow> heads(readers.size());
+			auto greater = [&heads, &options](size_t a, size_t b) {
+				int c = compareRows(heads[a], heads[b], options.order_by);
+				return c != 0 ? c > 0 : a > b;
+			};
+			std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+			for (size_t i = 0; i < readers.size(); ++i)
+			{
+				if (readers[i].next(heads[i]))
+				{
+					checkOrderColumns(heads[i], options.order_by);
+					heap.push(i);
+				}
+			}
+
+			while (!heap.empty())
+			{
+				size_t idx = heap.top();
+				heap.pop();
+				if (!emit(heads[idx]))
+					break;
+				if (readers[idx].next(heads[idx]))
+					heap.push(idx);
+			}
+		}
+		else
+		{
+			ScatterRow r;
+			bool more = true;
+			for (size_t i = 0; i < readers.size() && more; ++i)
+			{
+				while (more && readers[i].next(r))
+					more = emit(r);
+			}
+		}
+	}
+	catch (...)
+	{
+		stopParts();
+		throw;
+	}
+
+	stopParts();
+
+	columns.clear();
+	for (auto& channel : state.channels)
+	{
+		stats.rows_read += channel->rows_read;
+		if (columns.empty() && channel->has_columns)
+			columns = channel->columns;
+		//Errors of parts the merge did not read to the end
+		if (channel->error)
+			std::rethrow_exception(channel->error);
+	}
+
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	return stats;
+}
+
+std::vector<ScatterRow> ScatterGather::read(const std::string& sql, const ScatterOptions& options,
+	const std::function<void(DatabaseQuery&)>& bind)
+{
+	std::vector<ScatterRow> ret;
+	execute(sql, [&ret](const ScatterRow& r) {
+		ret.push_back(r);
+		return true;
+	}, options, bind);
+	return ret;
+}
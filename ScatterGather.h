@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include "Exporter.h"
+
+namespace sqlgen
+{
+	class Database;
+	class DatabaseQuery;
+	class ShardedDatabase;
+
+	class ScatterError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	//One row of a scatter-gather result
+	typedef std::vector<BinaryValue> ScatterRow;
+
+	enum ScatterAggregate
+	{
+		//Column is part of the group key
+		ScatterAggregate_Group,
+		ScatterAggregate_Count,
+		ScatterAggregate_Sum,
+		ScatterAggregate_Min,
+		ScatterAggregate_Max
+	};
+
+	struct ScatterSortKey
+	{
+		int column = 0;
+		bool descending = false;
+	};
+
+	struct ScatterOptions
+	{
+		//Columns the parts return their rows ordered by (ORDER BY). The part results are merged in this order
+		std::vector<ScatterSortKey> order_by;
+		//Combines the rows of the parts per column, e.g. for SELECT k, COUNT(*), SUM(v) ... GROUP BY k
+		std::vector<ScatterAggregate> aggregates;
+		//Maximum number of rows (-1 = all). Without aggregates also appended as LIMIT to the statement of each part
+		int64_t limit = -1;
+		//Rows a part reads ahead of the merge
+		size_t buffer_rows = 4096;
+	};
+
+	struct ScatterStats
+	{
+		size_t parts = 0;
+		//Rows read from all parts
+		size_t rows_read = 0;
+		//Rows returned
+		size_t rows = 0;
+		double seconds = 0;
+	};
+
+	/**
+	* Runs the same query on several parts in parallel, one thread per part,
+	* and merges the results. A part is a connection (a reader of it is used,
+	* see Database::addReaders) and an attached schema name, which replaces
+	* "{schema}" in the statement. addShards() adds every shard of a
+	* ShardedDatabase.
+	*
+	* Rows are streamed: each part reads ahead up to buffer_rows, and the
+	* merge takes rows from the parts as the callback consumes them. With
+	* order_by the sorted part results are merged with a k-way merge. Values
+	* compare like in SQLite with BINARY collation (NULL < numbers < text <
+	* blob). Without order_by the parts are returned one after the other.
+	* Reading stops once limit rows were returned or the callback returns
+	* false.
+	*
+	* With aggregates, COUNT and SUM are added up and MIN and MAX combined
+	* over the rows with the same group columns (AVG has to be computed from
+	* SUM and COUNT). The groups are sorted by order_by, or else by group key.
+	* LIMIT is not pushed down then, because every part needs all its groups.
+	*/
+	class ScatterGather
+	{
+	public:
+		//Several parts on the same connection need a reader each (Database::addReaders)
+		void addPart(Database& db, const std::string& schema = "main");
+		void addShards(ShardedDatabase& shards);
+
+		size_t getPartCount() {
+			return parts.size();
+		}
+
+		/**
+		* Calls row for each merged row until it returns false. bind is called
+		* with the statement of every part to bind parameters. It runs on the
+		* part threads concurrently, so it must be thread-safe. Throws
+		* ScatterError (or PrepareError) if a part fails.
+		*/
+		ScatterStats execute(const std::string& sql, const std::function<bool(const ScatterRow&)>& row,
+			const ScatterOptions& options = ScatterOptions(), const std::function<void(DatabaseQuery&)>& bind = nullptr);
+
+		std::vector<ScatterRow> read(const std::string& sql, const ScatterOptions& options = ScatterOptions(),
+			const std::function<void(DatabaseQuery&)>& bind = nullptr);
+
+		//Column names of the last execute()
+		const std::vector<std::string>& getColumns() {
+			return columns;
+		}
+
+	private:
+		struct Part
+		{
+			Database* db;
+			std::string schema;
+		};
+
+		std::vector<Part> parts;
+		std::vector<std::string> columns;
+	};
+
+	//Compares like SQLite with BINARY collation. Returns <0, 0 or >0
+	int compareValues(const BinaryValue& a, const BinaryValue& b);
+}
@@ -0,0 +1,267 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "ShardedDatabase.h"
+#include "DatabaseLogger.h"
+#include "sqlite/sqlite3.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+
+namespace sqlgen
+{
+	struct ShardWriteTask
+	{
+		std::function<void(Database&)> f;
+		std::promise<void> done;
+	};
+
+	struct ShardState
+	{
+		std::string file;
+		std::unique_ptr<Database> db;
+
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::condition_variable idle_cond;
+		std::deque<ShardWriteTask> queue;
+		//Tasks taken from the queue but not finished yet
+		size_t running = 0;
+		bool stop = false;
+		std::thread writer;
+		ShardWriterStats stats;
+	};
+}
+
+using namespace sqlgen;
+
+namespace
+{
+	uint64_t fnv1aHash(std::string_view data)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+		for (char ch : data)
+		{
+			hash ^= static_cast<unsigned char>(ch);
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+}
+
+ShardedDatabase::ShardedDatabase(const std::vector<std::string>& files, ShardOptions options)
+	: options(std::move(options))
+{
+	if (files.empty())
+		throw ShardError("ShardedDatabase needs at least one shard file");
+
+	if (!this->options.hash)
+		this->options.hash = fnv1aHash;
+
+	for (const std::string& file : files)
+	{
+		std::unique_ptr<ShardState> state(new ShardState);
+		state->file = file;
+		state->db.reset(new Database(file, {}, std::string::npos, this->options.params));
+		shards.push_back(std::move(state));
+		if (!this->options.schema.empty())
+			execShard(*shards.back(), this->options.schema);
+		if (this->options.readers > 0)
+			shards.back()->db->addReaders(this->options.readers);
+	}
+}
+
+ShardedDatabase::~ShardedDatabase()
+{
+	for (auto& state : shards)
+	{
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->stop = true;
+		}
+		state->cond.notify_all();
+	}
+
+	for (auto& state : shards)
+	{
+		if (state->writer.joinable())
+			state->writer.join();
+	}
+}
+
+Database& ShardedDatabase::getShard(size_t idx)
+{
+	if (idx >= shards.size())
+		throw ShardError("Shard index " + std::to_string(idx) + " out of range (" + std::to_string(shards.size()) + " shards)");
+	return *shards[idx]->db;
+}
+
+size_t ShardedDatabase::getShardIndex(int64_t key)
+{
+	char buf[8];
+	uint64_t ukey = static_cast<uint64_t>(key);
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = static_cast<char>((ukey >> (i * 8)) & 0xFF);
+	return static_cast<size_t>(options.hash(std::string_view(buf, sizeof(buf))) % shards.size());
+}
+
+size_t ShardedDatabase::getShardIndex(std::string_view key)
+{
+	return static_cast<size_t>(options.hash(key) % shards.size());
+}
+
+void ShardedDatabase::write(const std::string& sql)
+{
+	for (auto& state : shards)
+		execShard(*state, sql);
+}
+
+void ShardedDatabase::execShard(ShardState& state, const std::string& sql)
+{
+	if (sqlite3_exec(state.db->getDatabase(), sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+		throw ShardError("Error executing statements on shard " + state.file + ": " + sqlite3_errmsg(state.db->getDatabase()));
+}
+
+std::future<void> ShardedDatabase::submitWrite(size_t shard, std::function<void(Database&)> f)
+{
+	getShard(shard);
+	ShardState* state = shards[shard].get();
+
+	ShardWriteTask task;
+	task.f = std::move(f);
+	std::future<void> ret = task.done.get_future();
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		if (state->stop)
+			throw ShardError("ShardedDatabase is shutting down");
+		if (!state->writer.joinable())
+			state->writer = std::thread(&ShardedDatabase::writerThread, this, state);
+		state->queue.push_back(std::move(task));
+	}
+	state->cond.notify_one();
+	return ret;
+}
+
+void ShardedDatabase::flush()
+{
+	for (auto& state : shards)
+	{
+		std::unique_lock<std::mutex> lock(state->mutex);
+		while (!state->queue.empty() || state->running > 0)
+			state->idle_cond.wait(lock);
+	}
+}
+
+ShardWriterStats ShardedDatabase::getWriterStats(size_t shard)
+{
+	getShard(shard);
+	std::lock_guard<std::mutex> lock(shards[shard]->mutex);
+	return shards[shard]->stats;
+}
+
+void ShardedDatabase::writerThread(ShardState* state)
+{
+	//Own connection, so the batch transaction does not include writes of other threads on the shard Database
+	Database conn(state->file, {}, std::string::npos, options.params);
+
+	while (true)
+	{
+		std::vector<ShardWriteTask> batch;
+		{
+			std::unique_lock<std::mutex> lock(state->mutex);
+			while (state->queue.empty() && !state->stop)
+				state->cond.wait(lock);
+
+			if (state->queue.empty())
+				break;
+
+			while (!state->queue.empty() && batch.size() < (std::max)(options.max_batch, size_t(1)))
+			{
+				batch.push_back(std::move(state->queue.front()));
+				state->queue.pop_front();
+			}
+			state->running = batch.size();
+		}
+
+		//Writes that were rolled back already have their exception set
+		std::vector<bool> ok(batch.size(), false);
+		std::vector<bool> rolled_back(batch.size(), false);
+		size_t failed = 0;
+		bool committed = false;
+		try
+		{
+			conn.beginWriteTransaction();
+			bool aborted = false;
+			for (size_t i = 0; i < batch.size() && !aborted; ++i)
+			{
+				conn.beginWriteTransaction();
+				try
+				{
+					batch[i].f(conn);
+					conn.endTransaction();
+					ok[i] = true;
+				}
+				catch (...)
+				{
+					conn.rollbackTransaction();
+					batch[i].done.set_exception(std::current_exception());
+					rolled_back[i] = true;
+					++failed;
+				}
+
+				//SQLite rolls back the whole transaction after some errors (e.g. SQLITE_FULL, SQLITE_IOERR, SQLITE_NOMEM).
+				//Writes before were lost and the next ones would run without transaction
+				aborted = sqlite3_get_autocommit(conn.getDatabase()) != 0;
+			}
+
+			if (aborted)
+			{
+				conn.rollbackTransaction();
+			}
+			else
+			{
+				conn.endTransaction();
+				committed = sqlite3_get_autocommit(conn.getDatabase()) != 0;
+				if (!committed)
+					conn.rollbackTransaction();
+			}
+		}
+		catch (...)
+		{
+			if (conn.isInTransaction())
+				conn.rollbackTransaction();
+		}
+
+		if (!committed)
+			getDatabaseLogger()->Log("Committing " + std::to_string(batch.size()) + " writes to shard " + state->file + " failed", LL_ERROR);
+
+		for (size_t i = 0; i < batch.size(); ++i)
+		{
+			if (rolled_back[i])
+				continue;
+
+			if (committed && ok[i])
+			{
+				batch[i].done.set_value();
+			}
+			else
+			{
+				batch[i].done.set_exception(std::make_exception_ptr(ShardError("Committing write to shard " + state->file + " failed")));
+				++failed;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->running = 0;
+			state->stats.writes += batch.size();
+			state->stats.failed += failed;
+			if (committed)
+				++state->stats.transactions;
+		}
+		state->idle_cond.notify_all();
+	}
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <future>
+#include <type_traits>
+#include <stdint.h>
+#include "Database.h"
+#include "DatabaseQuery.h"
+
+namespace sqlgen
+{
+	class ShardError : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	struct ShardOptions
+	{
+		//Open parameters of each shard (see Database)
+		str_map params;
+		//Statements run on each shard when it is opened, before the readers are added
+		std::string schema;
+		//Reader connections per shard (see Database::addReaders)
+		size_t readers = 0;
+		//Hash of the key bytes. Integer keys are hashed as 8 little-endian bytes. Default is FNV-1a.
+		//Has to stay the same for existing shard files, otherwise rows are looked up on the wrong shard
+		std::function<uint64_t(std::string_view)> hash;
+		//Maximum number of submitted writes a shard writer commits in one transaction
+		size_t max_batch = 1000;
+	};
+
+	struct ShardWriterStats
+	{
+		size_t writes = 0;
+		size_t failed = 0;
+		size_t transactions = 0;
+	};
+
+	struct ShardState;
+
+	/**
+	* Hash-partitions data over several SQLite files ("shards"), each with
+	* its own Database (and optional readers), so writes to different shards
+	* do not wait for each other. Rows are routed by a key: getShardIndex()
+	* hashes it, so the number and order of shard files must not change
+	* once data was written.
+	*
+	* submitWrite() queues a write for the writer thread of a shard. The
+	* writer thread uses its own connection and commits all queued writes
+	* in one transaction (up to max_batch), each in a savepoint, so a write
+	* that throws only rolls back itself. forEachShard() runs a function on
+	* all shards in parallel, e.g. for queries without key.
+	*
+	* Generated functions with @shard_key are routed automatically, see
+	* ShardedQuery.
+	*/
+	class ShardedDatabase
+	{
+	public:
+		ShardedDatabase(const std::vector<std::string>& files, ShardOptions options = ShardOptions());
+		~ShardedDatabase();
+
+		ShardedDatabase(const ShardedDatabase&) = delete;
+		ShardedDatabase& operator=(const ShardedDatabase&) = delete;
+
+		size_t getShardCount() {
+			return shards.size();
+		}
+
+		Database& getShard(size_t idx);
+
+		size_t getShardIndex(int64_t key);
+		size_t getShardIndex(std::string_view key);
+
+		template<typename K>
+		Database& forKey(const K& key) {
+			return getShard(getShardIndex(key));
+		}
+
+		//Runs the statements on every shard. Readers opened before may not see new tables, see ShardOptions::schema
+		void write(const std::string& sql);
+
+		/**
+		* Runs f(Database&) in a write transaction on the writer thread of the
+		* shard. The future is set once the transaction is committed, or holds
+		* the exception f threw (or ShardError if the commit failed or SQLite
+		* rolled back the batch transaction after an error).
+		*/
+		std::future<void> submitWrite(size_t shard, std::function<void(Database&)> f);
+
+		template<typename K>
+		std::future<void> submitWriteForKey(const K& key, std::function<void(Database&)> f) {
+			return submitWrite(getShardIndex(key), std::move(f));
+		}
+
+		//Waits until all writes submitted before are committed
+		void flush();
+
+		ShardWriterStats getWriterStats(size_t shard);
+
+		/**
+		* Runs f(Database& shard, size_t idx) on all shards in parallel and
+		* returns the results in shard order. Rethrows the first exception.
+		* f runs on multiple threads, so it must not share a DAO object that
+		* was not generated with @threads shared.
+		*/
+		template<typename F>
+		auto forEachShard(F f) -> std::vector<decltype(f(std::declval<Database&>(), size_t()))>
+		{
+			typedef decltype(f(std::declval<Database&>(), size_t())) R;
+			std::vector<std::future<R> > futures;
+			for (size_t i = 0; i < shards.size(); ++i)
+			{
+				Database& shard = getShard(i);
+				futures.push_back(std::async(std::launch::async, [&f, &shard, i]() {
+					return f(shard, i);
+				}));
+			}
+
+			for (auto& fut : futures)
+				fut.wait();
+
+			std::vector<R> ret;
+			ret.reserve(futures.size());
+			for (auto& fut : futures)
+				ret.push_back(fut.get());
+			return ret;
+		}
+
+		//Version for functions without return value
+		template<typename F>
+		void forEachShardVoid(F f)
+		{
+			forEachShard([&f](Database& shard, size_t idx) {
+				f(shard, idx);
+				return true;
+			});
+		}
+
+	private:
+		void writerThread(ShardState* state);
+		void execShard(ShardState& state, const std::string& sql);
+
+		ShardOptions options;
+		std::vector<std::unique_ptr<ShardState> > shards;
+	};
+
+	/**
+	* Statement of a generated function with @shard_key. Holds one Q
+	* (RoutedQuery or, with @threads shared, ThreadQuery) per shard.
+	*/
+	template<typename Q>
+	class ShardedQuery
+	{
+	public:
+		ShardedQuery(size_t nshards)
+		{
+			for (size_t i = 0; i < nshards; ++i)
+				queries.emplace_back(new Q);
+		}
+
+		DatabaseQuery& get(size_t shard, ReadConnection& conn, const std::string& sql) {
+			return queries.at(shard)->get(conn, sql);
+		}
+
+		//Statement on the writer connection of the shard
+		DatabaseQuery& get(size_t shard, Database& db, const std::string& sql) {
+			return queries.at(shard)->get(db, sql);
+		}
+
+		void prepareAll(ShardedDatabase& shards, const std::string& sql, int flags)
+		{
+			for (size_t i = 0; i < queries.size(); ++i)
+				queries[i]->prepareAll(shards.getShard(i), sql, flags);
+		}
+
+		void prepareWriter(ShardedDatabase& shards, const std::string& sql, int flags)
+		{
+			for (size_t i = 0; i < queries.size(); ++i)
+				queries[i]->prepareWriter(shards.getShard(i), sql, flags);
+		}
+
+	private:
+		std::vector<std::unique_ptr<Q> > queries;
+	};
+}
@@ -0,0 +1,448 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+#include "VectorTable.h"
+#include "sqlite/sqlite3.h"
+#include "DatabaseLogger.h"
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace sqlgen;
+
+namespace
+{
+	struct VectorTableVtab
+	{
+		sqlite3_vtab base;
+		VectorTableBase* table;
+	};
+
+	struct VectorTableFilter
+	{
+		int col;
+		int op;
+		sqlite3_value* val;
+	};
+
+	struct VectorTableCursor
+	{
+		sqlite3_vtab_cursor base;
+		VectorTableBase* table;
+		size_t row;
+		size_t end;
+		std::vector<VectorTableFilter> filters;
+
+		void clearFilters()
+		{
+			for (auto& filter : filters)
+				sqlite3_value_free(filter.val);
+			filters.clear();
+		}
+	};
+
+	bool isPushdownOp(int op)
+	{
+		return op == SQLITE_INDEX_CONSTRAINT_EQ
+			|| op == SQLITE_INDEX_CONSTRAINT_GT
+			|| op == SQLITE_INDEX_CONSTRAINT_GE
+			|| op == SQLITE_INDEX_CONSTRAINT_LT
+			|| op == SQLITE_INDEX_CONSTRAINT_LE;
+	}
+
+	bool opMatches(int op, int cmp)
+	{
+		switch (op)
+		{
+		case SQLITE_INDEX_CONSTRAINT_EQ: return cmp == 0;
+		case SQLITE_INDEX_CONSTRAINT_GT: return cmp > 0;
+		case SQLITE_INDEX_CONSTRAINT_GE: return cmp >= 0;
+		case SQLITE_INDEX_CONSTRAINT_LT: return cmp < 0;
+		case SQLITE_INDEX_CONSTRAINT_LE: return cmp <= 0;
+		default: return true;
+		}
+	}
+
+	//First row in [begin, end) which compares greater (or equal if !strict) than val
+	size_t lowerBound(VectorTableBase* table, int col, sqlite3_value* val, size_t begin, size_t end, bool strict)
+	{
+		while (begin < end)
+		{
+			size_t mid = begin + (end - begin) / 2;
+			int cmp = table->compare(mid, col, val);
+			if (cmp < 0 || (strict && cmp == 0))
+				begin = mid + 1;
+			else
+				end = mid;
+		}
+		return begin;
+	}
+
+	bool cursorMatches(VectorTableCursor* cur)
+	{
+		for (const auto& filter : cur->filters)
+		{
+			if (!opMatches(filter.op, cur->table->compare(cur->row, filter.col, filter.val)))
+				return false;
+		}
+		return true;
+	}
+
+	void cursorSkip(VectorTableCursor* cur)
+	{
+		while (cur->row < cur->end && !cursorMatches(cur))
+			++cur->row;
+	}
+
+	int vtConnect(sqlite3* db, void* pAux, int argc, const char* const* argv,
+		sqlite3_vtab** ppVtab, char** pzErr)
+	{
+		VectorTableBase* table = static_cast<VectorTableBase*>(pAux);
+
+		std::string schema = "CREATE TABLE x(";
+		const auto& cols = table->getColumnDefs();
+		for (size_t i = 0; i < cols.size(); ++i)
+		{
+			if (i > 0)
+				schema += ", ";
+			schema += "\"" + cols[i].name + "\" " + cols[i].decl_type;
+		}
+		schema += ")";
+
+		int rc = sqlite3_declare_vtab(db, schema.c_str());
+		if (rc != SQLITE_OK)
+			return rc;
+
+		VectorTableVtab* vtab = static_cast<VectorTableVtab*>(sqlite3_malloc(sizeof(VectorTableVtab)));
+		if (vtab == nullptr)
+			return SQLITE_NOMEM;
+
+		*vtab = {};
+		vtab->table = table;
+		*ppVtab = &vtab->base;
+		return SQLITE_OK;
+	}
+
+	int vtDisconnect(sqlite3_vtab* pVtab)
+	{
+		sqlite3_free(pVtab);
+		return SQLITE_OK;
+	}
+
+	int vtBestIndex(sqlite3_vtab* tab, sqlite3_index_info* pIdxInfo)
+	{
+		VectorTableBase* table = reinterpret_cast<VectorTableVtab*>(tab)->table;
+		const auto& cols = table->getColumnDefs();
+		int sorted_col = table->getSortedColumn();
+
+		std::string idx_str;
+		int n_args = 0;
+		bool has_sorted_eq = false;
+		bool has_sorted_range = false;
+		bool has_filter = false;
+		for (int i = 0; i < pIdxInfo->nConstraint; ++i)
+		{
+			const auto& constraint = pIdxInfo->aConstraint[i];
+			if (!constraint.usable
+				|| constraint.iColumn < 0
+				|| !cols[constraint.iColumn].key
+				|| !isPushdownOp(constraint.op))
+				continue;
+
+			if (cols[constraint.iColumn].decl_type == "TEXT"
+				&& sqlite3_stricmp(sqlite3_vtab_collation(pIdxInfo, i), "BINARY") != 0)
+				continue;
+
+			pIdxInfo->aConstraintUsage[i].argvIndex = ++n_args;
+			pIdxInfo->aConstraintUsage[i].omit = 1;
+			idx_str += std::to_string(constraint.iColumn) + ":" + std::to_string(constraint.op) + ",";
+
+			if (constraint.iColumn == sorted_col)
+			{
+				if (constraint.op == SQLITE_INDEX_CONSTRAINT_EQ)
+					has_sorted_eq = true;
+				else
+					has_sorted_range = true;
+			}
+			else
+			{
+				has_filter = true;
+			}
+		}
+
+		double n_rows = static_cast<double>((std::max)(table->rowCount(), size_t(1)));
+		double est_rows = n_rows;
+		if (has_sorted_eq)
+			est_rows = 1;
+		else if (has_sorted_range)
+			est_rows = n_rows / 4;
+		if (has_filter)
+			est_rows = (std::max)(est_rows / 4, 1.0);
+
+		double cost = n_rows;
+		if (has_sorted_eq || has_sorted_range)
+			cost = std::log2(n_rows) + est_rows;
+
+		pIdxInfo->estimatedCost = cost;
+		pIdxInfo->estimatedRows = static_cast<sqlite3_int64>(est_rows);
+		if (has_sorted_eq && !has_filter)
+			pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+
+		if (pIdxInfo->nOrderBy == 1
+			&& pIdxInfo->aOrderBy[0].iColumn == sorted_col
+			&& sorted_col >= 0
+			&& !pIdxInfo->aOrderBy[0].desc)
+		{
+			pIdxInfo->orderByConsumed = 1;
+		}
+
+		if (!idx_str.empty())
+		{
+			pIdxInfo->idxStr = sqlite3_mprintf("%s", idx_str.c_str());
+			pIdxInfo->needToFreeIdxStr = 1;
+		}
+
+		return SQLITE_OK;
+	}
+
+	int vtOpen(sqlite3_vtab* p, sqlite3_vtab_cursor** ppCursor)
+	{
+		VectorTableCursor* cur = new VectorTableCursor();
+		cur->table = reinterpret_cast<VectorTableVtab*>(p)->table;
+		*ppCursor = &cur->base;
+		return SQLITE_OK;
+	}
+
+	int vtClose(sqlite3_vtab_cursor* cur)
+	{
+		VectorTableCursor* vcur = reinterpret_cast<VectorTableCursor*>(cur);
+		vcur->clearFilters();
+		delete vcur;
+		return SQLITE_OK;
+	}
+
+	int vtFilter(sqlite3_vtab_cursor* cur, int idxNum, const char* idxStr,
+		int argc, sqlite3_value** argv)
+	{
+		VectorTableCursor* vcur = reinterpret_cast<VectorTableCursor*>(cur);
+		VectorTableBase* table = vcur->table;
+		int sorted_col = table->getSortedColumn();
+
+		vcur->clearFilters();
+		vcur->row = 0;
+		vcur->end = table->rowCount();
+
+		const char* pos = idxStr;
+		for (int i = 0; i < argc && pos != nullptr && *pos != 0; ++i)
+		{
+			char* next_pos;
+			int col = static_cast<int>(strtol(pos, &next_pos, 10));
+			int op = static_cast<int>(strtol(next_pos + 1, &next_pos, 10));
+			pos = next_pos + 1;
+
+			sqlite3_value* val = argv[i];
+			if (sqlite3_value_type(val) == SQLITE_NULL)
+			{
+				//Comparisons with NULL are never true
+				vcur->end = 0;
+				break;
+			}
+
+			if (col == sorted_col)
+			{
+				size_t begin = vcur->row;
+				size_t end = vcur->end;
+				switch (op)
+				{
+				case SQLITE_INDEX_CONSTRAINT_EQ:
+					vcur->row = lowerBound(table, col, val, begin, end, false);
+					vcur->end = lowerBound(table, col, val, vcur->row, end, true);
+					break;
+				case SQLITE_INDEX_CONSTRAINT_GT:
+					vcur->row = lowerBound(table, col, val, begin, end, true);
+					break;
+				case SQLITE_INDEX_CONSTRAINT_GE:
+					vcur->row = lowerBound(table, col, val, begin, end, false);
+					break;
+				case SQLITE_INDEX_CONSTRAINT_LT:
+					vcur->end = lowerBound(table, col, val, begin, end, false);
+					break;
+				case SQLITE_INDEX_CONSTRAINT_LE:
+					vcur->end = lowerBound(table, col, val, begin, end, true);
+					break;
+				}
+			}
+			else
+			{
+				sqlite3_value* dup = sqlite3_value_dup(val);
+				if (dup == nullptr)
+					return SQLITE_NOMEM;
+				vcur->filters.push_back(VectorTableFilter{ col, op, dup });
+			}
+		}
+
+		cursorSkip(vcur);
+		return SQLITE_OK;
+	}
+
+	int vtNext(sqlite3_vtab_cursor* cur)
+	{
+		VectorTableCursor* vcur = reinterpret_cast<VectorTableCursor*>(cur);
+		++vcur->row;
+		cursorSkip(vcur);
+		return SQLITE_OK;
+	}
+
+	int vtEof(sqlite3_vtab_cursor* cur)
+	{
+		VectorTableCursor* vcur = reinterpret_cast<VectorTableCursor*>(cur);
+		return vcur->row >= vcur->end;
+	}
+
+	int vtColumn(sqlite3_vtab_cursor* cur, sqlite3_context* ctx, int i)
+	{
+		VectorTableCursor* vcur = reinterpret_cast<VectorTableCursor*>(cur);
+		vcur->table->result(vcur->row, i, ctx);
+		return SQLITE_OK;
+	}
+
+	int vtRowid(sqlite3_vtab_cursor* cur, sqlite_int64* pRowid)
+	{
+		*pRowid = static_cast<sqlite_int64>(reinterpret_cast<VectorTableCursor*>(cur)->row);
+		return SQLITE_OK;
+	}
+
+	sqlite3_module vectorTableModule = {
+		0,                 /* iVersion */
+		nullptr,           /* xCreate */
+		vtConnect,         /* xConnect */
+		vtBestIndex,       /* xBestIndex */
+		vtDisconnect,      /* xDisconnect */
+		nullptr,           /* xDestroy */
+		vtOpen,            /* xOpen */
+		vtClose,           /* xClose */
+		vtFilter,          /* xFilter */
+		vtNext,            /* xNext */
+		vtEof,             /* xEof */
+		vtColumn,          /* xColumn */
+		vtRowid,           /* xRowid */
+	};
+
+	template<typename T>
+	int compareNum(T a, T b)
+	{
+		if (a < b) return -1;
+		if (a > b) return 1;
+		return 0;
+	}
+
+	int compareBytes(const void* a, size_t a_size, const void* b, size_t b_size)
+	{
+		int cmp = memcmp(a, b, (std::min)(a_size, b_size));
+		if (cmp != 0)
+			return cmp;
+		return compareNum(a_size, b_size);
+	}
+}
+
+VectorTableBase::~VectorTableBase()
+{
+	if (registered)
+	{
+		sqlite3_create_module(db.getDatabase(), name.c_str(), nullptr, nullptr);
+	}
+}
+
+void VectorTableBase::registerModule()
+{
+	int rc = sqlite3_create_module(db.getDatabase(), name.c_str(), &vectorTableModule, this);
+	if (rc != SQLITE_OK)
+	{
+		std::string msg = "Error registering virtual table [" + name + "]: " + sqlite3_errstr(rc);
+		getDatabaseLogger()->Log(msg, LL_ERROR);
+		throw std::runtime_error(msg);
+	}
+	registered = true;
+}
+
+void VectorTableBase::resultValue(sqlite3_context* ctx, int v)
+{
+	sqlite3_result_int(ctx, v);
+}
+
+void VectorTableBase::resultValue(sqlite3_context* ctx, int64_t v)
+{
+	sqlite3_result_int64(ctx, v);
+}
+
+void VectorTableBase::resultValue(sqlite3_context* ctx, double v)
+{
+	sqlite3_result_double(ctx, v);
+}
+
+void VectorTableBase::resultValue(sqlite3_context* ctx, const std::string& v, bool blob)
+{
+	if (blob)
+		sqlite3_result_blob(ctx, v.data(), static_cast<int>(v.size()), SQLITE_STATIC);
+	else
+		sqlite3_result_text(ctx, v.data(), static_cast<int>(v.size()), SQLITE_STATIC);
+}
+
+int VectorTableBase::compareValue(int v, sqlite3_value* val)
+{
+	return compareValue(static_cast<int64_t>(v), val);
+}
+
+int VectorTableBase::compareValue(int64_t v, sqlite3_value* val)
+{
+	switch (sqlite3_value_numeric_type(val))
+	{
+	case SQLITE_INTEGER:
+		return compareNum<int64_t>(v, sqlite3_value_int64(val));
+	case SQLITE_FLOAT:
+		return compareNum<double>(static_cast<double>(v), sqlite3_value_double(val));
+	case SQLITE_NULL:
+		return 1;
+	default:
+		//Numeric values sort before TEXT and BLOB
+		return -1;
+	}
+}
+
+int VectorTableBase::compareValue(double v, sqlite3_value* val)
+{
+	switch (sqlite3_value_numeric_type(val))
+	{
+	case SQLITE_INTEGER:
+	case SQLITE_FLOAT:
+		return compareNum<double>(v, sqlite3_value_double(val));
+	case SQLITE_NULL:
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+int VectorTableBase::compareValue(const std::string& v, sqlite3_value* val, bool blob)
+{
+	int val_type = sqlite3_value_type(val);
+	if (val_type == SQLITE_NULL)
+		return 1;
+
+	if (blob)
+	{
+		if (val_type != SQLITE_BLOB)
+			return 1;
+
+		const void* data = sqlite3_value_blob(val);
+		return compareBytes(v.data(), v.size(), data, static_cast<size_t>(sqlite3_value_bytes(val)));
+	}
+
+	if (val_type == SQLITE_BLOB)
+		return -1;
+
+	const unsigned char* data = sqlite3_value_text(val);
+	return compareBytes(v.data(), v.size(), data, static_cast<size_t>(sqlite3_value_bytes(val)));
+}
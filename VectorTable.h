@@ -0,0 +1,187 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <type_traits>
+#include <stdint.h>
+#include "Database.h"
+
+struct sqlite3_context;
+struct sqlite3_value;
+
+namespace sqlgen
+{
+	class VectorTableBase
+	{
+	public:
+		VectorTableBase(const VectorTableBase&) = delete;
+		VectorTableBase& operator=(const VectorTableBase&) = delete;
+
+		const std::string& getName() {
+			return name;
+		}
+
+		//Internal interface used by the virtual table module
+		struct ColumnDef
+		{
+			std::string name;
+			std::string decl_type;
+			bool key;
+		};
+
+		const std::vector<ColumnDef>& getColumnDefs() {
+			return column_defs;
+		}
+
+		int getSortedColumn() {
+			return sorted_col;
+		}
+
+		virtual size_t rowCount() = 0;
+		virtual void result(size_t row, int col, sqlite3_context* ctx) = 0;
+		virtual int compare(size_t row, int col, sqlite3_value* val) = 0;
+
+	protected:
+		VectorTableBase(Database& db, const std::string& name)
+			: db(db), name(name) {}
+		virtual ~VectorTableBase();
+
+		void registerModule();
+		bool registered = false;
+
+		static void resultValue(sqlite3_context* ctx, int v);
+		static void resultValue(sqlite3_context* ctx, int64_t v);
+		static void resultValue(sqlite3_context* ctx, double v);
+		static void resultValue(sqlite3_context* ctx, const std::string& v, bool blob);
+
+		static int compareValue(int v, sqlite3_value* val);
+		static int compareValue(int64_t v, sqlite3_value* val);
+		static int compareValue(double v, sqlite3_value* val);
+		static int compareValue(const std::string& v, sqlite3_value* val, bool blob);
+
+		static const char* declType(int) { return "INTEGER"; }
+		static const char* declType(int64_t) { return "INTEGER"; }
+		static const char* declType(double) { return "REAL"; }
+		static const char* declType(const std::string&) { return "TEXT"; }
+
+		Database& db;
+		std::string name;
+		std::vector<ColumnDef> column_defs;
+		int sorted_col = -1;
+	};
+
+	enum VectorTableKey
+	{
+		VectorTableKey_None,
+		VectorTableKey_Filter,
+		VectorTableKey_Sorted
+	};
+
+	/**
+	* Exposes a random-access range of aggregates as eponymous virtual table
+	* on a database connection:
+	*
+	* VectorTable<FileHash> hashes(db, "client_hashes");
+	* hashes.column("hash", &FileHash::hash, VectorTableKey_Sorted);
+	* hashes.column("size", &FileHash::size);
+	* hashes.setData(client_hashes);
+	* db.read("SELECT f.id FROM files f JOIN client_hashes h ON f.hash=h.hash");
+	*
+	* Equality and range constraints on key columns are evaluated by the table.
+	* The data has to be sorted ascending on a VectorTableKey_Sorted column
+	* and is then searched with binary search. Columns have to be declared
+	* before the first setData(). The data is not copied and has to stay
+	* valid and unchanged while statements use the table.
+	*/
+	template<typename T>
+	class VectorTable : public VectorTableBase
+	{
+	public:
+		VectorTable(Database& db, const std::string& name)
+			: VectorTableBase(db, name) {}
+
+		template<typename M>
+		VectorTable& column(const std::string& col_name, M T::* member, VectorTableKey key = VectorTableKey_None)
+		{
+			addColumn(col_name, std::make_unique<MemberColumn<M> >(member, false), declType(M{}), key);
+			return *this;
+		}
+
+		VectorTable& blobColumn(const std::string& col_name, std::string T::* member, VectorTableKey key = VectorTableKey_None)
+		{
+			addColumn(col_name, std::make_unique<MemberColumn<std::string> >(member, true), "BLOB", key);
+			return *this;
+		}
+
+		template<typename Range>
+		void setData(const Range& range)
+		{
+			data = &range;
+			n_rows = static_cast<size_t>(std::size(range));
+			at = [](const void* r, size_t i) -> const T& {
+				return static_cast<const Range*>(r)->begin()[i];
+			};
+			if (!registered)
+				registerModule();
+		}
+
+		size_t rowCount() override {
+			return n_rows;
+		}
+
+		void result(size_t row, int col, sqlite3_context* ctx) override {
+			columns[col]->result(at(data, row), ctx);
+		}
+
+		int compare(size_t row, int col, sqlite3_value* val) override {
+			return columns[col]->compare(at(data, row), val);
+		}
+
+	private:
+		struct Column
+		{
+			virtual ~Column() {}
+			virtual void result(const T& obj, sqlite3_context* ctx) = 0;
+			virtual int compare(const T& obj, sqlite3_value* val) = 0;
+		};
+
+		template<typename M>
+		struct MemberColumn : public Column
+		{
+			MemberColumn(M T::* member, bool blob)
+				: member(member), blob(blob) {}
+
+			void result(const T& obj, sqlite3_context* ctx) override {
+				if constexpr (std::is_same<M, std::string>::value)
+					resultValue(ctx, obj.*member, blob);
+				else
+					resultValue(ctx, obj.*member);
+			}
+
+			int compare(const T& obj, sqlite3_value* val) override {
+				if constexpr (std::is_same<M, std::string>::value)
+					return compareValue(obj.*member, val, blob);
+				else
+					return compareValue(obj.*member, val);
+			}
+
+			M T::* member;
+			bool blob;
+		};
+
+		void addColumn(const std::string& col_name, std::unique_ptr<Column> col, const char* decl_type, VectorTableKey key)
+		{
+			if (key == VectorTableKey_Sorted)
+				sorted_col = static_cast<int>(columns.size());
+			columns.push_back(std::move(col));
+			column_defs.push_back(ColumnDef{ col_name, decl_type, key != VectorTableKey_None });
+		}
+
+		std::vector<std::unique_ptr<Column> > columns;
+		const void* data = nullptr;
+		size_t n_rows = 0;
+		const T& (*at)(const void*, size_t) = nullptr;
+	};
+}
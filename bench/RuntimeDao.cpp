@@ -0,0 +1,95 @@
+#include "RuntimeDao.h"
+
+/**
+* @-SQLGenAccess
+* @func BenchRow RuntimeDao::getRowById
+* @return int64 id, string name, int64 value, string payload
+* @sql
+*      SELECT id, name, value, payload FROM bench_rows WHERE id=:id(int64)
+*/
+RuntimeDao::BenchRow RuntimeDao::getRowById(int64_t id)
+{
+	sqlgen::ReadConnection conn=db.acquireReader();
+	sqlgen::DatabaseQuery& query=_getRowById.get(conn, "SELECT id, name, value, payload FROM bench_rows WHERE id=?");
+	query.bind(id);
+	auto& cursor=query.cursor();
+	BenchRow ret = { false, 0, "", 0, "" };
+	if(cursor.next())
+	{
+		ret.exists=true;
+		cursor.get(0, ret.id);
+		cursor.get(1, ret.name);
+		cursor.get(2, ret.value);
+		cursor.get(3, ret.payload);
+	}
+	query.reset();
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func vector<BenchRow> RuntimeDao::getRowsInRange
+* @return int64 id, string name, int64 value, string payload
+* @sql
+*      SELECT id, name, value, payload FROM bench_rows WHERE id BETWEEN :min_id(int64) AND :max_id(int64)
+*/
+std::vector<RuntimeDao::BenchRow> RuntimeDao::getRowsInRange(int64_t min_id, int64_t max_id)
+{
+	sqlgen::ReadConnection conn=db.acquireReader();
+	sqlgen::DatabaseQuery& query=_getRowsInRange.get(conn, "SELECT id, name, value, payload FROM bench_rows WHERE id BETWEEN ? AND ?");
+	query.bind(min_id);
+	query.bind(max_id);
+	auto& cursor=query.cursor();
+	std::vector<RuntimeDao::BenchRow> ret;
+	while(cursor.next())
+	{
+		ret.emplace_back();
+		RuntimeDao::BenchRow& obj=ret.back();
+		obj.exists=true;
+		cursor.get(0, obj.id);
+		cursor.get(1, obj.name);
+		cursor.get(2, obj.value);
+		cursor.get(3, obj.payload);
+	}
+	query.reset();
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func void RuntimeDao::addRow
+* @sql
+*      INSERT INTO bench_rows (id, name, value, payload) VALUES (:id(int64), :name(string), :value(int64), :payload(string))
+*/
+void RuntimeDao::addRow(int64_t id, const std::string& name, int64_t value, const std::string& payload)
+{
+	if(!_addRow.prepared())
+	{
+		_addRow=db.prepare("INSERT INTO bench_rows (id, name, value, payload) VALUES (?, ?, ?, ?)");
+	}
+	_addRow.bind(id);
+	_addRow.bind(name);
+	_addRow.bind(value);
+	_addRow.bind(payload);
+	_addRow.write();
+	_addRow.reset();
+}
+
+/**
+* @-SQLGenAccess
+* @func void RuntimeDao::updateRow
+* @sql
+*      UPDATE bench_rows SET value=:value(int64), payload=:payload(string) WHERE id=:id(int64)
+*/
+void RuntimeDao::updateRow(int64_t value, const std::string& payload, int64_t id)
+{
+	if(!_updateRow.prepared())
+	{
+		_updateRow=db.prepare("UPDATE bench_rows SET value=?, payload=? WHERE id=?");
+	}
+	_updateRow.bind(value);
+	_updateRow.bind(payload);
+	_updateRow.bind(id);
+	_updateRow.write();
+	_updateRow.reset();
+}
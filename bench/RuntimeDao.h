@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "../DatabaseQuery.h"
+
+class RuntimeDao
+{
+	sqlgen::Database& db;
+public:
+	RuntimeDao(sqlgen::Database& db) : db(db) {}
+
+	//@-SQLGenFunctionsBegin
+	struct BenchRow
+	{
+		bool exists;
+		int64_t id;
+		std::string name;
+		int64_t value;
+		std::string payload;
+	};
+
+
+	BenchRow getRowById(int64_t id);
+	std::vector<BenchRow> getRowsInRange(int64_t min_id, int64_t max_id);
+	void addRow(int64_t id, const std::string& name, int64_t value, const std::string& payload);
+	void updateRow(int64_t value, const std::string& payload, int64_t id);
+	void prepareAll()
+	{
+		_getRowById.prepareAll(db, "SELECT id, name, value, payload FROM bench_rows WHERE id=?", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		_getRowsInRange.prepareAll(db, "SELECT id, name, value, payload FROM bench_rows WHERE id BETWEEN ? AND ?", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		if(!_addRow.prepared())
+			_addRow=db.prepare("INSERT INTO bench_rows (id, name, value, payload) VALUES (?, ?, ?, ?)", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		if(!_updateRow.prepared())
+			_updateRow=db.prepare("UPDATE bench_rows SET value=?, payload=? WHERE id=?", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+	}
+	//@-SQLGenFunctionsEnd
+
+private:
+	//@-SQLGenVariablesBegin
+	sqlgen::RoutedQuery _getRowById;
+	sqlgen::RoutedQuery _getRowsInRange;
+	sqlgen::DatabaseQuery _addRow;
+	sqlgen::DatabaseQuery _updateRow;
+	//@-SQLGenVariablesEnd
+};
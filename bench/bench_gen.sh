@@ -0,0 +1,7 @@
+#!/bin/bash
+
+set -e
+
+cp bench.db benchgen.db
+../build/sqlite-cpp-sqlgen benchgen.db RuntimeDao.cpp
+rm benchgen.db
@@ -0,0 +1,620 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+/**
+* Lock contention benchmark. Forks writer and reader processes (each with
+* one or more threads and one connection per thread) against one database
+* file in WAL and rollback journal mode. Writers insert batches of rows in
+* ScopedAutoCommitWriteTransaction, readers run point lookups. All
+* statements use the default DatabaseQuery retry path. The busy handler of
+* each connection implements the selected busy policy and counts
+* SQLITE_BUSY events. Throughput, busy counts and p50/p99/p999 latency are
+* written as JSON.
+*
+* Busy policies:
+*   none    - no waiting in SQLite, DatabaseQuery resets and retries the statement
+*   sleep   - sleep 1ms between retries
+*   sqlite  - SQLite's own busy_timeout delay schedule
+*   backoff - randomized exponential backoff from 100us to 50ms
+*
+* Usage: sqlgen-contention-bench [--writers N] [--readers M] [--threads T] [--duration S]
+*            [--batch N] [--journal WAL,DELETE] [--policy none,sleep,sqlite,backoff]
+*            [--timeout MS] [--db file] [--out results.json]
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../Database.h"
+#include "../DatabaseQuery.h"
+#include "../DatabaseCursor.h"
+#include "../stringtools.h"
+#include "../sqlite/sqlite3.h"
+
+using namespace sqlgen;
+
+namespace
+{
+	const size_t c_initial_rows = 10000;
+
+	enum BusyPolicy
+	{
+		BusyPolicy_None,
+		BusyPolicy_Sleep,
+		BusyPolicy_Sqlite,
+		BusyPolicy_Backoff
+	};
+
+	struct BenchOptions
+	{
+		size_t writers = 2;
+		size_t readers = 2;
+		size_t threads = 1;
+		double duration = 5;
+		size_t batch = 10;
+		int timeout_ms = c_sqlite_busy_timeout_default;
+		std::vector<std::string> journal_modes = { "WAL", "DELETE" };
+		std::vector<std::string> policies = { "none", "sleep", "sqlite", "backoff" };
+		std::string db_file = "contention_bench.db";
+		std::string outfile;
+	};
+
+	//Per connection state of the busy handler
+	struct BusyState
+	{
+		BusyPolicy policy;
+		int timeout_ms;
+		uint64_t events = 0;
+		uint64_t calls = 0;
+		uint64_t rnd = 0;
+		std::chrono::steady_clock::time_point event_start;
+	};
+
+	int busyHandler(void* p, int count)
+	{
+		BusyState* state = static_cast<BusyState*>(p);
+		auto now = std::chrono::steady_clock::now();
+		if (count == 0)
+		{
+			++state->events;
+			state->event_start = now;
+		}
+		++state->calls;
+
+		if (state->policy == BusyPolicy_None)
+			return 0;
+
+		if (std::chrono::duration_cast<std::chrono::milliseconds>(now - state->event_start).count() >= state->timeout_ms)
+			return 0;
+
+		switch (state->policy)
+		{
+		case BusyPolicy_Sleep:
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			break;
+		case BusyPolicy_Sqlite:
+		{
+			static const int delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+			const int n_delays = static_cast<int>(sizeof(delays) / sizeof(delays[0]));
+			std::this_thread::sleep_for(std::chrono::milliseconds(delays[(std::min)(count, n_delays - 1)]));
+			break;
+		}
+		case BusyPolicy_Backoff:
+		{
+			int64_t max_us = (std::min)(int64_t(100) << (std::min)(count, 9), int64_t(50000));
+			state->rnd = state->rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+			int64_t us = max_us / 2 + static_cast<int64_t>((state->rnd >> 33) % static_cast<uint64_t>(max_us / 2 + 1));
+			std::this_thread::sleep_for(std::chrono::microseconds(us));
+			break;
+		}
+		default:
+			break;
+		}
+		return 1;
+	}
+
+	bool parsePolicy(const std::string& name, BusyPolicy& policy)
+	{
+		if (name == "none")
+			policy = BusyPolicy_None;
+		else if (name == "sleep")
+			policy = BusyPolicy_Sleep;
+		else if (name == "sqlite")
+			policy = BusyPolicy_Sqlite;
+		else if (name == "backoff")
+			policy = BusyPolicy_Backoff;
+		else
+			return false;
+		return true;
+	}
+
+	//Results of one worker process, sent to the parent through a pipe
+	struct WorkerSummary
+	{
+		uint64_t ops;
+		uint64_t rows;
+		uint64_t busy_events;
+		uint64_t busy_calls;
+		uint64_t errors;
+		uint64_t n_latencies;
+	};
+
+	struct WorkerResult
+	{
+		WorkerSummary summary = {};
+		std::vector<uint64_t> latencies_ns;
+	};
+
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	void runWriterThread(const BenchOptions& options, BusyPolicy policy, time_point start, time_point end,
+		uint64_t seed, WorkerResult& result)
+	{
+		Database db(options.db_file);
+		BusyState busy_state;
+		busy_state.policy = policy;
+		busy_state.timeout_ms = options.timeout_ms;
+		busy_state.rnd = seed;
+
+		DatabaseQuery q_insert = db.prepare("INSERT INTO contention (value, payload) VALUES (?, ?)");
+		std::string payload(100, 'x');
+
+		sqlite3_busy_handler(db.getDatabase(), busyHandler, &busy_state);
+
+		std::this_thread::sleep_until(start);
+
+		int64_t value = 0;
+		while (std::chrono::steady_clock::now() < end)
+		{
+			auto op_start = std::chrono::steady_clock::now();
+			bool ok = true;
+			if (options.batch > 1)
+			{
+				ScopedAutoCommitWriteTransaction trans(&db);
+				for (size_t i = 0; i < options.batch; ++i)
+				{
+					q_insert.bind(++value);
+					q_insert.bind(payload);
+					ok = q_insert.write() && ok;
+					q_insert.reset();
+				}
+			}
+			else
+			{
+				q_insert.bind(++value);
+				q_insert.bind(payload);
+				ok = q_insert.write();
+				q_insert.reset();
+			}
+			auto op_end = std::chrono::steady_clock::now();
+
+			++result.summary.ops;
+			result.summary.rows += (std::max)(options.batch, static_cast<size_t>(1));
+			if (!ok)
+				++result.summary.errors;
+			result.latencies_ns.push_back(static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(op_end - op_start).count()));
+		}
+
+		result.summary.busy_events = busy_state.events;
+		result.summary.busy_calls = busy_state.calls;
+	}
+
+	void runReaderThread(const BenchOptions& options, BusyPolicy policy, time_point start, time_point end,
+		uint64_t seed, WorkerResult& result)
+	{
+		Database db(options.db_file);
+		BusyState busy_state;
+		busy_state.policy = policy;
+		busy_state.timeout_ms = options.timeout_ms;
+		busy_state.rnd = seed;
+
+		DatabaseQuery q_get = db.prepare("SELECT id, value, payload FROM contention WHERE id=?");
+
+		sqlite3_busy_handler(db.getDatabase(), busyHandler, &busy_state);
+
+		std::this_thread::sleep_until(start);
+
+		uint64_t rnd = seed | 1;
+		while (std::chrono::steady_clock::now() < end)
+		{
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 7;
+			rnd ^= rnd << 17;
+			int64_t id = static_cast<int64_t>(rnd % c_initial_rows) + 1;
+
+			auto op_start = std::chrono::steady_clock::now();
+			q_get.bind(id);
+			DatabaseCursor& cursor = q_get.cursor();
+			int64_t value = 0;
+			bool found = false;
+			if (cursor.next())
+			{
+				found = cursor.get(1, value);
+			}
+			bool error = cursor.hasError();
+			q_get.reset();
+			auto op_end = std::chrono::steady_clock::now();
+
+			++result.summary.ops;
+			if (found)
+				++result.summary.rows;
+			if (error)
+				++result.summary.errors;
+			result.latencies_ns.push_back(static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(op_end - op_start).count()));
+		}
+
+		result.summary.busy_events = busy_state.events;
+		result.summary.busy_calls = busy_state.calls;
+	}
+
+	bool writeAll(int fd, const void* data, size_t size)
+	{
+		const char* p = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			ssize_t w = write(fd, p, size);
+			if (w <= 0)
+				return false;
+			p += w;
+			size -= static_cast<size_t>(w);
+		}
+		return true;
+	}
+
+	bool readAll(int fd, void* data, size_t size)
+	{
+		char* p = static_cast<char*>(data);
+		while (size > 0)
+		{
+			ssize_t r = read(fd, p, size);
+			if (r <= 0)
+				return false;
+			p += r;
+			size -= static_cast<size_t>(r);
+		}
+		return true;
+	}
+
+	//Runs in the forked child. Each thread gets its own connection
+	int runWorkerProcess(const BenchOptions& options, bool writer, BusyPolicy policy, time_point start, time_point end,
+		uint64_t seed, int fd)
+	{
+		//DatabaseLogger writes retries and errors to stdout
+		if (freopen("/dev/null", "w", stdout) == nullptr)
+			return 1;
+
+		std::vector<WorkerResult> results(options.threads);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < options.threads; ++i)
+		{
+			threads.push_back(std::thread([&, i]() {
+				try
+				{
+					if (writer)
+						runWriterThread(options, policy, start, end, seed + i, results[i]);
+					else
+						runReaderThread(options, policy, start, end, seed + i, results[i]);
+				}
+				catch (std::exception& e)
+				{
+					std::cerr << "Worker error: " << e.what() << std::endl;
+					++results[i].summary.errors;
+				}
+			}));
+		}
+
+		WorkerResult merged;
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i].join();
+			merged.summary.ops += results[i].summary.ops;
+			merged.summary.rows += results[i].summary.rows;
+			merged.summary.busy_events += results[i].summary.busy_events;
+			merged.summary.busy_calls += results[i].summary.busy_calls;
+			merged.summary.errors += results[i].summary.errors;
+			merged.latencies_ns.insert(merged.latencies_ns.end(), results[i].latencies_ns.begin(), results[i].latencies_ns.end());
+		}
+		merged.summary.n_latencies = merged.latencies_ns.size();
+
+		if (!writeAll(fd, &merged.summary, sizeof(merged.summary))
+			|| !writeAll(fd, merged.latencies_ns.data(), merged.latencies_ns.size() * sizeof(uint64_t)))
+			return 1;
+		return 0;
+	}
+
+	struct RoleResult
+	{
+		WorkerResult result;
+		size_t processes = 0;
+	};
+
+	struct BenchResult
+	{
+		std::string journal_mode;
+		std::string policy;
+		RoleResult writers;
+		RoleResult readers;
+		double seconds;
+	};
+
+	void removeDbFiles(const std::string& db_file)
+	{
+		remove(db_file.c_str());
+		remove((db_file + "-wal").c_str());
+		remove((db_file + "-shm").c_str());
+		remove((db_file + "-journal").c_str());
+	}
+
+	void setupDb(const BenchOptions& options, const std::string& journal_mode)
+	{
+		removeDbFiles(options.db_file);
+		Database db(options.db_file);
+		db.write("PRAGMA journal_mode=" + journal_mode);
+		db.write("CREATE TABLE contention (id INTEGER PRIMARY KEY, value INTEGER, payload TEXT)");
+
+		ScopedAutoCommitWriteTransaction trans(&db);
+		DatabaseQuery q = db.prepare("INSERT INTO contention (value, payload) VALUES (?, ?)");
+		std::string payload(100, 'x');
+		for (size_t i = 0; i < c_initial_rows; ++i)
+		{
+			q.bind(static_cast<int64_t>(i));
+			q.bind(payload);
+			q.write();
+			q.reset();
+		}
+	}
+
+	bool runBench(const BenchOptions& options, const std::string& journal_mode, const std::string& policy_name,
+		BenchResult& res)
+	{
+		BusyPolicy policy;
+		if (!parsePolicy(policy_name, policy))
+		{
+			std::cerr << "Unknown busy policy " << policy_name << std::endl;
+			return false;
+		}
+
+		setupDb(options, journal_mode);
+
+		res.journal_mode = journal_mode;
+		res.policy = policy_name;
+		res.seconds = options.duration;
+
+		//Children start at the same time once all of them are forked
+		time_point start = std::chrono::steady_clock::now() + std::chrono::milliseconds(200 + 20 * static_cast<int>(options.writers + options.readers));
+		time_point end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.duration));
+
+		struct Child
+		{
+			pid_t pid;
+			int fd;
+			bool writer;
+		};
+		std::vector<Child> children;
+
+		std::cout.flush();
+		std::cerr.flush();
+
+		for (size_t i = 0; i < options.writers + options.readers; ++i)
+		{
+			bool writer = i < options.writers;
+			int fds[2];
+			if (pipe(fds) != 0)
+			{
+				std::cerr << "Error creating pipe" << std::endl;
+				return false;
+			}
+
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				close(fds[0]);
+				int rc = runWorkerProcess(options, writer, policy, start, end, 0x9E3779B97F4A7C15ULL * (i + 1), fds[1]);
+				close(fds[1]);
+				_exit(rc);
+			}
+			else if (pid < 0)
+			{
+				std::cerr << "Error forking worker" << std::endl;
+				close(fds[0]);
+				close(fds[1]);
+				return false;
+			}
+			close(fds[1]);
+			children.push_back(Child{ pid, fds[0], writer });
+		}
+
+		bool ok = true;
+		for (auto& child : children)
+		{
+			WorkerResult result;
+			if (readAll(child.fd, &result.summary, sizeof(result.summary)))
+			{
+				result.latencies_ns.resize(result.summary.n_latencies);
+				if (!readAll(child.fd, result.latencies_ns.data(), result.latencies_ns.size() * sizeof(uint64_t)))
+					ok = false;
+			}
+			else
+			{
+				ok = false;
+			}
+			close(child.fd);
+
+			int status = 0;
+			waitpid(child.pid, &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				ok = false;
+
+			RoleResult& role = child.writer ? res.writers : res.readers;
+			++role.processes;
+			role.result.summary.ops += result.summary.ops;
+			role.result.summary.rows += result.summary.rows;
+			role.result.summary.busy_events += result.summary.busy_events;
+			role.result.summary.busy_calls += result.summary.busy_calls;
+			role.result.summary.errors += result.summary.errors;
+			role.result.latencies_ns.insert(role.result.latencies_ns.end(), result.latencies_ns.begin(), result.latencies_ns.end());
+		}
+
+		removeDbFiles(options.db_file);
+		return ok;
+	}
+
+	double percentileMs(std::vector<uint64_t>& sorted_ns, double p)
+	{
+		if (sorted_ns.empty())
+			return 0;
+		size_t idx = (std::min)(static_cast<size_t>(p * sorted_ns.size()), sorted_ns.size() - 1);
+		return sorted_ns[idx] / 1000000.0;
+	}
+
+	std::string jsonNumber(double v)
+	{
+		std::ostringstream ss;
+		ss.precision(6);
+		ss << std::fixed << v;
+		return ss.str();
+	}
+
+	std::string roleJson(RoleResult& role, double seconds)
+	{
+		std::vector<uint64_t>& lat = role.result.latencies_ns;
+		std::sort(lat.begin(), lat.end());
+		const WorkerSummary& s = role.result.summary;
+		return "{ \"processes\": " + std::to_string(role.processes)
+			+ ", \"ops\": " + std::to_string(s.ops)
+			+ ", \"rows\": " + std::to_string(s.rows)
+			+ ", \"ops_per_sec\": " + jsonNumber(s.ops / seconds)
+			+ ", \"rows_per_sec\": " + jsonNumber(s.rows / seconds)
+			+ ", \"busy_events\": " + std::to_string(s.busy_events)
+			+ ", \"busy_handler_calls\": " + std::to_string(s.busy_calls)
+			+ ", \"errors\": " + std::to_string(s.errors)
+			+ ", \"p50_ms\": " + jsonNumber(percentileMs(lat, 0.5))
+			+ ", \"p99_ms\": " + jsonNumber(percentileMs(lat, 0.99))
+			+ ", \"p999_ms\": " + jsonNumber(percentileMs(lat, 0.999))
+			+ ", \"max_ms\": " + jsonNumber(lat.empty() ? 0 : lat.back() / 1000000.0) + " }";
+	}
+
+	std::string toJson(std::vector<BenchResult>& results, const BenchOptions& options)
+	{
+		std::string ret = "{\n  \"benchmark\": \"contention\",\n";
+		ret += "  \"writers\": " + std::to_string(options.writers) + ",\n";
+		ret += "  \"readers\": " + std::to_string(options.readers) + ",\n";
+		ret += "  \"threads_per_process\": " + std::to_string(options.threads) + ",\n";
+		ret += "  \"batch\": " + std::to_string(options.batch) + ",\n";
+		ret += "  \"duration_s\": " + jsonNumber(options.duration) + ",\n";
+		ret += "  \"results\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			BenchResult& r = results[i];
+			ret += "    {\n";
+			ret += "      \"journal_mode\": \"" + r.journal_mode + "\",\n";
+			ret += "      \"policy\": \"" + r.policy + "\",\n";
+			ret += "      \"writers\": " + roleJson(r.writers, r.seconds) + ",\n";
+			ret += "      \"readers\": " + roleJson(r.readers, r.seconds) + "\n";
+			ret += std::string("    }") + (i + 1 < results.size() ? "," : "") + "\n";
+		}
+		ret += "  ]\n}\n";
+		return ret;
+	}
+
+	bool parseOptions(int argc, char* argv[], BenchOptions& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (i + 1 >= argc)
+				return false;
+
+			std::string val = argv[++i];
+			if (arg == "--writers")
+				options.writers = static_cast<size_t>(atoll(val.c_str()));
+			else if (arg == "--readers")
+				options.readers = static_cast<size_t>(atoll(val.c_str()));
+			else if (arg == "--threads")
+				options.threads = (std::max)(static_cast<size_t>(atoll(val.c_str())), static_cast<size_t>(1));
+			else if (arg == "--duration")
+				options.duration = (std::max)(atof(val.c_str()), 0.1);
+			else if (arg == "--batch")
+				options.batch = static_cast<size_t>(atoll(val.c_str()));
+			else if (arg == "--timeout")
+				options.timeout_ms = atoi(val.c_str());
+			else if (arg == "--journal")
+			{
+				options.journal_modes.clear();
+				Tokenize(val, options.journal_modes, ",");
+			}
+			else if (arg == "--policy")
+			{
+				options.policies.clear();
+				Tokenize(val, options.policies, ",");
+			}
+			else if (arg == "--db")
+				options.db_file = val;
+			else if (arg == "--out")
+				options.outfile = val;
+			else
+				return false;
+		}
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: sqlgen-contention-bench [--writers N] [--readers M] [--threads T] [--duration S] "
+			"[--batch N] [--journal WAL,DELETE] [--policy none,sleep,sqlite,backoff] [--timeout MS] [--db file] [--out results.json]" << std::endl;
+		return 1;
+	}
+
+	std::vector<BenchResult> results;
+	bool ok = true;
+	for (auto& journal_mode : options.journal_modes)
+	{
+		for (auto& policy : options.policies)
+		{
+			BenchResult res;
+			try
+			{
+				if (!runBench(options, journal_mode, policy, res))
+					ok = false;
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "Error: " << e.what() << std::endl;
+				return 2;
+			}
+			std::cerr << "sqlgen-contention-bench: " << journal_mode << "/" << policy << ": "
+				<< res.writers.result.summary.rows << " rows written, "
+				<< res.readers.result.summary.ops << " reads, "
+				<< (res.writers.result.summary.busy_events + res.readers.result.summary.busy_events) << " busy" << std::endl;
+			results.push_back(std::move(res));
+		}
+	}
+
+	std::string json = toJson(results, options);
+	if (options.outfile.empty())
+	{
+		std::cout << json;
+	}
+	else
+	{
+		writestring(json, options.outfile);
+	}
+
+	return ok ? 0 : 3;
+}
@@ -0,0 +1,603 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+/**
+* Runtime benchmark. Runs point lookups, range scans, inserts and updates
+* through the raw sqlite3 API, Database::read/write, DatabaseCursor with
+* index and name based get() and the generated RuntimeDao on the same
+* schema and data. Reports throughput and C++ heap allocations per
+* operation as JSON for each journal mode, synchronous mode and row width.
+* Also measures opening a Database on the same file.
+*
+* Usage: sqlgen-runtime-bench [--rows N] [--ops N] [--write-ops N] [--open-ops N] [--range N]
+*            [--widths 16,256,4096] [--journal DELETE,WAL] [--sync OFF,NORMAL,FULL]
+*            [--db file] [--out results.json]
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <functional>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../Database.h"
+#include "../DatabaseQuery.h"
+#include "../DatabaseCursor.h"
+#include "../stringtools.h"
+#include "../sqlite/sqlite3.h"
+#include "RuntimeDao.h"
+
+using namespace sqlgen;
+
+namespace
+{
+	std::atomic<uint64_t> n_allocations(0);
+}
+
+void* operator new(size_t size)
+{
+	++n_allocations;
+	void* p = malloc(size == 0 ? 1 : size);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace
+{
+	struct BenchOptions
+	{
+		size_t rows = 10000;
+		size_t ops = 10000;
+		size_t write_ops = 1000;
+		size_t open_ops = 200;
+		size_t range = 100;
+		std::vector<size_t> widths = { 16, 256, 4096 };
+		std::vector<std::string> journal_modes = { "DELETE", "WAL" };
+		std::vector<std::string> sync_modes = { "OFF", "NORMAL", "FULL" };
+		std::string db_file = "runtime_bench.db";
+		std::string outfile;
+	};
+
+	struct BenchResult
+	{
+		std::string journal_mode;
+		std::string synchronous;
+		size_t row_width;
+		std::string operation;
+		std::string api;
+		size_t ops;
+		double seconds;
+		uint64_t allocations;
+	};
+
+	struct Row
+	{
+		int64_t id;
+		std::string name;
+		int64_t value;
+		std::string payload;
+	};
+
+	//Deterministic pseudo random ids so every API sees the same access pattern
+	class IdSequence
+	{
+	public:
+		IdSequence(size_t max_id)
+			: state(88172645463325252ULL), max_id(max_id) {}
+
+		int64_t next() {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			return static_cast<int64_t>(state % max_id) + 1;
+		}
+
+	private:
+		uint64_t state;
+		size_t max_id;
+	};
+
+	std::string makePayload(size_t width, size_t seed)
+	{
+		std::string ret(width, 'a');
+		for (size_t i = 0; i < width; ++i)
+			ret[i] = static_cast<char>('a' + (seed + i) % 26);
+		return ret;
+	}
+
+	std::string makeName(int64_t id)
+	{
+		return "name" + std::to_string(id);
+	}
+
+	void removeDbFiles(const std::string& db_file)
+	{
+		remove(db_file.c_str());
+		remove((db_file + "-wal").c_str());
+		remove((db_file + "-shm").c_str());
+		remove((db_file + "-journal").c_str());
+	}
+
+	void setupData(Database& db, const BenchOptions& options, size_t width)
+	{
+		db.write("CREATE TABLE bench_rows (id INTEGER PRIMARY KEY, name TEXT, value INTEGER, payload TEXT)");
+		db.write("CREATE INDEX bench_rows_value ON bench_rows(value)");
+
+		ScopedAutoCommitWriteTransaction trans(&db);
+		DatabaseQuery q = db.prepare("INSERT INTO bench_rows (id, name, value, payload) VALUES (?, ?, ?, ?)");
+		for (size_t i = 1; i <= options.rows; ++i)
+		{
+			q.bind(static_cast<int64_t>(i));
+			q.bind(makeName(static_cast<int64_t>(i)));
+			q.bind(static_cast<int64_t>(i * 7));
+			q.bind(makePayload(width, i));
+			q.write();
+			q.reset();
+		}
+	}
+
+	class Runner
+	{
+	public:
+		Runner(const std::string& journal_mode, const std::string& synchronous, size_t width,
+			std::vector<BenchResult>& results)
+			: journal_mode(journal_mode), synchronous(synchronous), width(width), results(results) {}
+
+		void run(const std::string& operation, const std::string& api, size_t ops, const std::function<void(size_t)>& op)
+		{
+			uint64_t alloc_start = n_allocations.load();
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < ops; ++i)
+			{
+				op(i);
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			uint64_t allocations = n_allocations.load() - alloc_start;
+
+			results.push_back(BenchResult{ journal_mode, synchronous, width, operation, api, ops, seconds, allocations });
+			std::cerr << "sqlgen-runtime-bench: " << journal_mode << "/" << synchronous << "/" << width << " "
+				<< operation << " " << api << ": " << static_cast<uint64_t>(ops / (std::max)(seconds, 1e-9)) << " ops/s" << std::endl;
+		}
+
+	private:
+		std::string journal_mode;
+		std::string synchronous;
+		size_t width;
+		std::vector<BenchResult>& results;
+	};
+
+	void readRawRow(sqlite3_stmt* stmt, Row& row)
+	{
+		row.id = sqlite3_column_int64(stmt, 0);
+		row.name.assign(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)), sqlite3_column_bytes(stmt, 1));
+		row.value = sqlite3_column_int64(stmt, 2);
+		row.payload.assign(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)), sqlite3_column_bytes(stmt, 3));
+	}
+
+	void readIndexRow(DatabaseCursor& cursor, Row& row)
+	{
+		cursor.get(0, row.id);
+		cursor.get(1, row.name);
+		cursor.get(2, row.value);
+		cursor.get(3, row.payload);
+	}
+
+	void readNameRow(DatabaseCursor& cursor, Row& row)
+	{
+		cursor.get("id", row.id);
+		cursor.get("name", row.name);
+		cursor.get("value", row.value);
+		cursor.get("payload", row.payload);
+	}
+
+	sqlite3_stmt* prepareRaw(Database& db, const std::string& sql)
+	{
+		sqlite3_stmt* stmt = nullptr;
+		if (sqlite3_prepare_v2(db.getDatabase(), sql.c_str(), static_cast<int>(sql.size()), &stmt, nullptr) != SQLITE_OK)
+			throw PrepareError("Error preparing [" + sql + "]: " + sqlite3_errmsg(db.getDatabase()));
+		return stmt;
+	}
+
+	const char* c_point_sql = "SELECT id, name, value, payload FROM bench_rows WHERE id=?";
+	const char* c_range_sql = "SELECT id, name, value, payload FROM bench_rows WHERE id BETWEEN ? AND ?";
+	const char* c_insert_sql = "INSERT INTO bench_rows (id, name, value, payload) VALUES (?, ?, ?, ?)";
+	const char* c_update_sql = "UPDATE bench_rows SET value=?, payload=? WHERE id=?";
+
+	void benchReads(Database& db, const BenchOptions& options, Runner& runner, int64_t& checksum)
+	{
+		RuntimeDao dao(db);
+		Row row;
+		int64_t max_start = static_cast<int64_t>(options.rows > options.range ? options.rows - options.range : 1);
+
+		{
+			sqlite3_stmt* stmt = prepareRaw(db, c_point_sql);
+			IdSequence ids(options.rows);
+			runner.run("point_lookup", "raw", options.ops, [&](size_t) {
+				sqlite3_bind_int64(stmt, 1, ids.next());
+				if (sqlite3_step(stmt) == SQLITE_ROW)
+				{
+					readRawRow(stmt, row);
+					checksum += row.value;
+				}
+				sqlite3_reset(stmt);
+			});
+			sqlite3_finalize(stmt);
+		}
+		{
+			IdSequence ids(options.rows);
+			runner.run("point_lookup", "db_results", options.ops, [&](size_t) {
+				db_results res = db.read("SELECT id, name, value, payload FROM bench_rows WHERE id=" + std::to_string(ids.next()));
+				if (!res.empty())
+					checksum += atoll(res[0]["value"].c_str());
+			});
+		}
+		{
+			DatabaseQuery q = db.prepare(c_point_sql);
+			IdSequence ids(options.rows);
+			runner.run("point_lookup", "cursor_index", options.ops, [&](size_t) {
+				q.bind(ids.next());
+				DatabaseCursor& cursor = q.cursor();
+				if (cursor.next())
+				{
+					readIndexRow(cursor, row);
+					checksum += row.value;
+				}
+				q.reset();
+			});
+		}
+		{
+			DatabaseQuery q = db.prepare(c_point_sql);
+			IdSequence ids(options.rows);
+			runner.run("point_lookup", "cursor_name", options.ops, [&](size_t) {
+				q.bind(ids.next());
+				DatabaseCursor& cursor = q.cursor();
+				if (cursor.next())
+				{
+					readNameRow(cursor, row);
+					checksum += row.value;
+				}
+				q.reset();
+			});
+		}
+		{
+			IdSequence ids(options.rows);
+			runner.run("point_lookup", "dao", options.ops, [&](size_t) {
+				RuntimeDao::BenchRow res = dao.getRowById(ids.next());
+				if (res.exists)
+					checksum += res.value;
+			});
+		}
+
+		size_t range_ops = (std::max)(options.ops / options.range, static_cast<size_t>(1));
+		int64_t range = static_cast<int64_t>(options.range);
+
+		{
+			sqlite3_stmt* stmt = prepareRaw(db, c_range_sql);
+			IdSequence ids(max_start);
+			runner.run("range_scan", "raw", range_ops, [&](size_t) {
+				int64_t start = ids.next();
+				sqlite3_bind_int64(stmt, 1, start);
+				sqlite3_bind_int64(stmt, 2, start + range - 1);
+				std::vector<Row> rows;
+				while (sqlite3_step(stmt) == SQLITE_ROW)
+				{
+					rows.emplace_back();
+					readRawRow(stmt, rows.back());
+				}
+				sqlite3_reset(stmt);
+				checksum += static_cast<int64_t>(rows.size());
+			});
+			sqlite3_finalize(stmt);
+		}
+		{
+			IdSequence ids(max_start);
+			runner.run("range_scan", "db_results", range_ops, [&](size_t) {
+				int64_t start = ids.next();
+				db_results res = db.read("SELECT id, name, value, payload FROM bench_rows WHERE id BETWEEN "
+					+ std::to_string(start) + " AND " + std::to_string(start + range - 1));
+				checksum += static_cast<int64_t>(res.size());
+			});
+		}
+		{
+			DatabaseQuery q = db.prepare(c_range_sql);
+			IdSequence ids(max_start);
+			runner.run("range_scan", "cursor_index", range_ops, [&](size_t) {
+				int64_t start = ids.next();
+				q.bind(start);
+				q.bind(start + range - 1);
+				DatabaseCursor& cursor = q.cursor();
+				std::vector<Row> rows;
+				while (cursor.next())
+				{
+					rows.emplace_back();
+					readIndexRow(cursor, rows.back());
+				}
+				q.reset();
+				checksum += static_cast<int64_t>(rows.size());
+			});
+		}
+		{
+			DatabaseQuery q = db.prepare(c_range_sql);
+			IdSequence ids(max_start);
+			runner.run("range_scan", "cursor_name", range_ops, [&](size_t) {
+				int64_t start = ids.next();
+				q.bind(start);
+				q.bind(start + range - 1);
+				DatabaseCursor& cursor = q.cursor();
+				std::vector<Row> rows;
+				while (cursor.next())
+				{
+					rows.emplace_back();
+					readNameRow(cursor, rows.back());
+				}
+				q.reset();
+				checksum += static_cast<int64_t>(rows.size());
+			});
+		}
+		{
+			IdSequence ids(max_start);
+			runner.run("range_scan", "dao", range_ops, [&](size_t) {
+				int64_t start = ids.next();
+				checksum += static_cast<int64_t>(dao.getRowsInRange(start, start + range - 1).size());
+			});
+		}
+	}
+
+	void benchWrites(Database& db, const BenchOptions& options, size_t width, Runner& runner)
+	{
+		RuntimeDao dao(db);
+		int64_t next_id = static_cast<int64_t>(options.rows) + 1;
+		std::string payload = makePayload(width, 3);
+		std::string name = makeName(next_id);
+
+		{
+			sqlite3_stmt* stmt = prepareRaw(db, c_insert_sql);
+			runner.run("insert", "raw", options.write_ops, [&](size_t i) {
+				sqlite3_bind_int64(stmt, 1, next_id++);
+				sqlite3_bind_text(stmt, 2, name.c_str(), static_cast<int>(name.size()), SQLITE_TRANSIENT);
+				sqlite3_bind_int64(stmt, 3, static_cast<int64_t>(i));
+				sqlite3_bind_text(stmt, 4, payload.c_str(), static_cast<int>(payload.size()), SQLITE_TRANSIENT);
+				sqlite3_step(stmt);
+				sqlite3_reset(stmt);
+			});
+			sqlite3_finalize(stmt);
+		}
+		runner.run("insert", "db_write", options.write_ops, [&](size_t i) {
+			db.write("INSERT INTO bench_rows (id, name, value, payload) VALUES (" + std::to_string(next_id++)
+				+ ", '" + name + "', " + std::to_string(i) + ", '" + payload + "')");
+		});
+		{
+			DatabaseQuery q = db.prepare(c_insert_sql);
+			runner.run("insert", "query", options.write_ops, [&](size_t i) {
+				q.bind(next_id++);
+				q.bind(name);
+				q.bind(static_cast<int64_t>(i));
+				q.bind(payload);
+				q.write();
+				q.reset();
+			});
+		}
+		runner.run("insert", "dao", options.write_ops, [&](size_t i) {
+			dao.addRow(next_id++, name, static_cast<int64_t>(i), payload);
+		});
+
+		{
+			sqlite3_stmt* stmt = prepareRaw(db, c_update_sql);
+			IdSequence ids(options.rows);
+			runner.run("update", "raw", options.write_ops, [&](size_t i) {
+				sqlite3_bind_int64(stmt, 1, static_cast<int64_t>(i));
+				sqlite3_bind_text(stmt, 2, payload.c_str(), static_cast<int>(payload.size()), SQLITE_TRANSIENT);
+				sqlite3_bind_int64(stmt, 3, ids.next());
+				sqlite3_step(stmt);
+				sqlite3_reset(stmt);
+			});
+			sqlite3_finalize(stmt);
+		}
+		{
+			IdSequence ids(options.rows);
+			runner.run("update", "db_write", options.write_ops, [&](size_t i) {
+				db.write("UPDATE bench_rows SET value=" + std::to_string(i) + ", payload='" + payload
+					+ "' WHERE id=" + std::to_string(ids.next()));
+			});
+		}
+		{
+			DatabaseQuery q = db.prepare(c_update_sql);
+			IdSequence ids(options.rows);
+			runner.run("update", "query", options.write_ops, [&](size_t i) {
+				q.bind(static_cast<int64_t>(i));
+				q.bind(payload);
+				q.bind(ids.next());
+				q.write();
+				q.reset();
+			});
+		}
+		{
+			IdSequence ids(options.rows);
+			runner.run("update", "dao", options.write_ops, [&](size_t i) {
+				dao.updateRow(static_cast<int64_t>(i), payload, ids.next());
+			});
+		}
+	}
+
+	std::string jsonNumber(double v)
+	{
+		std::ostringstream ss;
+		ss.precision(6);
+		ss << std::fixed << v;
+		return ss.str();
+	}
+
+	std::string toJson(const std::vector<BenchResult>& results, const BenchOptions& options, int64_t checksum)
+	{
+		std::string ret = "{\n  \"benchmark\": \"runtime\",\n";
+		ret += "  \"rows\": " + std::to_string(options.rows) + ",\n";
+		ret += "  \"range\": " + std::to_string(options.range) + ",\n";
+		ret += "  \"checksum\": " + std::to_string(checksum) + ",\n";
+		ret += "  \"results\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const BenchResult& r = results[i];
+			double ops = static_cast<double>((std::max)(r.ops, static_cast<size_t>(1)));
+			ret += "    { \"journal_mode\": \"" + r.journal_mode + "\", \"synchronous\": \"" + r.synchronous + "\", "
+				"\"row_width\": " + std::to_string(r.row_width) + ", \"operation\": \"" + r.operation + "\", "
+				"\"api\": \"" + r.api + "\", \"ops\": " + std::to_string(r.ops) + ", "
+				"\"seconds\": " + jsonNumber(r.seconds) + ", "
+				"\"ops_per_sec\": " + jsonNumber(r.ops / (std::max)(r.seconds, 1e-9)) + ", "
+				"\"allocations_per_op\": " + jsonNumber(r.allocations / ops) + " }";
+			ret += std::string(i + 1 < results.size() ? "," : "") + "\n";
+		}
+		ret += "  ]\n}\n";
+		return ret;
+	}
+
+	std::vector<size_t> parseSizes(const std::string& arg)
+	{
+		std::vector<std::string> toks;
+		Tokenize(arg, toks, ",");
+		std::vector<size_t> ret;
+		for (auto& tok : toks)
+		{
+			size_t n = static_cast<size_t>(atoll(tok.c_str()));
+			if (n > 0)
+				ret.push_back(n);
+		}
+		return ret;
+	}
+
+	std::vector<std::string> parseList(const std::string& arg)
+	{
+		std::vector<std::string> ret;
+		Tokenize(arg, ret, ",");
+		return ret;
+	}
+
+	bool parseOptions(int argc, char* argv[], BenchOptions& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (i + 1 >= argc)
+				return false;
+
+			std::string val = argv[++i];
+			if (arg == "--rows")
+				options.rows = (std::max)(static_cast<size_t>(atoll(val.c_str())), static_cast<size_t>(1));
+			else if (arg == "--ops")
+				options.ops = static_cast<size_t>(atoll(val.c_str()));
+			else if (arg == "--write-ops")
+				options.write_ops = static_cast<size_t>(atoll(val.c_str()));
+			else if (arg == "--open-ops")
+				options.open_ops = static_cast<size_t>(atoll(val.c_str()));
+			else if (arg == "--range")
+				options.range = (std::max)(static_cast<size_t>(atoll(val.c_str())), static_cast<size_t>(1));
+			else if (arg == "--widths")
+				options.widths = parseSizes(val);
+			else if (arg == "--journal")
+				options.journal_modes = parseList(val);
+			else if (arg == "--sync")
+				options.sync_modes = parseList(val);
+			else if (arg == "--db")
+				options.db_file = val;
+			else if (arg == "--out")
+				options.outfile = val;
+			else
+				return false;
+		}
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: sqlgen-runtime-bench [--rows N] [--ops N] [--write-ops N] [--open-ops N] [--range N] "
+			"[--widths 16,256,4096] [--journal DELETE,WAL] [--sync OFF,NORMAL,FULL] [--db file] [--out results.json]" << std::endl;
+		return 1;
+	}
+
+	std::vector<BenchResult> results;
+	int64_t checksum = 0;
+
+	try
+	{
+		for (auto& journal_mode : options.journal_modes)
+		{
+			for (auto& sync_mode : options.sync_modes)
+			{
+				for (size_t width : options.widths)
+				{
+					removeDbFiles(options.db_file);
+					{
+						str_map params;
+						params["synchronous"] = sync_mode;
+						Database db(options.db_file, {}, std::string::npos, params);
+						db.write("PRAGMA journal_mode=" + journal_mode);
+						setupData(db, options, width);
+
+						Runner runner(journal_mode, sync_mode, width, results);
+						benchReads(db, options, runner, checksum);
+						benchWrites(db, options, width, runner);
+
+						//Connection setup cost of short-lived connections
+						runner.run("open", "database", options.open_ops, [&](size_t) {
+							Database conn(options.db_file, {}, std::string::npos, params);
+						});
+					}
+					removeDbFiles(options.db_file);
+				}
+			}
+		}
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 2;
+	}
+
+	std::string json = toJson(results, options, checksum);
+	if (options.outfile.empty())
+	{
+		std::cout << json;
+	}
+	else
+	{
+		writestring(json, options.outfile);
+	}
+
+	return 0;
+}
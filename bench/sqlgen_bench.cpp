@@ -0,0 +1,292 @@
+/**
+ * Copyright (C) Martin Raiber
+ * SPDX-License-Identifier: Apache-2.0.
+ */
+
+/**
+* Generator benchmark. Synthesizes DAO sources with a growing number of
+* annotated functions, runs them through sqlgen_main and reports the time
+* spent in each pipeline phase as JSON.
+*
+* Usage: sqlgen-bench [--sizes 10,100,1000,10000] [--repeat N] [--out results.json]
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+#include "../Database.h"
+#include "../sqlgen.h"
+#include "../stringtools.h"
+
+using namespace sqlgen;
+
+namespace
+{
+	const size_t c_n_tables = 8;
+
+	class NullBuffer : public std::streambuf
+	{
+	protected:
+		int overflow(int c) override {
+			return c;
+		}
+	};
+
+	void setupSchema(Database& db)
+	{
+		for (size_t t = 0; t < c_n_tables; ++t)
+		{
+			std::string tn = "bench_t" + std::to_string(t);
+			db.write("CREATE TABLE " + tn + " (id INTEGER PRIMARY KEY, name TEXT, value INTEGER, created INTEGER, "
+				"flags INTEGER, score REAL, owner INTEGER, data BLOB)");
+			db.write("CREATE INDEX " + tn + "_name ON " + tn + "(name)");
+		}
+	}
+
+	std::string accessAnnotation(size_t i)
+	{
+		return i % 2 == 0 ? "@-SQLGenAccess" : "@-SQLGenAccessNoCheck";
+	}
+
+	//One annotated function. The shape cycles through the return kinds the generator supports
+	std::string synthFunction(size_t i)
+	{
+		std::string tn = "bench_t" + std::to_string(i % c_n_tables);
+		std::string fn = std::to_string(i);
+		std::string ret;
+		ret += "/**\n";
+		ret += "* " + accessAnnotation(i) + "\n";
+		switch (i % 6)
+		{
+		case 0:
+			ret += "* @func vector<SRow> BenchDao::getRows" + fn + "\n";
+			ret += "* @return int64 id, string name, int64 value, int64 created\n";
+			ret += "* @sql\n";
+			ret += "*      SELECT id, name, value, created FROM " + tn + " WHERE value>:min_value(int64)\n";
+			break;
+		case 1:
+			ret += "* @func SRow BenchDao::getRowById" + fn + "\n";
+			ret += "* @return int64 id, string name, int64 value, int64 created\n";
+			ret += "* @sql\n";
+			ret += "*      SELECT id, name, value, created FROM " + tn + " WHERE id=:id(int64)\n";
+			break;
+		case 2:
+			ret += "* @func optional<string> BenchDao::getName" + fn + "\n";
+			ret += "* @return string name\n";
+			ret += "* @sql\n";
+			ret += "*      SELECT name FROM " + tn + " WHERE id=:id(int64)\n";
+			break;
+		case 3:
+			ret += "* @func int64_t BenchDao::addRow" + fn + "\n";
+			ret += "* @return int64_raw id\n";
+			ret += "* @sql\n";
+			ret += "*      INSERT INTO " + tn + " (name, value, created) VALUES (:name(string), :value(int64), :created(int64)) RETURNING id\n";
+			break;
+		case 4:
+			ret += "* @func void BenchDao::updateRow" + fn + "\n";
+			ret += "* @sql\n";
+			ret += "*      UPDATE " + tn + " SET name=:name(string), value=:value(int64), created=:created(int64),\n";
+			ret += "*          flags=:flags(int), score=:score(double), owner=:owner(int64), data=:data(blob)\n";
+			ret += "*      WHERE id=:id(int64) AND value<>:old_value(int64)\n";
+			break;
+		default:
+		{
+			std::string tn2 = "bench_t" + std::to_string((i + 1) % c_n_tables);
+			ret += "* @func vector<SJoinRow> BenchDao::getJoined" + fn + "\n";
+			ret += "* @return int64 id, string name, int64 value, int64 owner, double score, int64 other_id, string other_name, int flags\n";
+			ret += "* @sql\n";
+			ret += "*      SELECT a.id AS id, a.name AS name, a.value AS value, a.owner AS owner, a.score AS score,\n";
+			ret += "*             b.id AS other_id, b.name AS other_name, a.flags AS flags\n";
+			ret += "*      FROM " + tn + " a INNER JOIN " + tn2 + " b ON a.owner=b.id\n";
+			ret += "*      WHERE a.value BETWEEN :min_value(int64) AND :max_value(int64)\n";
+			ret += "*        AND (a.flags & :flag_mask(int))<>0 AND a.created>:created_after(int64)\n";
+			ret += "*        AND b.name LIKE :name_pattern(string) AND a.score>=:min_score(double)\n";
+			ret += "*      ORDER BY a.value DESC, a.id LIMIT :limit(int)\n";
+			break;
+		}
+		}
+		ret += "*/\n\n";
+		return ret;
+	}
+
+	std::string synthCpp(size_t n)
+	{
+		std::string ret = "#include \"BenchDao.h\"\n\n";
+		for (size_t i = 0; i < n; ++i)
+		{
+			ret += synthFunction(i);
+		}
+		ret += "// eof";
+		return ret;
+	}
+
+	std::string synthHeader()
+	{
+		return "#pragma once\n\n"
+			"#include <vector>\n"
+			"#include <string>\n"
+			"#include \"DatabaseQuery.h\"\n\n"
+			"class BenchDao\n"
+			"{\n"
+			"\tsqlgen::Database& db;\n"
+			"public:\n"
+			"\tBenchDao(sqlgen::Database& db) : db(db) {}\n\n"
+			"\t//@-SQLGenFunctionsBegin\n"
+			"\t//@-SQLGenFunctionsEnd\n\n"
+			"private:\n"
+			"\t//@-SQLGenVariablesBegin\n"
+			"\t//@-SQLGenVariablesEnd\n"
+			"};\n";
+	}
+
+	struct BenchResult
+	{
+		size_t n;
+		size_t source_bytes;
+		size_t output_bytes;
+		bool ok;
+		double total_ms;
+		SqlGenStats stats;
+	};
+
+	BenchResult runOnce(size_t n)
+	{
+		Database db(":memory:");
+		setupSchema(db);
+
+		std::string cppfile = synthCpp(n);
+		std::string headerfile = synthHeader();
+
+		BenchResult res;
+		res.n = n;
+		res.source_bytes = cppfile.size();
+
+		NullBuffer null_buf;
+		std::ostream null_out(&null_buf);
+
+		auto start = std::chrono::steady_clock::now();
+		res.ok = sqlgen_main(db, cppfile, headerfile, std::string(), null_out, &res.stats);
+		res.total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		res.output_bytes = cppfile.size() + headerfile.size();
+		return res;
+	}
+
+	//Keeps the fastest run per phase to reduce noise
+	void mergeMin(BenchResult& best, const BenchResult& curr)
+	{
+		best.ok = best.ok && curr.ok;
+		best.total_ms = (std::min)(best.total_ms, curr.total_ms);
+		best.stats.tokenize_ms = (std::min)(best.stats.tokenize_ms, curr.stats.tokenize_ms);
+		best.stats.annotate_ms = (std::min)(best.stats.annotate_ms, curr.stats.annotate_ms);
+		best.stats.parse_annotations_ms = (std::min)(best.stats.parse_annotations_ms, curr.stats.parse_annotations_ms);
+		best.stats.generate_check_ms = (std::min)(best.stats.generate_check_ms, curr.stats.generate_check_ms);
+		best.stats.generate_nocheck_ms = (std::min)(best.stats.generate_nocheck_ms, curr.stats.generate_nocheck_ms);
+		best.stats.place_data_ms = (std::min)(best.stats.place_data_ms, curr.stats.place_data_ms);
+	}
+
+	std::string jsonNumber(double v)
+	{
+		std::ostringstream ss;
+		ss.precision(6);
+		ss << std::fixed << v;
+		return ss.str();
+	}
+
+	std::string toJson(const std::vector<BenchResult>& results, size_t repeat)
+	{
+		std::string ret = "{\n  \"benchmark\": \"sqlgen\",\n  \"repeat\": " + std::to_string(repeat) + ",\n  \"results\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const BenchResult& r = results[i];
+			ret += "    {\n";
+			ret += "      \"functions\": " + std::to_string(r.n) + ",\n";
+			ret += "      \"generated_functions\": " + std::to_string(r.stats.functions) + ",\n";
+			ret += "      \"ok\": " + std::string(r.ok ? "true" : "false") + ",\n";
+			ret += "      \"source_bytes\": " + std::to_string(r.source_bytes) + ",\n";
+			ret += "      \"output_bytes\": " + std::to_string(r.output_bytes) + ",\n";
+			ret += "      \"total_ms\": " + jsonNumber(r.total_ms) + ",\n";
+			ret += "      \"phases_ms\": {\n";
+			ret += "        \"tokenize\": " + jsonNumber(r.stats.tokenize_ms) + ",\n";
+			ret += "        \"annotate\": " + jsonNumber(r.stats.annotate_ms) + ",\n";
+			ret += "        \"parse_annotations\": " + jsonNumber(r.stats.parse_annotations_ms) + ",\n";
+			ret += "        \"generate_check\": " + jsonNumber(r.stats.generate_check_ms) + ",\n";
+			ret += "        \"generate_nocheck\": " + jsonNumber(r.stats.generate_nocheck_ms) + ",\n";
+			ret += "        \"place_data\": " + jsonNumber(r.stats.place_data_ms) + "\n";
+			ret += "      }\n";
+			ret += std::string("    }") + (i + 1 < results.size() ? "," : "") + "\n";
+		}
+		ret += "  ]\n}\n";
+		return ret;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<size_t> sizes = { 10, 100, 1000, 10000 };
+	size_t repeat = 3;
+	std::string outfile;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--sizes" && i + 1 < argc)
+		{
+			std::vector<std::string> toks;
+			Tokenize(argv[++i], toks, ",");
+			sizes.clear();
+			for (auto& tok : toks)
+			{
+				size_t n = static_cast<size_t>(atoll(tok.c_str()));
+				if (n > 0)
+					sizes.push_back(n);
+			}
+		}
+		else if (arg == "--repeat" && i + 1 < argc)
+		{
+			repeat = (std::max)(static_cast<size_t>(atoi(argv[++i])), static_cast<size_t>(1));
+		}
+		else if (arg == "--out" && i + 1 < argc)
+		{
+			outfile = argv[++i];
+		}
+		else
+		{
+			std::cerr << "Usage: sqlgen-bench [--sizes 10,100,1000,10000] [--repeat N] [--out results.json]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<BenchResult> results;
+	for (size_t n : sizes)
+	{
+		BenchResult best = runOnce(n);
+		for (size_t r = 1; r < repeat; ++r)
+		{
+			mergeMin(best, runOnce(n));
+		}
+		std::cerr << "sqlgen-bench: " << n << " functions in " << jsonNumber(best.total_ms) << " ms" << std::endl;
+		results.push_back(best);
+	}
+
+	std::string json = toJson(results, repeat);
+	if (outfile.empty())
+	{
+		std::cout << json;
+	}
+	else
+	{
+		writestring(json, outfile);
+	}
+
+	for (auto& r : results)
+	{
+		if (!r.ok)
+			return 3;
+	}
+	return 0;
+}
@@ -4,64 +4,408 @@
  */
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include <algorithm>
 #include "Database.h"
 #include "sqlgen.h"
+#include "Importer.h"
+#include "Exporter.h"
+#include "DatabaseQuery.h"
 #include "stringtools.h"
 #include "sqlgen_config.h"
 #include "test.h"
 
 using namespace sqlgen;
 
-int main(int argc, char* argv[])
+namespace
 {
-	if(argc<3)
+	struct GenOptions
 	{
-		if(argc==2 && std::string(argv[1]) == "test")
-		{
-			return test();
-		}
+		std::string db_file;
+		std::vector<std::pair<std::string, std::string> > attach_dbs;
+		std::vector<std::string> files;
+		size_t jobs = 0;
+		bool read_only = false;
+	};
 
+	void printUsage()
+	{
 		std::cout << "SQLite SQLGen version " << SQLGEN_VERSION_MAJOR << "." << SQLGEN_VERSION_MINOR << std::endl;
 		std::cout << "Usage: SQLGen [SQLite database filename] [cpp-file] ([Attached db name] [Attached db filename] ...)" << std::endl;
-		return 1;
+		std::cout << "       SQLGen --db [SQLite database filename] [--attach [name] [filename] ...] [--jobs N] [cpp-file|directory] ..." << std::endl;
+		std::cout << "       SQLGen import --db [SQLite database filename] --table [table] [--delimiter C|tab] [--no-header] [--columns a,b,...]" << std::endl;
+		std::cout << "              [--empty-null] [--create] [--chunk N] [--bulk] [csv/tsv-file] ..." << std::endl;
+		std::cout << "       SQLGen export --db [SQLite database filename] --query [SQL] [--format csv|tsv|binary] [--no-header] [--gzip N] [output-file]" << std::endl;
 	}
 
-	std::string sqlite_db_str=argv[1];
-	std::string cppfile=argv[2];
-	std::string headerfile=getuntil(".cpp", cppfile)+".h";
+	int runImport(int argc, char* argv[])
+	{
+		std::string db_file;
+		std::string table;
+		std::vector<std::string> files;
+		std::string delimiter;
+		bool no_header = false;
+		bool empty_null = false;
+		bool create = false;
+		bool bulk = false;
+		size_t chunk = 0;
+		std::vector<std::string> columns;
 
-	std::vector<std::pair<std::string, std::string> > attach_dbs;
-	for(int i=3;i+1<argc;i+=2)
+		for(int i=2;i<argc;++i)
+		{
+			std::string arg = argv[i];
+			if(arg=="--db" && i+1<argc)
+				db_file = argv[++i];
+			else if(arg=="--table" && i+1<argc)
+				table = argv[++i];
+			else if(arg=="--delimiter" && i+1<argc)
+				delimiter = argv[++i];
+			else if(arg=="--columns" && i+1<argc)
+				Tokenize(argv[++i], columns, ",");
+			else if(arg=="--chunk" && i+1<argc)
+				chunk = static_cast<size_t>(atoll(argv[++i]));
+			else if(arg=="--no-header")
+				no_header = true;
+			else if(arg=="--empty-null")
+				empty_null = true;
+			else if(arg=="--create")
+				create = true;
+			else if(arg=="--bulk")
+				bulk = true;
+			else if(next(arg, 0, "--"))
+			{
+				std::cout << "Unknown option " << arg << std::endl;
+				return 1;
+			}
+			else
+				files.push_back(arg);
+		}
+
+		if(db_file.empty() || table.empty() || files.empty())
+		{
+			printUsage();
+			return 1;
+		}
+
+		try
+		{
+			Database db(db_file);
+			if(bulk)
+				db.beginBulkLoad();
+
+			for(const std::string& file : files)
+			{
+				ImportOptions options = Importer::optionsForFile(file);
+				if(delimiter=="tab" || delimiter=="\\t")
+					options.delimiter = '\t';
+				else if(!delimiter.empty())
+					options.delimiter = delimiter[0];
+				options.header = !no_header;
+				options.columns = columns;
+				options.empty_as_null = empty_null;
+				options.create_table = create;
+				if(chunk>0)
+					options.chunk_rows = chunk;
+
+				Importer importer(db, options);
+				ImportStats stats = importer.importFile(file, table);
+				std::cout << "SQLGen: Imported " << stats.rows << " rows from " << file << " in " << stats.seconds << "s ("
+					<< static_cast<size_t>(stats.rows / (std::max)(stats.seconds, 1e-9)) << " rows/s, parsing " << stats.parse_seconds << "s)" << std::endl;
+			}
+
+			if(bulk)
+				db.endBulkLoad();
+		}
+		catch (std::exception& e)
+		{
+			std::cout << "Error: " << e.what() << std::endl;
+			return 3;
+		}
+		return 0;
+	}
+
+	int runExport(int argc, char* argv[])
 	{
-		attach_dbs.push_back(std::make_pair(argv[i + 1], argv[i]));
+		std::string db_file;
+		std::string sql;
+		std::string format;
+		std::string out_file;
+		bool no_header = false;
+		int gzip_threads = -1;
+
+		for(int i=2;i<argc;++i)
+		{
+			std::string arg = argv[i];
+			if(arg=="--db" && i+1<argc)
+				db_file = argv[++i];
+			else if(arg=="--query" && i+1<argc)
+				sql = argv[++i];
+			else if(arg=="--format" && i+1<argc)
+				format = argv[++i];
+			else if(arg=="--gzip" && i+1<argc)
+				gzip_threads = atoi(argv[++i]);
+			else if(arg=="--no-header")
+				no_header = true;
+			else if(next(arg, 0, "--"))
+			{
+				std::cout << "Unknown option " << arg << std::endl;
+				return 1;
+			}
+			else
+				out_file = arg;
+		}
+
+		if(db_file.empty() || sql.empty() || out_file.empty())
+		{
+			printUsage();
+			return 1;
+		}
+
+		try
+		{
+			Database db(db_file, {}, std::string::npos, {{"read_only", "1"}});
+			DatabaseQuery query = db.prepare(sql);
+
+			ExportOptions options = Exporter::optionsForFile(out_file);
+			if(format=="csv")
+				options.format = ExportFormat_Csv;
+			else if(format=="tsv")
+				options.format = ExportFormat_Tsv;
+			else if(format=="binary")
+				options.format = ExportFormat_Binary;
+			else if(!format.empty())
+			{
+				std::cout << "Unknown format " << format << std::endl;
+				return 1;
+			}
+			options.header = !no_header;
+			if(gzip_threads>=0)
+				options.compress_threads = static_cast<size_t>(gzip_threads);
+
+			Exporter exporter(options);
+			ExportStats stats = exporter.exportQuery(query, out_file);
+			std::cout << "SQLGen: Exported " << stats.rows << " rows to " << out_file << " in " << stats.seconds << "s ("
+				<< static_cast<size_t>(stats.rows / (std::max)(stats.seconds, 1e-9)) << " rows/s, " << stats.written_bytes << " bytes)" << std::endl;
+		}
+		catch (std::exception& e)
+		{
+			std::cout << "Error: " << e.what() << std::endl;
+			return 3;
+		}
+		return 0;
 	}
 
-	std::string cppfile_data;
-	std::string headerfile_data;
-	try
+	bool processFile(Database& db, const std::string& cppfile, std::ostream& out)
 	{
-		str_map db_params;
-		auto sqldb = Database(sqlite_db_str, attach_dbs, std::string::npos, db_params);	
-		cppfile_data=getFile(cppfile);
-		headerfile_data=getFile(headerfile);
+		std::string headerfile=getuntil(".cpp", cppfile)+".h";
+
+		std::string cppfile_data=getFile(cppfile);
+		std::string headerfile_data=getFile(headerfile);
 
 		writestring(cppfile_data, cppfile+".sqlgenbackup");
 		writestring(headerfile_data, headerfile+".sqlgenbackup");
 
-		sqlgen::sqlgen_main(sqldb, cppfile_data, headerfile_data);
+		if(!sqlgen::sqlgen_main(db, cppfile_data, headerfile_data, cppfile+".sqlgencache", out))
+		{
+			out << "SQLGen: Errors in " << cppfile << ". Not writing output." << std::endl;
+			return false;
+		}
+
+		writestring(cppfile_data, cppfile);
+		writestring(headerfile_data, headerfile);
+		return true;
 	}
-	catch (std::exception& e)
+
+	// Tables created by @-SQLGenTempSetup must not leak into the next file
+	void dropTempSchema(Database& db)
 	{
-		std::cout << "Error: " << e.what() << std::endl;
-		return 3;
+		db_results res = db.read("SELECT type, name FROM temp.sqlite_master WHERE type IN ('table', 'view')");
+		for(auto& it : res)
+		{
+			db.write("DROP " + strlower(it["type"]) + " IF EXISTS temp.\"" + it["name"] + "\"");
+		}
+	}
+
+	void collectFiles(const std::string& path, std::vector<std::string>& files)
+	{
+		namespace fs = std::filesystem;
+		if(!fs::is_directory(path))
+		{
+			files.push_back(path);
+			return;
+		}
+
+		std::vector<std::string> dir_files;
+		for(auto& entry : fs::recursive_directory_iterator(path))
+		{
+			if(!entry.is_regular_file() || entry.path().extension()!=".cpp")
+				continue;
+
+			std::string cppfile = entry.path().string();
+			if(!fs::exists(getuntil(".cpp", cppfile)+".h"))
+				continue;
+
+			if(getFile(cppfile).find("@-SQLGen")==std::string::npos)
+				continue;
+
+			dir_files.push_back(cppfile);
+		}
+		std::sort(dir_files.begin(), dir_files.end());
+		files.insert(files.end(), dir_files.begin(), dir_files.end());
+	}
+
+	bool parseOptions(int argc, char* argv[], GenOptions& options)
+	{
+		if(argc>=2 && next(argv[1], 0, "--"))
+		{
+			options.read_only = true;
+			for(int i=1;i<argc;++i)
+			{
+				std::string arg = argv[i];
+				if(arg=="--db" && i+1<argc)
+				{
+					options.db_file = argv[++i];
+				}
+				else if(arg=="--attach" && i+2<argc)
+				{
+					options.attach_dbs.push_back(std::make_pair(argv[i + 2], argv[i + 1]));
+					i+=2;
+				}
+				else if((arg=="--jobs" || arg=="-j") && i+1<argc)
+				{
+					options.jobs = static_cast<size_t>(atoi(argv[++i]));
+				}
+				else if(next(arg, 0, "--"))
+				{
+					std::cout << "Unknown option " << arg << std::endl;
+					return false;
+				}
+				else
+				{
+					collectFiles(arg, options.files);
+				}
+			}
+			return !options.db_file.empty();
+		}
+
+		if(argc<3)
+			return false;
+
+		options.db_file = argv[1];
+		options.files.push_back(argv[2]);
+		options.jobs = 1;
+
+		for(int i=3;i+1<argc;i+=2)
+		{
+			options.attach_dbs.push_back(std::make_pair(argv[i + 1], argv[i]));
+		}
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc==2 && std::string(argv[1]) == "test")
+	{
+		return test();
+	}
+
+	if(argc>=2 && std::string(argv[1]) == "import")
+	{
+		return runImport(argc, argv);
+	}
+
+	if(argc>=2 && std::string(argv[1]) == "export")
+	{
+		return runExport(argc, argv);
+	}
+
+	GenOptions options;
+	if(!parseOptions(argc, argv, options) || options.files.empty())
+	{
+		printUsage();
+		return 1;
 	}
 
-	writestring(cppfile_data, cppfile);
-	writestring(headerfile_data, headerfile);
+	size_t jobs = options.jobs;
+	if(jobs==0)
+		jobs = (std::max)(std::thread::hardware_concurrency(), 1u);
+	jobs = (std::min)(jobs, options.files.size());
+
+	str_map db_params;
+	if(options.read_only)
+		db_params["read_only"] = "1";
+
+	std::atomic<size_t> next_file(0);
+	std::atomic<size_t> failed_files(0);
+	std::mutex output_mutex;
+
+	auto worker = [&]()
+	{
+		std::unique_ptr<Database> sqldb;
+		try
+		{
+			sqldb = std::make_unique<Database>(options.db_file, options.attach_dbs, std::string::npos, db_params);
+		}
+		catch (std::exception& e)
+		{
+			std::lock_guard<std::mutex> lock(output_mutex);
+			std::cout << "Error: " << e.what() << std::endl;
+			return;
+		}
+
+		size_t idx;
+		while((idx = next_file++) < options.files.size())
+		{
+			const std::string& cppfile = options.files[idx];
+			std::ostringstream out;
+			bool ok;
+			try
+			{
+				ok = processFile(*sqldb, cppfile, out);
+				dropTempSchema(*sqldb);
+			}
+			catch (std::exception& e)
+			{
+				out << "Error: " << e.what() << std::endl;
+				ok = false;
+			}
+
+			if(!ok)
+				++failed_files;
+
+			std::lock_guard<std::mutex> lock(output_mutex);
+			if(options.files.size()>1)
+				std::cout << "SQLGen: " << cppfile << std::endl;
+			std::cout << out.str();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(size_t i=1;i<jobs;++i)
+	{
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+	for(auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	size_t unprocessed = options.files.size() - (std::min)(next_file.load(), options.files.size());
+	if(failed_files>0 || unprocessed>0)
+	{
+		std::cout << "SQLGen: " << (failed_files + unprocessed) << " of " << options.files.size() << " files failed." << std::endl;
+		return 3;
+	}
 
 	std::cout << "SQLGen: Ok." << std::endl;
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -11,11 +11,9 @@
 */
 std::vector<Users::User> Users::getUsers()
 {
-	if(!_getUsers.prepared())
-	{
-		_getUsers=db.prepare("SELECT id, name, password FROM users");
-	}
-	auto& cursor=_getUsers.cursor();
+	sqlgen::ReadConnection conn=db.acquireReader();
+	sqlgen::DatabaseQuery& query=_getUsers.get(conn, "SELECT id, name, password FROM users");
+	auto& cursor=query.cursor();
 	std::vector<Users::User> ret;
 	while(cursor.next())
 	{
@@ -37,12 +35,10 @@ std::vector<Users::User> Users::getUsers()
 */
 Users::User Users::getUserById(int64_t id)
 {
-	if(!_getUserById.prepared())
-	{
-		_getUserById=db.prepare("SELECT id, name, password FROM users WHERE id=?");
-	}
-	_getUserById.bind(id);
-	auto& cursor=_getUserById.cursor();
+	sqlgen::ReadConnection conn=db.acquireReader();
+	sqlgen::DatabaseQuery& query=_getUserById.get(conn, "SELECT id, name, password FROM users WHERE id=?");
+	query.bind(id);
+	auto& cursor=query.cursor();
 	User ret = { false, 0, "", "" };
 	if(cursor.next())
 	{
@@ -51,7 +47,7 @@ Users::User Users::getUserById(int64_t id)
 		cursor.get(1, ret.name);
 		cursor.get(2, ret.password);
 	}
-	_getUserById.reset();
+	query.reset();
 	return ret;
 }
 
@@ -64,12 +60,10 @@ Users::User Users::getUserById(int64_t id)
 */
 Users::User Users::getUserByName(const std::string& name)
 {
-	if(!_getUserByName.prepared())
-	{
-		_getUserByName=db.prepare("SELECT id, name, password FROM users WHERE name=?");
-	}
-	_getUserByName.bind(name);
-	auto& cursor=_getUserByName.cursor();
+	sqlgen::ReadConnection conn=db.acquireReader();
+	sqlgen::DatabaseQuery& query=_getUserByName.get(conn, "SELECT id, name, password FROM users WHERE name=?");
+	query.bind(name);
+	auto& cursor=query.cursor();
 	User ret = { false, 0, "", "" };
 	if(cursor.next())
 	{
@@ -78,7 +72,7 @@ Users::User Users::getUserByName(const std::string& name)
 		cursor.get(1, ret.name);
 		cursor.get(2, ret.password);
 	}
-	_getUserByName.reset();
+	query.reset();
 	return ret;
 }
 
@@ -98,7 +92,8 @@ int64_t Users::addUser(const std::string& name, const std::string& password)
 	_addUser.bind(name);
 	_addUser.bind(password);
 	auto& cursor=_addUser.cursor();
-	assert(cursor.next());
+	const auto hasNext = cursor.next();
+	assert(hasNext);
 	int64_t ret;
 	cursor.get(0, ret);
 	_addUser.reset();
@@ -25,13 +25,23 @@ public:
 	User getUserByName(const std::string& name);
 	int64_t addUser(const std::string& name, const std::string& password);
 	void deleteUser(int64_t id);
+	void prepareAll()
+	{
+		_getUsers.prepareAll(db, "SELECT id, name, password FROM users", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		_getUserById.prepareAll(db, "SELECT id, name, password FROM users WHERE id=?", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		_getUserByName.prepareAll(db, "SELECT id, name, password FROM users WHERE name=?", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		if(!_addUser.prepared())
+			_addUser=db.prepare("INSERT INTO users (name, password) VALUES (?, ?) RETURNING id", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+		if(!_deleteUser.prepared())
+			_deleteUser=db.prepare("DELETE FROM users WHERE id=?", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);
+	}
 	//@-SQLGenFunctionsEnd
 
 private:
     //@-SQLGenVariablesBegin
-	sqlgen::DatabaseQuery _getUsers;
-	sqlgen::DatabaseQuery _getUserById;
-	sqlgen::DatabaseQuery _getUserByName;
+	sqlgen::RoutedQuery _getUsers;
+	sqlgen::RoutedQuery _getUserById;
+	sqlgen::RoutedQuery _getUserByName;
 	sqlgen::DatabaseQuery _addUser;
 	sqlgen::DatabaseQuery _deleteUser;
 	//@-SQLGenVariablesEnd
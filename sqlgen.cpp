@@ -7,9 +7,18 @@
 #include "stringtools.h"
 #include <regex>
 #include <iostream>
+#include <string_view>
+#include <string.h>
 #include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+#include <chrono>
 #include "Database.h"
 #include "DatabaseQuery.h"
+#include "sqlgen_config.h"
+#include "sqlite/sqlite3.h"
 
 using namespace sqlgen;
 
@@ -22,6 +31,32 @@ struct GenConfig
 	std::string newline = "\r\n";
 	std::string query_type = "IQuery";
 	std::string cursor_type = "IDatabaseCursor";
+	//Generated statements are per thread (sqlgen::ThreadQuery), so the DAO can be shared between threads
+	bool shared_threads = false;
+	std::ostream* out = &std::cout;
+	SqlGenStats* stats = nullptr;
+};
+
+//Adds the time until destruction to *ms (if set)
+class PhaseTimer
+{
+public:
+	PhaseTimer(double* ms)
+		: ms(ms), start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~PhaseTimer()
+	{
+		if (ms != nullptr)
+		{
+			*ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+private:
+	double* ms;
+	std::chrono::steady_clock::time_point start;
 };
 
 enum CPPFileTokenType
@@ -32,137 +67,165 @@ enum CPPFileTokenType
 
 struct CPPToken
 {
-	CPPToken(const std::string& data, CPPFileTokenType type)
+	CPPToken(std::string_view data, CPPFileTokenType type)
 		: data(data), type(type)
 	{
 	}
 
-	std::string data;
+	//Points into the tokenized file
+	std::string_view data;
 	CPPFileTokenType type;
 };
 
-enum TokenizeState
+bool isIdentChar(char ch)
 {
-	TokenizeState_None,
-	TokenizeState_CommentMultiline,
-	TokenizeState_CommentSingleline
-};
+	return isalnum(static_cast<unsigned char>(ch)) || ch=='_';
+}
 
-std::vector<CPPToken> tokenizeFileRegex(std::string &cppfile)
+//Start of the identifier or number ending before pos
+size_t identStart(std::string_view data, size_t pos)
 {
-	//So much for that. Causes stack overflows
-	std::regex find_comments("(/\\*(\\S|\\s)*?\\*/)|(//.*)", std::regex::ECMAScript);
-	auto comments_begin=std::regex_iterator<std::string::iterator>(cppfile.begin(), cppfile.end(), find_comments);
-	auto comments_end=std::regex_iterator<std::string::iterator>();
+	while(pos>0 && isIdentChar(data[pos-1]))
+		--pos;
+	return pos;
+}
 
-	std::vector<CPPToken> tokens;
-	size_t lastPos=0;
-	for(auto i=comments_begin;i!=comments_end;++i)
+//data[pos]=='"'. Raw string literals are R"delim( ... )delim" with optional u8/u/U/L prefix
+bool isRawStringStart(std::string_view data, size_t pos)
+{
+	if(pos==0 || data[pos-1]!='R')
+		return false;
+	std::string_view prefix = data.substr(identStart(data, pos-1), pos-1-identStart(data, pos-1));
+	return prefix.empty() || prefix=="u8" || prefix=="u" || prefix=="U" || prefix=="L";
+}
+
+//data[pos]=='\''. C++14 digit separator as in 1'000'000
+bool isDigitSeparator(std::string_view data, size_t pos)
+{
+	size_t start = identStart(data, pos);
+	return start<pos && isdigit(static_cast<unsigned char>(data[start]));
+}
+
+//Returns position after the string or char literal starting at pos
+size_t skipLiteral(std::string_view data, size_t pos)
+{
+	char quote = data[pos];
+	if(quote=='"' && isRawStringStart(data, pos))
 	{
-		auto m=*i;
-		size_t pos=m.position(0);
-		if(lastPos<pos)
-		{
-			tokens.push_back(CPPToken(cppfile.substr(lastPos, pos-lastPos), CPPFileTokenType_Code));
-			lastPos=pos;
-		}
-		tokens.push_back(CPPToken(m.str(), CPPFileTokenType_Comment));
-		lastPos+=m.length();
+		size_t open_paren = data.find('(', pos+1);
+		if(open_paren==std::string_view::npos)
+			return data.size();
+		std::string end_seq = ")" + std::string(data.substr(pos+1, open_paren-pos-1)) + "\"";
+		size_t end = data.find(end_seq, open_paren+1);
+		return end==std::string_view::npos ? data.size() : end+end_seq.size();
 	}
-	if(lastPos<cppfile.size())
+
+	for(size_t i=pos+1;i<data.size();++i)
 	{
-		tokens.push_back(CPPToken(cppfile.substr(lastPos), CPPFileTokenType_Code));
+		char ch = data[i];
+		if(ch=='\\')
+			++i;
+		else if(ch==quote)
+			return i+1;
+		else if(ch=='\n')
+			return i; //unterminated
 	}
-
-	return tokens;
+	return data.size();
 }
 
-std::vector<CPPToken> tokenizeFile(std::string &cppfile)
+/**
+* Splits the file into code and comment tokens without copying. Scans for
+* the next '/', '"' or '\'' with memchr and skips string, raw string and
+* char literals so comment markers inside them are not misinterpreted.
+*/
+std::vector<CPPToken> tokenizeFile(std::string_view cppfile)
 {
-	std::string cdata;
 	std::vector<CPPToken> tokens;
-	int state = 0;
-	for (size_t i = 0; i < cppfile.size(); ++i)
+	const char specials[] = { '/', '"', '\'' };
+	size_t next_special[] = { 0, 0, 0 };
+	bool need_scan[] = { true, true, true };
+	size_t code_start = 0;
+	size_t pos = 0;
+	const char* base = cppfile.data();
+	const size_t size = cppfile.size();
+
+	auto addCode = [&](size_t end)
 	{
-		char ch = cppfile[i];
+		if(end>code_start)
+			tokens.push_back(CPPToken(cppfile.substr(code_start, end-code_start), CPPFileTokenType_Code));
+	};
 
-		cdata += ch;
-
-		switch (state)
+	while(pos<size)
+	{
+		size_t curr = std::string_view::npos;
+		for(size_t i=0;i<3;++i)
 		{
-		case 0:
-			if (ch == '/')
+			if(need_scan[i] || (next_special[i]!=std::string_view::npos && next_special[i]<pos))
 			{
-				state = 1;
+				const void* found = memchr(base+pos, specials[i], size-pos);
+				next_special[i] = found==nullptr ? std::string_view::npos : static_cast<const char*>(found)-base;
+				need_scan[i] = false;
 			}
+			if(next_special[i]<curr)
+				curr = next_special[i];
+		}
+
+		if(curr==std::string_view::npos)
 			break;
-		case 1:
-			if (ch == '*')
-			{
-				state = 2;
 
-				if (cdata.size() > 2)
-				{
-					tokens.push_back(CPPToken(cdata.substr(0, cdata.size() - 2), CPPFileTokenType_Code));
-				}
-				cdata = "/*";
-			}
-			else if (ch == '/')
+		char ch = cppfile[curr];
+		if(ch=='/')
+		{
+			if(curr+1<size && cppfile[curr+1]=='*')
 			{
-				state = 3;
-				if (cdata.size() > 2)
+				size_t end = cppfile.find("*/", curr+2);
+				if(end==std::string_view::npos)
 				{
-					tokens.push_back(CPPToken(cdata.substr(0, cdata.size() - 2), CPPFileTokenType_Code));
+					//Unterminated comment stays code
+					break;
 				}
-				cdata = "//";
-			}
-			else
-			{
-				state = 0;
-			}
-			break;
-		case 2:
-			if (ch == '*')
-			{
-				state = 4;
+				end+=2;
+				addCode(curr);
+				tokens.push_back(CPPToken(cppfile.substr(curr, end-curr), CPPFileTokenType_Comment));
+				code_start = pos = end;
 			}
-			break;
-		case 3:
-			if (ch == '\n')
+			else if(curr+1<size && cppfile[curr+1]=='/')
 			{
-				state = 0;
-				if (cdata.size() > 2 && cdata[cdata.size() - 2] == '\r')
+				size_t end = curr+2;
+				while((end = cppfile.find('\n', end))!=std::string_view::npos)
 				{
-					tokens.push_back(CPPToken(cdata.substr(0, cdata.size() - 2), CPPFileTokenType_Comment));
-					cdata = "\r\n";
+					size_t last = end-1;
+					if(cppfile[last]=='\r' && last>curr+1)
+						--last;
+					if(cppfile[last]!='\\')
+						break;
+					++end; //line continuation
 				}
-				else
-				{
-					tokens.push_back(CPPToken(cdata.substr(0, cdata.size() - 1), CPPFileTokenType_Comment));
-					cdata = "\n";
-				}
-				cdata = "\n";
+				if(end==std::string_view::npos)
+					end = size;
+				pos = end;
+				if(end>curr && cppfile[end-1]=='\r')
+					--end;
+				addCode(curr);
+				tokens.push_back(CPPToken(cppfile.substr(curr, end-curr), CPPFileTokenType_Comment));
+				code_start = end;
 			}
-			break;
-		case 4:
-			if (ch == '/')
-			{
-				state = 0;
-				tokens.push_back(CPPToken(cdata, CPPFileTokenType_Comment));
-				cdata.clear();
-			}
-			else if(ch!='*')
+			else
 			{
-				state = 2;
+				pos = curr+1;
 			}
-			break;
+		}
+		else if(ch=='\'' && isDigitSeparator(cppfile, curr))
+		{
+			pos = curr+1;
+		}
+		else
+		{
+			pos = skipLiteral(cppfile, curr);
 		}
 	}
 
-	if (!cdata.empty())
-	{
-		tokens.push_back(CPPToken(cdata, CPPFileTokenType_Code));
-	}
+	addCode(size);
 
 	return tokens;
 }
@@ -174,13 +237,15 @@ struct AnnotatedCode
 	{
 	}
 
-	AnnotatedCode(std::string code)
-		: code(code)
+	AnnotatedCode(std::string_view source)
+		: source(source)
 	{
 	}
 
 	std::map<std::string, std::string> annotations;
 	std::string code;
+	//Unchanged code. Points into the input file
+	std::string_view source;
 };
 
 std::string cleanup_annotation(const std::string& annotation)
@@ -218,12 +283,18 @@ std::string cleanup_annotation(const std::string& annotation)
 	return ret;
 };
 
-std::string extractFirstFunction(const std::string& data)
+std::string_view extractFirstFunction(std::string_view data)
 {
 	int c=0;
 	bool was_in_function=false;
 	for(size_t i=0;i<data.size();++i)
 	{
+		if(data[i]=='"' || (data[i]=='\'' && !isDigitSeparator(data, i)))
+		{
+			i=skipLiteral(data, i)-1;
+			continue;
+		}
+
 		if(data[i]=='{') ++c;
 		if(data[i]=='}') --c;
 
@@ -238,10 +309,10 @@ std::string extractFirstFunction(const std::string& data)
 		}
 	}
 
-	return std::string();
+	return std::string_view();
 }
 
-std::map<std::string, std::string> parseAnnotations(const std::string& data)
+std::map<std::string, std::string> parseAnnotations(std::string_view data)
 {
 	int state = 0;
 	std::string name;
@@ -308,14 +379,14 @@ std::map<std::string, std::string> parseAnnotations(const std::string& data)
 	return ret;
 }
 
-std::map<std::string, std::string> parseAnnotationSingle(const std::string& data)
+std::map<std::string, std::string> parseAnnotationSingle(std::string_view data)
 {
 	//Doesn't work with MSVC2015 (out of stack memory): "@([^ \\r\\n]*)[ ]*(((?!@)(?!\\*/)(\\S|\\s))*)"
 	//std::regex find_annotations = std::regex("@([^ \\r\\n]*)[ ]*((\\S|\\s)*?)(?=(\\*/)|@)", std::regex::ECMAScript);
 	std::regex find_annotations = std::regex("@([^ \\r\\n]*)[ ]*((\\S|\\s)*?)", std::regex::ECMAScript);
 	std::map<std::string, std::string> ret;
-	for (auto it = std::regex_iterator<std::string::const_iterator>(data.begin(), data.end(), find_annotations);
-		it != std::regex_iterator<std::string::const_iterator>(); ++it)
+	for (auto it = std::regex_iterator<std::string_view::const_iterator>(data.begin(), data.end(), find_annotations);
+		it != std::regex_iterator<std::string_view::const_iterator>(); ++it)
 	{
 		auto m = *it;
 		std::string annotation_text = m[2].str();
@@ -325,32 +396,42 @@ std::map<std::string, std::string> parseAnnotationSingle(const std::string& data
 	return ret;
 }
 
-std::vector<AnnotatedCode> getAnnotatedCode(const std::vector<CPPToken>& tokens)
+std::vector<AnnotatedCode> getAnnotatedCode(const std::vector<CPPToken>& tokens, double* parse_ms = nullptr)
 {
 	std::vector<AnnotatedCode> ret;
+	ret.reserve(tokens.size()+tokens.size()/2);
 	for(size_t i=0;i<tokens.size();++i)
 	{
 		if(tokens[i].type==CPPFileTokenType_Comment)
 		{
-			std::map<std::string, std::string> annotations = parseAnnotations(tokens[i].data);
+			std::string_view comment=tokens[i].data;
+			std::map<std::string, std::string> annotations;
 
-			if (tokens[i].data.find("//") == 0)
+			if(comment.find('@')!=std::string_view::npos)
 			{
-				annotations = parseAnnotationSingle(tokens[i].data);
+				PhaseTimer timer(parse_ms);
+				if (comment.compare(0, 2, "//") == 0)
+				{
+					annotations = parseAnnotationSingle(comment);
+				}
+				else
+				{
+					annotations = parseAnnotations(comment);
+				}
 			}
 
-			ret.push_back(AnnotatedCode(tokens[i].data));
+			ret.push_back(AnnotatedCode(comment));
 
 			if(!annotations.empty())
 			{
 				if(i+1<tokens.size() && tokens[i+1].type==CPPFileTokenType_Code)
 				{
-					std::string next_code=tokens[i+1].data;
-					std::string first_function=extractFirstFunction(next_code);
+					std::string_view next_code=tokens[i+1].data;
+					std::string_view first_function=extractFirstFunction(next_code);
 
 					if(!first_function.empty())
 					{
-						ret.push_back(AnnotatedCode(annotations, first_function));
+						ret.push_back(AnnotatedCode(annotations, std::string(first_function)));
 						ret.push_back(AnnotatedCode(next_code.substr(first_function.size())));
 						++i;
 					}
@@ -389,11 +470,24 @@ std::vector<ReturnType> parseReturnTypes(std::string return_str)
 	for(size_t i=0;i<toks.size();++i)
 	{
 		toks[i]=trim(toks[i]);
-		ret.push_back(ReturnType(getuntil(" ", toks[i]), getafter(" ", toks[i])));
+		if(toks[i].find(' ')==std::string::npos)
+		{
+			//Type is inferred from the schema
+			ret.push_back(ReturnType("", toks[i]));
+		}
+		else
+		{
+			ret.push_back(ReturnType(getuntil(" ", toks[i]), getafter(" ", toks[i])));
+		}
 	}
 	return ret;
 }
 
+bool isArrayType(const std::string& type)
+{
+	return type.size()>2 && type.compare(type.size()-2, 2, "[]")==0;
+}
+
 std::string parseSqlString(std::string sql, std::vector<ReturnType>& types)
 {
 	std::regex find_var(":([^ (]*)\\(([^)]*?)\\)",std::regex::ECMAScript);
@@ -406,10 +500,50 @@ std::string parseSqlString(std::string sql, std::vector<ReturnType>& types)
 		if(m.position()>lastPos)
 		{
 			retSql+=sql.substr(lastPos, m.position()-lastPos);
-			lastPos=m.position()+m[0].length();
 		}
-		retSql+="?";
-		types.push_back(ReturnType(m[2].str(), m[1].str()));
+		lastPos=m.position()+m[0].length();
+
+		std::string type=m[2].str();
+		if(isArrayType(type))
+		{
+			size_t open_pos=retSql.find_last_not_of(" \t\r\n");
+			size_t close_pos=sql.find_first_not_of(" \t\r\n", lastPos);
+			std::string prev_token;
+			if(open_pos!=std::string::npos && retSql[open_pos]=='(')
+			{
+				size_t token_end=retSql.find_last_not_of(" \t\r\n", open_pos==0 ? std::string::npos : open_pos-1);
+				if(open_pos>0 && token_end!=std::string::npos)
+				{
+					size_t token_start=token_end;
+					while(token_start>0 && (isalnum(static_cast<unsigned char>(retSql[token_start-1])) || retSql[token_start-1]=='_'))
+						--token_start;
+					prev_token=strlower(retSql.substr(token_start, token_end-token_start+1));
+				}
+			}
+
+			if(prev_token=="in"
+				&& close_pos!=std::string::npos && sql[close_pos]==')')
+			{
+				//IN (:ids(int64[])) -> IN carray(?)
+				retSql.erase(open_pos);
+				lastPos=close_pos+1;
+				retSql+="carray(?)";
+			}
+			else if(prev_token=="carray")
+			{
+				//carray(:ids(int64[])) -> carray(?)
+				retSql+="?";
+			}
+			else
+			{
+				retSql+="carray(?)";
+			}
+		}
+		else
+		{
+			retSql+="?";
+		}
+		types.push_back(ReturnType(type, m[1].str()));
 	}
 	if(lastPos<sql.size())
 	{
@@ -429,10 +563,14 @@ struct GeneratedData
 	std::string funcdecls;
 	std::map<std::string, SStructure> structures;
 	std::string variables;
+	std::string prepare_all;
+	std::set<std::string> touched_structures;
+	int errors = 0;
 };
 
 void generateStructure(std::string name, std::vector<ReturnType> return_types, const GenConfig& config, GeneratedData& gen_data, bool use_exists)
 {
+	gen_data.touched_structures.insert(name);
 	if(gen_data.structures.find(name)!=gen_data.structures.end() && (!use_exists || gen_data.structures[name].use_exist ) )
 	{
 		return;
@@ -474,6 +612,7 @@ std::string generateConditional(ReturnType rtype, const GenConfig& config, Gener
 		cond_name+=rtype.type.substr(1);
 	}
 	cond_name="Cond"+cond_name;
+	gen_data.touched_structures.insert(cond_name);
 
 	if(gen_data.structures.find(cond_name)!=gen_data.structures.end())
 	{
@@ -570,6 +709,208 @@ std::string return_blob(size_t tabs, std::string value_name, std::string sql_nam
 	return ret;
 }
 
+//First top-level keyword of the statement, skipping common table expressions
+StatementType getStatementType(const std::string& sql)
+{
+	std::string lsql=strlower(sql);
+	int depth=0;
+	char quote=0;
+	std::string word;
+	bool with=false;
+	for(size_t i=0;i<=lsql.size();++i)
+	{
+		char ch=i<lsql.size() ? lsql[i] : ' ';
+		if(quote!=0)
+		{
+			if(ch==quote)
+				quote=0;
+			continue;
+		}
+		if(ch=='\'' || ch=='"' || ch=='`')
+		{
+			quote=ch;
+			continue;
+		}
+		if(ch=='(')
+			++depth;
+		else if(ch==')')
+			--depth;
+
+		if(depth==0 && ((ch>='a' && ch<='z') || ch=='_'))
+		{
+			word+=ch;
+			continue;
+		}
+		if(word.empty())
+			continue;
+
+		if(word=="select" || word=="values")
+			return StatementType_Select;
+		else if(word=="insert" || word=="replace")
+			return StatementType_Insert;
+		else if(word=="update")
+			return StatementType_Update;
+		else if(word=="delete")
+			return StatementType_Delete;
+		else if(word=="create")
+			return StatementType_Create;
+		else if(word=="drop")
+			return StatementType_Drop;
+		else if(word=="with")
+			with=true;
+		else if(!with)
+			return StatementType_None;
+		word.clear();
+	}
+	return StatementType_None;
+}
+
+struct ResultColumn
+{
+	std::string name;
+	//Declared type of the table column. Empty for expressions
+	std::string decl_type;
+	std::string origin;
+	bool primary_key = false;
+};
+
+/**
+* Prepares the statement and reads its result columns. With
+* SQLITE_ENABLE_COLUMN_METADATA the table column each result column comes
+* from is known as well.
+*/
+bool describeStatement(Database& db, const std::string& sql, std::vector<ResultColumn>& columns, bool& read_only)
+{
+	sqlite3_stmt* stmt=nullptr;
+	if(sqlite3_prepare_v2(db.getDatabase(), sql.c_str(), static_cast<int>(sql.size()), &stmt, nullptr)!=SQLITE_OK
+		|| stmt==nullptr)
+	{
+		sqlite3_finalize(stmt);
+		return false;
+	}
+
+	read_only=sqlite3_stmt_readonly(stmt)!=0;
+
+	int ncols=sqlite3_column_count(stmt);
+	for(int i=0;i<ncols;++i)
+	{
+		ResultColumn col;
+		const char* name=sqlite3_column_name(stmt, i);
+		col.name=name!=nullptr ? name : "";
+		const char* decl_type=sqlite3_column_decltype(stmt, i);
+		if(decl_type!=nullptr)
+			col.decl_type=decl_type;
+#ifdef SQLITE_ENABLE_COLUMN_METADATA
+		const char* db_name=sqlite3_column_database_name(stmt, i);
+		const char* table=sqlite3_column_table_name(stmt, i);
+		const char* origin=sqlite3_column_origin_name(stmt, i);
+		if(db_name!=nullptr && table!=nullptr && origin!=nullptr)
+		{
+			col.origin=std::string(db_name)+"."+table+"."+origin;
+			int primary_key=0;
+			if(sqlite3_table_column_metadata(db.getDatabase(), db_name, table, origin,
+				nullptr, nullptr, nullptr, &primary_key, nullptr)==SQLITE_OK)
+			{
+				col.primary_key=primary_key!=0;
+			}
+		}
+#endif
+		columns.push_back(col);
+	}
+	sqlite3_finalize(stmt);
+	return true;
+}
+
+enum ColumnAffinity
+{
+	ColumnAffinity_Integer,
+	ColumnAffinity_Text,
+	ColumnAffinity_Blob,
+	ColumnAffinity_Real,
+	ColumnAffinity_Numeric
+};
+
+//SQLite's rules for the affinity of a declared column type
+ColumnAffinity getAffinity(const std::string& decl_type)
+{
+	std::string t=strlower(decl_type);
+	if(t.find("int")!=std::string::npos)
+		return ColumnAffinity_Integer;
+	if(t.find("char")!=std::string::npos || t.find("clob")!=std::string::npos || t.find("text")!=std::string::npos)
+		return ColumnAffinity_Text;
+	if(t.empty() || t.find("blob")!=std::string::npos)
+		return ColumnAffinity_Blob;
+	if(t.find("real")!=std::string::npos || t.find("floa")!=std::string::npos || t.find("doub")!=std::string::npos)
+		return ColumnAffinity_Real;
+	return ColumnAffinity_Numeric;
+}
+
+/**
+* Fills in missing @return types from the declared column types and warns
+* about annotations that lose data. Returns false if a return value is not
+* a result column or its type cannot be inferred.
+*/
+bool checkReturnTypes(std::vector<ReturnType>& return_types, const std::vector<ResultColumn>& columns,
+	const std::string& sql, const GenConfig& config, const std::string& func)
+{
+	for(ReturnType& rtype : return_types)
+	{
+		auto col=std::find_if(columns.begin(), columns.end(), [&rtype](const ResultColumn& c) {
+			return c.name==rtype.name;
+		});
+		if(col==columns.end())
+		{
+			*config.out << "ERROR Cannot find variable '" << rtype.name << "' in SQL: " << sql << " Function: " << func << std::endl;
+			return false;
+		}
+
+		std::string type=greplace("_raw", "", rtype.type);
+		if(col->decl_type.empty())
+		{
+			if(type.empty())
+			{
+				*config.out << "ERROR Cannot infer type of expression '" << rtype.name << "'. Annotate it in @return. Function: " << func << std::endl;
+				return false;
+			}
+			continue;
+		}
+
+		std::string lower_decl=strlower(col->decl_type);
+		ColumnAffinity affinity=getAffinity(col->decl_type);
+		if(type.empty())
+		{
+			switch(affinity)
+			{
+			case ColumnAffinity_Integer: rtype.type="int64"; break;
+			case ColumnAffinity_Text: rtype.type="string"; break;
+			case ColumnAffinity_Blob: rtype.type="blob"; break;
+			case ColumnAffinity_Real: rtype.type="double"; break;
+			//DATE, DECIMAL etc. may hold text or exact numbers a double cannot represent
+			case ColumnAffinity_Numeric: rtype.type=lower_decl.find("bool")!=std::string::npos ? "int" : "string"; break;
+			}
+			continue;
+		}
+
+		std::string column_desc="'"+rtype.name+"' ("+(col->origin.empty() ? col->name : col->origin)+" "+col->decl_type+")";
+		if(type=="int" && affinity==ColumnAffinity_Integer
+			&& (col->primary_key || lower_decl.find("big")!=std::string::npos || lower_decl.find("int8")!=std::string::npos
+				|| lower_decl.find("int64")!=std::string::npos))
+		{
+			*config.out << "WARNING int for " << column_desc << " may overflow 32 bits. Use int64. Function: " << func << std::endl;
+		}
+		else if((type=="int" || type=="int64" || type=="int64_t")
+			&& (affinity==ColumnAffinity_Text || affinity==ColumnAffinity_Blob))
+		{
+			*config.out << "WARNING " << type << " for " << column_desc << " converts text to a number. Function: " << func << std::endl;
+		}
+		else if((type=="int" || type=="int64" || type=="int64_t") && affinity==ColumnAffinity_Real)
+		{
+			*config.out << "WARNING " << type << " for " << column_desc << " truncates the fractional part. Use double. Function: " << func << std::endl;
+		}
+	}
+	return true;
+}
+
 std::string getReturnCol(const std::string& return_name, const std::map<std::string, size_t>& return_cols)
 {
 	auto it = return_cols.find(return_name);
@@ -579,6 +920,207 @@ std::string getReturnCol(const std::string& return_name, const std::map<std::str
 		return std::to_string(it->second);
 }
 
+//Parses "size=N ttl=T" of @cache. T is in seconds or has a ms, s, m or h suffix
+bool parseCacheAnnotation(const std::string& val, size_t& size, int64_t& ttl_ms)
+{
+	std::vector<std::string> toks;
+	Tokenize(val, toks, " \t");
+	for(const std::string& tok : toks)
+	{
+		std::string key=getuntil("=", tok);
+		std::string value=getafter("=", tok);
+		if(key=="size" && !value.empty())
+		{
+			size=static_cast<size_t>(atoll(value.c_str()));
+		}
+		else if(key=="ttl" && !value.empty())
+		{
+			int64_t mult=1000;
+			if(value.size()>2 && value.substr(value.size()-2)=="ms")
+				mult=1;
+			else if(value.back()=='m')
+				mult=60*1000;
+			else if(value.back()=='h')
+				mult=60*60*1000;
+			ttl_ms=atoll(value.c_str())*mult;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//Parses "[db.]table.column [write]" of @blob_stream
+bool parseBlobStreamAnnotation(const std::string& val, std::string& db_name, std::string& table, std::string& column, bool& writable)
+{
+	std::vector<std::string> toks;
+	Tokenize(val, toks, " \t");
+	if(toks.empty() || toks.size()>2)
+		return false;
+	if(toks.size()==2)
+	{
+		if(toks[1]!="write")
+			return false;
+		writable=true;
+	}
+
+	std::vector<std::string> names;
+	Tokenize(toks[0], names, ".");
+	if(names.size()==2)
+	{
+		table=names[0];
+		column=names[1];
+	}
+	else if(names.size()==3)
+	{
+		db_name=names[0];
+		table=names[1];
+		column=names[2];
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+struct ReadTables
+{
+	//"db.table" of tables with read columns
+	std::set<std::string> tables;
+	//Names of all read tables. The db name is not reported for tables read without columns
+	std::set<std::string> names;
+};
+
+int readTablesAuthorizer(void* p, int action, const char* table, const char* column, const char* db_name, const char* trigger)
+{
+	if(action==SQLITE_READ && table!=nullptr)
+	{
+		ReadTables* read_tables=static_cast<ReadTables*>(p);
+		read_tables->names.insert(table);
+		if(db_name!=nullptr)
+			read_tables->tables.insert(std::string(db_name)+"."+table);
+	}
+	return SQLITE_OK;
+}
+
+//Tables opened by the program, also ones the authorizer does not report (e.g. for COUNT(*))
+void addOpenedTables(Database& db, const db_results& ops, std::set<std::string>& tables)
+{
+	std::map<std::string, std::string> db_names;
+	for(const db_single_result& op : ops)
+	{
+		auto opcode=op.find("opcode");
+		if(opcode==op.end() || opcode->second!="OpenRead")
+			continue;
+
+		if(db_names.empty())
+		{
+			db_results dbs=db.read("PRAGMA database_list");
+			for(auto& it : dbs)
+				db_names[it["seq"]]=it["name"];
+		}
+
+		auto db_name=db_names.find(op.at("p3"));
+		if(db_name==db_names.end())
+			continue;
+
+		db_results res=db.read("SELECT tbl_name FROM \""+db_name->second+"\".sqlite_master WHERE rootpage="+std::to_string(atoll(op.at("p2").c_str())));
+		if(!res.empty())
+			tables.insert(db_name->second+"."+res[0]["tbl_name"]);
+	}
+}
+
+bool isIdentifierChar(char ch)
+{
+	return isalnum(static_cast<unsigned char>(ch)) || ch=='_' || ch=='$';
+}
+
+bool containsIdentifier(const std::string& lsql, const std::string& lname)
+{
+	for(size_t pos=lsql.find(lname);pos!=std::string::npos;pos=lsql.find(lname, pos+1))
+	{
+		if((pos==0 || !isIdentifierChar(lsql[pos-1]))
+			&& (pos+lname.size()==lsql.size() || !isIdentifierChar(lsql[pos+lname.size()])))
+			return true;
+	}
+	return false;
+}
+
+std::string virtualTableModule(Database& db, const std::string& name)
+{
+	db_results dbs=db.read("PRAGMA database_list");
+	for(auto& it : dbs)
+	{
+		auto q=db.prepare("SELECT sql FROM \""+it["name"]+"\".sqlite_master WHERE type='table' AND name=? COLLATE NOCASE");
+		q.bind(name);
+		db_results res=q.read();
+		if(res.empty())
+			continue;
+
+		std::string sql=strlower(res[0]["sql"]);
+		if(sql.find("create virtual table")!=0)
+			return std::string();
+		std::string module=trim(getafter(" using ", sql));
+		size_t end=0;
+		while(end<module.size() && isIdentifierChar(module[end]))
+			++end;
+		return module.substr(0, end);
+	}
+	//Eponymous virtual table
+	return strlower(name);
+}
+
+/**
+* Readers are separate connections. They do not have the temp schema
+* (e.g. tables created by -SQLGenTempSetup) or virtual tables of modules
+* that are only registered on this connection (e.g. VectorTable).
+*/
+bool usesConnectionObjects(Database& db, const std::string& sql, const db_results& ops, const std::set<std::string>& read_names)
+{
+	std::string lsql=strlower(sql);
+	db_results temp_objects=db.read("SELECT name FROM temp.sqlite_master WHERE type IN ('table', 'view')");
+	for(auto& it : temp_objects)
+	{
+		if(containsIdentifier(lsql, strlower(it["name"])))
+			return true;
+	}
+
+	bool has_vtab=false;
+	for(const db_single_result& op : ops)
+	{
+		auto opcode=op.find("opcode");
+		if(opcode!=op.end() && opcode->second=="VOpen")
+			has_vtab=true;
+	}
+	if(!has_vtab)
+		return false;
+
+	//Modules every connection has
+	static std::set<std::string> shared_modules;
+	if(shared_modules.empty())
+	{
+		Database mem(":memory:");
+		db_results res=mem.read("PRAGMA module_list");
+		for(auto& it : res)
+			shared_modules.insert(strlower(it["name"]));
+	}
+
+	for(const std::string& name : read_names)
+	{
+		std::string lname=strlower(name);
+		if(lname=="sqlite_master" || lname=="sqlite_schema" || next(lname, 0, "pragma_"))
+			continue;
+
+		std::string module=virtualTableModule(db, name);
+		if(!module.empty() && shared_modules.find(module)==shared_modules.end())
+			return true;
+	}
+	return false;
+}
+
 AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenConfig& config, GeneratedData& gen_data, bool check)
 {
 	std::string nl = config.newline;
@@ -588,7 +1130,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 	std::string return_type=getuntil(" ", func);
 	std::string funcsig=getafter(" ", func);
 
-	std::cout << "Generating func " << funcsig << std::endl;
+	*config.out << "Generating func " << funcsig << std::endl;
 
 	std::string struct_name=return_type;
 
@@ -604,7 +1146,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 
 	if(query_name.empty())
 	{
-		std::cout << "Empty query name" << std::endl;
+		*config.out << "Empty query name" << std::endl;
 		return AnnotatedCode(input.annotations, ""); 
 	}
 
@@ -627,20 +1169,23 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		size_t last_c = return_type.find_last_of('>');
 		if (last_c == std::string::npos)
 		{
-			std::cout << "cannot find closing > for optional in func " << func << std::endl;
+			*config.out << "cannot find closing > for optional in func " << func << std::endl;
 			return AnnotatedCode(input.annotations, "");
 		}
 
 		size_t first_c = return_type.find('<');
 		if (first_c == std::string::npos)
 		{
-			std::cout << "cannot find opening < for optional in func " << func << std::endl;
+			*config.out << "cannot find opening < for optional in func " << func << std::endl;
 			return AnnotatedCode(input.annotations, "");
 		}
 
 		return_type = return_type.substr(first_c+1, last_c - first_c - 1);
 	}
 
+	//Returns a DatabaseBlob on the column given with @blob_stream in the row with the selected rowid
+	bool return_blob_stream = return_type=="blob_stream";
+
 	bool return_vector=false;
 
 	if(return_type.find("vector")==0)
@@ -660,54 +1205,62 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 			return_type="std::vector<std::string>";
 		}
 		if(struct_name=="int64")
-		{
-			return_type="std::vector<int64_t>";
-		}
-		return_vector=true;
-	}
-
-	StatementType stmt_type=StatementType_None;
-	size_t op_pos;
-	if( (op_pos=strlower(sql).find("select"))!=std::string::npos)
-	{
-		stmt_type=StatementType_Select;
-	}
-	size_t new_pos;
-	if( (new_pos = strlower(sql).find("delete"))!=std::string::npos
-		&& new_pos<op_pos)
-	{
-		stmt_type=StatementType_Delete;
-		op_pos=new_pos;
-	}
-	if( (new_pos = strlower(sql).find("insert"))!=std::string::npos
-		&& new_pos<op_pos)
-	{
-		stmt_type=StatementType_Insert;
-		op_pos=new_pos;
-	}
-	if( (new_pos = strlower(sql).find("update"))!=std::string::npos
-		&& new_pos<op_pos)
-	{
-		stmt_type=StatementType_Update;
-		op_pos=new_pos;
-	}
-	if( (new_pos = strlower(sql).find("create"))!=std::string::npos
-		&& new_pos<op_pos)
-	{
-		stmt_type=StatementType_Create;
-		op_pos=new_pos;
+		{
+			return_type="std::vector<int64_t>";
+		}
+		return_vector=true;
 	}
-	if( (new_pos = strlower(sql).find("drop"))!=std::string::npos
-		&& new_pos<op_pos)
+
+	StatementType stmt_type=getStatementType(sql);
+	if(stmt_type==StatementType_None)
 	{
-		stmt_type=StatementType_Drop;
-		op_pos=new_pos;
+		//Earliest statement keyword anywhere in the SQL
+		size_t op_pos=std::string::npos;
+		const std::pair<const char*, StatementType> keywords[] = {
+			{ "select", StatementType_Select }, { "delete", StatementType_Delete },
+			{ "insert", StatementType_Insert }, { "update", StatementType_Update },
+			{ "create", StatementType_Create }, { "drop", StatementType_Drop } };
+		for(auto& keyword : keywords)
+		{
+			size_t new_pos=strlower(sql).find(keyword.first);
+			if(new_pos!=std::string::npos && (op_pos==std::string::npos || new_pos<op_pos))
+			{
+				stmt_type=keyword.second;
+				op_pos=new_pos;
+			}
+		}
 	}
 
 	std::string return_vals=input.annotations["return"];
 
 	std::vector<ReturnType> return_types=parseReturnTypes(return_vals);
 
+	std::vector<ReturnType> params;
+	std::string parsedSql=parseSqlString(sql, params);
+
+	//Only checked statements are routed to readers. Unchecked ones might use
+	//objects that are only on the writer connection
+	bool read_only=false;
+
+	//Result columns of the prepared statement. Used instead of parsing the SQL text
+	std::vector<ResultColumn> result_columns;
+	bool described=false;
+	if(check)
+	{
+		described=describeStatement(db, parsedSql, result_columns, read_only);
+		if(described && !checkReturnTypes(return_types, result_columns, parsedSql, config, func))
+			return AnnotatedCode(input.annotations, "");
+	}
+
+	for(const ReturnType& rtype : return_types)
+	{
+		if(rtype.type.empty())
+		{
+			*config.out << "ERROR Type of '" << rtype.name << "' is missing. It is only inferred if the statement is checked. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+	}
+
 	bool use_struct=false;
 	bool use_cond=false;
 	bool use_exists=false;
@@ -724,7 +1277,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 			generateStructure(struct_name, return_types, config, gen_data, false);
 		}
 	}
-	else if(strlower(return_type)!="void" && strlower(return_type)!="bool")
+	else if(!return_blob_stream && strlower(return_type)!="void" && strlower(return_type)!="bool")
 	{
 		if(return_types.size()==1)
 		{
@@ -740,6 +1293,8 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 			else
 			{
 				struct_name=generateConditional(return_types[0], config, gen_data);
+				use_cond=true;
+				use_exists=true;
 			}			
 		}
 		else
@@ -749,26 +1304,139 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		}
 	}
 
-	std::vector<ReturnType> params;
-	std::string parsedSql=parseSqlString(sql, params);
+	bool use_cache=false;
+	size_t cache_size=1000;
+	int64_t cache_ttl_ms=0;
+	std::set<std::string> cache_tables;
+	auto cache_it=input.annotations.find("cache");
+	if(cache_it!=input.annotations.end())
+	{
+		if(!parseCacheAnnotation(cache_it->second, cache_size, cache_ttl_ms))
+		{
+			*config.out << "ERROR invalid @cache \"" << cache_it->second << "\". Expected size=N ttl=T. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		if(stmt_type!=StatementType_Select || strlower(return_type)=="void" || strlower(return_type)=="bool")
+		{
+			*config.out << "ERROR @cache is only supported for functions returning the result of a SELECT. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		for(size_t i=0;i<params.size();++i)
+		{
+			if(isArrayType(params[i].type))
+			{
+				*config.out << "ERROR @cache is not supported with array parameters. Function: " << func << std::endl;
+				return AnnotatedCode(input.annotations, "");
+			}
+		}
+		if(config.shared_threads)
+		{
+			//ResultCache is not thread-safe
+			*config.out << "ERROR @cache is not supported with @threads shared. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		use_cache=true;
+	}
+
+	//Routes the function to the shard of this parameter (sqlgen::ShardedDatabase shards member)
+	std::string shard_key;
+	auto shard_it=input.annotations.find("shard_key");
+	if(shard_it!=input.annotations.end())
+	{
+		shard_key=trim(shard_it->second);
+		bool found=false;
+		for(size_t i=0;i<params.size();++i)
+		{
+			if(params[i].name==shard_key)
+			{
+				found=true;
+				if(params[i].type!="int" && params[i].type!="int64" && params[i].type!="string")
+				{
+					*config.out << "ERROR @shard_key parameter '" << shard_key << "' has to be int, int64 or string. Function: " << func << std::endl;
+					return AnnotatedCode(input.annotations, "");
+				}
+			}
+		}
+		if(!found)
+		{
+			*config.out << "ERROR @shard_key '" << shard_key << "' is not a parameter of the statement. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		if(use_cache)
+		{
+			*config.out << "ERROR @cache is not supported with @shard_key. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+	}
+
+	std::string blob_db="main";
+	std::string blob_table;
+	std::string blob_column;
+	bool blob_writable=false;
+	if(return_blob_stream)
+	{
+		if(!parseBlobStreamAnnotation(input.annotations["blob_stream"], blob_db, blob_table, blob_column, blob_writable))
+		{
+			*config.out << "ERROR blob_stream return needs @blob_stream [db.]table.column [write]. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		if(stmt_type!=StatementType_Select || return_types.size()!=1 || use_cache)
+		{
+			*config.out << "ERROR blob_stream functions have to select one rowid and cannot use @cache. Function: " << func << std::endl;
+			return AnnotatedCode(input.annotations, "");
+		}
+		if(check)
+		{
+			auto q=db.prepare("SELECT name FROM pragma_table_info(?, ?) WHERE name=?");
+			q.bind(blob_table);
+			q.bind(blob_db);
+			q.bind(blob_column);
+			if(q.read().empty())
+			{
+				*config.out << "ERROR Cannot find blob_stream column " << blob_db << "." << blob_table << "." << blob_column << ". Function: " << func << std::endl;
+				return AnnotatedCode(input.annotations, "");
+			}
+		}
+	}
 
 	if (check)
 	{
+		//Collects the tables the statement reads, so the cache is only invalidated by changes to them
+		ReadTables read_tables;
+		sqlite3_set_authorizer(db.getDatabase(), readTablesAuthorizer, &read_tables);
+		db_results ops;
 		try
 		{
 			auto q = db.prepare("EXPLAIN "+parsedSql);
-			q.read();
+			ops = q.read();
 		}
 		catch(sqlgen::PrepareError& e)
 		{
-			std::cout << "ERROR preparing statement: " << parsedSql << " Function: " << func << ": " << e.what() << std::endl;
+			sqlite3_set_authorizer(db.getDatabase(), nullptr, nullptr);
+			*config.out << "ERROR preparing statement: " << parsedSql << " Function: " << func << ": " << e.what() << std::endl;
 			return AnnotatedCode(input.annotations, "");
-		}		
+		}
+		sqlite3_set_authorizer(db.getDatabase(), nullptr, nullptr);
+		if(use_cache)
+		{
+			cache_tables=read_tables.tables;
+			addOpenedTables(db, ops, cache_tables);
+		}
+
+		if(read_only && usesConnectionObjects(db, parsedSql, ops, read_tables.names))
+			read_only=false;
 	}
 
 	std::map<std::string, size_t> return_cols;
 
-	if (stmt_type == StatementType_Select ||
+	if (described)
+	{
+		for (size_t i = 0; i < result_columns.size(); ++i)
+		{
+			return_cols[result_columns[i].name] = i;
+		}
+	}
+	else if (stmt_type == StatementType_Select ||
 		stmt_type == StatementType_Delete ||
 		stmt_type == StatementType_Insert ||
 		stmt_type == StatementType_Update)
@@ -817,7 +1485,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 					if (std::find(return_exp_vars.begin(), return_exp_vars.end(), return_types[i].name)
 						== return_exp_vars.end())
 					{
-						std::cout << "ERROR Cannot find variable '" << return_types[i].name << "' in SQL: " << parsedSql << " Function: " << func << std::endl;
+						*config.out << "ERROR Cannot find variable '" << return_types[i].name << "' in SQL: " << parsedSql << " Function: " << func << std::endl;
 						return AnnotatedCode(input.annotations, "");
 					}
 				}
@@ -837,7 +1505,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		{
 			if(return_types.empty())
 			{
-				std::cout << "@return is missing!" << std::endl;
+				*config.out << "@return is missing!" << std::endl;
 			}
 			else
 			{
@@ -867,7 +1535,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		return_type=struct_name;
 	}
 	else if(struct_name!="string" && struct_name!="void" && struct_name!="int"
-		&& struct_name!="bool" && struct_name!="int64" && struct_name!="int64_t")
+		&& struct_name!="bool" && struct_name!="int64" && struct_name!="int64_t" && struct_name!="double")
 	{
 		return_outer=(classname.empty()?"":classname+"::")+struct_name;
 		return_type=struct_name;
@@ -886,6 +1554,12 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 	if(return_type=="int64")
 		return_type = "int64_t";
 
+	if(return_blob_stream)
+	{
+		return_outer="sqlgen::DatabaseBlob";
+		return_type="sqlgen::DatabaseBlob";
+	}
+
 	if (return_optional)
 	{
 		return_outer = "std::optional<" + return_type + ">";
@@ -894,6 +1568,8 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 
 	std::string funcdecl=return_type+" "+func_s_name+"(";
 	std::string code=nl+return_outer+" "+funcsig+"(";
+	std::string cache_key_types;
+	std::string cache_key_args;
 	for(size_t i=0;i<params.size();++i)
 	{
 		bool found=false;
@@ -916,7 +1592,16 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 			funcdecl+=", ";
 		}
 		std::string type=params[i].type;
-		if(type=="string" || type=="std::string" )
+		if(isArrayType(type))
+		{
+			std::string elem_type=type.substr(0, type.size()-2);
+			if(elem_type=="string" || elem_type=="blob")
+				elem_type="std::string";
+			else if(elem_type=="int64")
+				elem_type="int64_t";
+			type="const std::vector<"+elem_type+">&";
+		}
+		else if(type=="string" || type=="std::string" )
 		{
 			type="const std::string&";
 		}
@@ -924,41 +1609,113 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		{
 			type="const std::string&";
 		}
-		else if(type=="int64")
+		else if(type=="int64" || type=="blob_stream")
 		{
 			type="int64_t";
 		}
 		code+=type+" "+params[i].name;
 		funcdecl+=type+" "+params[i].name;
+
+		if(use_cache)
+		{
+			if(!cache_key_types.empty())
+			{
+				cache_key_types+=", ";
+				cache_key_args+=", ";
+			}
+			cache_key_types+=(type=="const std::string&") ? "std::string" : type;
+			cache_key_args+=params[i].name;
+		}
 	}
 	code+=")" + nl +"{" + nl;
 	funcdecl+=");";
+	size_t body_start=code.size();
 
 	gen_data.funcdecls+=t + funcdecl+ nl;
-	gen_data.variables+="\tsqlgen::DatabaseQuery "+query_name+";\r\n";
 
-	code+="\tif(!"+query_name+".prepared())\r\n\t{\r\n\t";
-	code+="\t"+query_name+"=db.prepare(\""+parsedSql+"\");\r\n";
-	code+=t + "}" + nl;
+	//Read-only statements run on a reader connection if there are any
+	std::string stmt_name=query_name;
+	std::string routed_type=config.shared_threads ? "sqlgen::ThreadQuery" : "sqlgen::RoutedQuery";
+	if(!shard_key.empty())
+	{
+		//db is the shard in the function body
+		stmt_name="query";
+		gen_data.variables+="\tsqlgen::ShardedQuery<"+routed_type+"> "+query_name+"{shards.getShardCount()};\r\n";
+		gen_data.prepare_all+=t + t + query_name+(read_only ? ".prepareAll" : ".prepareWriter")+"(shards, \""+parsedSql+"\", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);" + nl;
+
+		code+=t + "size_t shard=shards.getShardIndex("+shard_key+");" + nl;
+		code+=t + "sqlgen::Database& db=shards.getShard(shard);" + nl;
+		if(read_only)
+		{
+			code+=t + "sqlgen::ReadConnection conn=db.acquireReader();" + nl;
+			code+=t + "sqlgen::DatabaseQuery& query="+query_name+".get(shard, conn, \""+parsedSql+"\");" + nl;
+		}
+		else
+		{
+			code+=t + "sqlgen::DatabaseQuery& query="+query_name+".get(shard, db, \""+parsedSql+"\");" + nl;
+		}
+	}
+	else if(read_only)
+	{
+		stmt_name="query";
+		gen_data.variables+="\t"+routed_type+" "+query_name+";\r\n";
+		gen_data.prepare_all+=t + t + query_name+".prepareAll(db, \""+parsedSql+"\", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);" + nl;
+
+		code+=t + "sqlgen::ReadConnection conn=db.acquireReader();" + nl;
+		code+=t + "sqlgen::DatabaseQuery& query="+query_name+".get(conn, \""+parsedSql+"\");" + nl;
+	}
+	else if(config.shared_threads)
+	{
+		stmt_name="query";
+		gen_data.variables+="\tsqlgen::ThreadQuery "+query_name+";\r\n";
+		gen_data.prepare_all+=t + t + query_name+".prepareWriter(db, \""+parsedSql+"\", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);" + nl;
+
+		code+=t + "sqlgen::DatabaseQuery& query="+query_name+".get(db, \""+parsedSql+"\");" + nl;
+	}
+	else
+	{
+		gen_data.variables+="\tsqlgen::DatabaseQuery "+query_name+";\r\n";
+		gen_data.prepare_all+=t + t + "if(!"+query_name+".prepared())" + nl;
+		gen_data.prepare_all+=t + t + t + query_name+"=db.prepare(\""+parsedSql+"\", sqlgen::PrepareFlag_Persistent | sqlgen::PrepareFlag_Optional);" + nl;
+
+		code+="\tif(!"+query_name+".prepared())\r\n\t{\r\n\t";
+		code+="\t"+query_name+"=db.prepare(\""+parsedSql+"\");\r\n";
+		code+=t + "}" + nl;
+	}
 
 	for(size_t i=0;i<params.size();++i)
 	{
 		if(params[i].type=="blob")
 		{
-			code+="\t"+query_name+".bind("+params[i].name+".data(), "+params[i].name+".size());\r\n";
+			code+="\t"+stmt_name+".bind("+params[i].name+".data(), "+params[i].name+".size());\r\n";
+		}
+		else if(params[i].type=="blob_stream")
+		{
+			code+="\t"+stmt_name+".bindZeroBlob("+params[i].name+");\r\n";
+		}
+		else if(params[i].type=="blob[]")
+		{
+			code+="\t"+stmt_name+".bindBlobArray("+params[i].name+".data(), "+params[i].name+".size());\r\n";
+		}
+		else if(isArrayType(params[i].type))
+		{
+			code+="\t"+stmt_name+".bindArray("+params[i].name+".data(), "+params[i].name+".size());\r\n";
 		}
 		else
 		{
-			code+="\t"+query_name+".bind("+params[i].name+");\r\n";
+			code+="\t"+stmt_name+".bind("+params[i].name+");\r\n";
 		}
 	}
 
 	bool has_return=false;
 	bool need_return = true;
+	//Single row reads have to be reset, otherwise the statement keeps its read transaction open
+	bool need_reset = !params.empty()
+		|| (!return_vector && (stmt_type==StatementType_Select || !return_types.empty()));
 
 	if(stmt_type==StatementType_Select || !return_types.empty())
 	{
-		code+=t + "auto& cursor="+query_name+".cursor();" + nl;
+		code+=t + "auto& cursor="+stmt_name+".cursor();" + nl;
 	}
 	else if(stmt_type==StatementType_Delete
 		|| stmt_type==StatementType_Insert
@@ -968,12 +1725,12 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 	{
 		if(return_type=="bool")
 		{
-			code+="\tbool ret = "+query_name+".write();\r\n";
+			code+="\tbool ret = "+stmt_name+".write();\r\n";
 			has_return=true;
 		}
 		else
 		{
-			code+="\t"+query_name+".write();\r\n";
+			code+="\t"+stmt_name+".write();\r\n";
 			need_return=false;
 		}
 	}
@@ -1015,7 +1772,7 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 			}
 			else
 			{
-				std::cout << "@return is missing!" << std::endl;
+				*config.out << "@return is missing!" << std::endl;
 				//TODO error handling
 			}
 		}
@@ -1050,6 +1807,21 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		}
 		code+=t + "}" + nl;		
 	}
+	else if(return_blob_stream)
+	{
+		code+=t + "if(!cursor.next())" + nl;
+		code+=t + "{" + nl;
+		code+=t + t + stmt_name + ".reset();" + nl;
+		code+=t + t + "return {};" + nl;
+		code+=t + "}" + nl;
+		code+=t + "int64_t blob_rowid;" + nl;
+		code+=t + "cursor.get("+getReturnCol(return_types[0].name, return_cols)+", blob_rowid);" + nl;
+		code+=t + stmt_name + ".reset();" + nl;
+		code+=t + "return sqlgen::DatabaseBlob(db, \""+blob_table+"\", \""+blob_column+"\", blob_rowid, "
+			+(blob_writable ? "true" : "false")+", \""+blob_db+"\");" + nl;
+		need_reset=false;
+		need_return=false;
+	}
 	else if(!return_types.empty() && !use_raw)
 	{
 		code+=t + struct_name+" ret = { ";
@@ -1058,7 +1830,8 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 			code+="false, ";
 			for(size_t i=0;i<return_types.size();++i)
 			{
-				if(return_types[i].type=="int" || return_types[i].type=="int64" || return_types[i].type=="int64_t")
+				if(return_types[i].type=="int" || return_types[i].type=="int64" || return_types[i].type=="int64_t"
+					|| return_types[i].type=="double")
 				{
 					code+="0";
 				}
@@ -1079,7 +1852,8 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		else
 		{
 			code+="false, ";
-			if(return_types[0].type=="int" || return_types[0].type=="int64" || return_types[0].type=="int64_t")
+			if(return_types[0].type=="int" || return_types[0].type=="int64" || return_types[0].type=="int64_t"
+				|| return_types[0].type=="double")
 			{
 				code+="0";
 			}
@@ -1125,9 +1899,9 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		{
 			code += t + "if(!cursor.next())" + nl;
 			code += t + "{" + nl;
-			if (!params.empty())
+			if (need_reset)
 			{
-				code += t + t + query_name + ".reset();" + nl;
+				code += t + t + stmt_name + ".reset();" + nl;
 			}
 			code += t + t + "return {};" + nl;
 			code += t + "}" + nl;
@@ -1141,6 +1915,10 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		{
 			code += t + "int64_t ret;" + nl;
 		}
+		else if(return_types[0].type=="double")
+		{
+			code += t + "double ret;" + nl;
+		}
 		else
 		{
 			code += t + "std::string ret;" + nl;
@@ -1148,9 +1926,9 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 		code += t + "cursor.get("+getReturnCol(return_types[0].name,
 			return_cols) +", ret);" + nl;
 	}
-	if (!params.empty())
+	if (need_reset)
 	{
-		code += t + query_name + ".reset();" + nl;
+		code += t + stmt_name + ".reset();" + nl;
 	}
 	/*if (return_optional)
 	{
@@ -1159,10 +1937,320 @@ AnnotatedCode generateSqlFunction(Database& db, AnnotatedCode input, const GenCo
 	}*/
 	if(need_return)
 		code += t + "return ret;" + nl;
+
+	if(use_cache)
+	{
+		std::string cache_name=query_name+"Cache";
+		std::string tables;
+		for(const std::string& table : cache_tables)
+		{
+			tables+=(tables.empty() ? "\"" : ", \"")+table+"\"";
+		}
+		gen_data.variables+="\tsqlgen::ResultCache<std::tuple<"+cache_key_types+">, "+return_type+"> "+cache_name
+			+"{db, "+std::to_string(cache_size)+", std::chrono::milliseconds("+std::to_string(cache_ttl_ms)+"), {"+tables+"}};\r\n";
+
+		std::string body=greplace(nl, nl+t, code.substr(body_start));
+		code=code.substr(0, body_start);
+		code+=t + "return "+cache_name+".getOrLoad(std::make_tuple("+cache_key_args+"), [&]() -> "+return_type + nl;
+		code+=t + "{" + nl;
+		code+=t + body.substr(0, body.size()-t.size());
+		code+=t + "});" + nl;
+	}
 	code+="}";
 	return AnnotatedCode(input.annotations, code);
 }
 
+//Bump if generated code changes, so cached functions are regenerated
+const int c_gen_cache_version = 9;
+
+/**
+* Result of generating one function. Structures are only reused if the
+* structures the function looked at are in the same state as when it was
+* generated (generateStructure() output depends on earlier functions).
+*/
+struct GenCacheEntry
+{
+	std::string code;
+	std::string funcdecls;
+	std::string variables;
+	std::string prepare_all;
+	std::map<std::string, int> struct_preconditions;
+	std::map<std::string, SStructure> structures;
+	//Printed again when the entry is used
+	std::string warnings;
+};
+
+struct GenCache
+{
+	std::string schema_fingerprint;
+	std::map<std::string, GenCacheEntry> entries;
+	std::map<std::string, GenCacheEntry> used;
+};
+
+uint64_t fnv1a(const std::string& data, uint64_t hash = 14695981039346656037ULL)
+{
+	for (unsigned char ch : data)
+	{
+		hash ^= ch;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::string hashHex(const std::string& data)
+{
+	//Two FNV-1a 64 hashes with different offset bases
+	char buf[33];
+	snprintf(buf, sizeof(buf), "%016llx%016llx",
+		static_cast<unsigned long long>(fnv1a(data)),
+		static_cast<unsigned long long>(fnv1a(data, 0x84222325cbf29ce4ULL)));
+	return buf;
+}
+
+std::string getSchemaFingerprint(Database& db)
+{
+	std::string schema;
+	db_results dbs = db.read("PRAGMA database_list");
+	for (auto& it : dbs)
+	{
+		const std::string& name = it["name"];
+		schema += name + "\n";
+		schema += db.read("PRAGMA \"" + name + "\".schema_version")[0]["schema_version"] + "\n";
+		db_results res = db.read("SELECT type, name, tbl_name, sql FROM \"" + name + "\".sqlite_master ORDER BY type, name");
+		for (auto& row : res)
+		{
+			schema += row["type"] + "\n" + row["name"] + "\n" + row["tbl_name"] + "\n" + row["sql"] + "\n";
+		}
+	}
+	return hashHex(schema);
+}
+
+std::string genCacheKey(const GenCache& cache, const AnnotatedCode& input, const GenConfig& config, bool check)
+{
+	std::string key_data = std::to_string(SQLGEN_VERSION_MAJOR) + "." + std::to_string(SQLGEN_VERSION_MINOR)
+		+ "." + std::to_string(c_gen_cache_version) + "\n";
+	key_data += cache.schema_fingerprint + "\n";
+	key_data += (check ? "check\n" : "nocheck\n");
+	key_data += config.tab + "\n" + config.newline + "\n";
+	if (config.shared_threads)
+		key_data += "threads:shared\n";
+	for (auto& it : input.annotations)
+	{
+		key_data += std::to_string(it.first.size()) + ":" + it.first + "=" + std::to_string(it.second.size()) + ":" + it.second + "\n";
+	}
+	return hashHex(key_data);
+}
+
+int getStructState(const GeneratedData& gen_data, const std::string& name)
+{
+	auto it = gen_data.structures.find(name);
+	if (it == gen_data.structures.end())
+		return -1;
+	return it->second.use_exist ? 1 : 0;
+}
+
+void writeCacheField(std::string& out, const std::string& field)
+{
+	out += std::to_string(field.size()) + "\n" + field + "\n";
+}
+
+bool readCacheField(const std::string& data, size_t& pos, std::string& field)
+{
+	size_t nl = data.find('\n', pos);
+	if (nl == std::string::npos)
+		return false;
+	size_t len = static_cast<size_t>(strtoull(data.c_str() + pos, nullptr, 10));
+	if (nl + 1 + len + 1 > data.size())
+		return false;
+	field = data.substr(nl + 1, len);
+	pos = nl + 1 + len + 1;
+	return true;
+}
+
+bool readCacheInt(const std::string& data, size_t& pos, int& val)
+{
+	std::string field;
+	if (!readCacheField(data, pos, field))
+		return false;
+	val = atoi(field.c_str());
+	return true;
+}
+
+const char* c_gen_cache_magic = "sqlgen-cache-3";
+
+void loadGenCache(const std::string& fn, GenCache& cache)
+{
+	std::ifstream in(fn, std::ios::binary);
+	if (!in)
+		return;
+	std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	size_t pos = 0;
+	std::string field;
+	if (!readCacheField(data, pos, field) || field != c_gen_cache_magic)
+		return;
+
+	while (pos < data.size())
+	{
+		std::string key;
+		GenCacheEntry entry;
+		int n;
+		if (!readCacheField(data, pos, key)
+			|| !readCacheField(data, pos, entry.code)
+			|| !readCacheField(data, pos, entry.funcdecls)
+			|| !readCacheField(data, pos, entry.variables)
+			|| !readCacheField(data, pos, entry.prepare_all)
+			|| !readCacheField(data, pos, entry.warnings)
+			|| !readCacheInt(data, pos, n))
+			return;
+
+		for (int i = 0; i < n; ++i)
+		{
+			std::string name;
+			int state;
+			if (!readCacheField(data, pos, name)
+				|| !readCacheInt(data, pos, state))
+				return;
+			entry.struct_preconditions[name] = state;
+		}
+
+		if (!readCacheInt(data, pos, n))
+			return;
+
+		for (int i = 0; i < n; ++i)
+		{
+			std::string name;
+			int use_exist;
+			SStructure s;
+			if (!readCacheField(data, pos, name)
+				|| !readCacheInt(data, pos, use_exist)
+				|| !readCacheField(data, pos, s.code))
+				return;
+			s.use_exist = use_exist != 0;
+			entry.structures[name] = s;
+		}
+
+		cache.entries[key] = entry;
+	}
+}
+
+void saveGenCache(const std::string& fn, const GenCache& cache)
+{
+	std::string out;
+	writeCacheField(out, c_gen_cache_magic);
+	for (auto& it : cache.used)
+	{
+		const GenCacheEntry& entry = it.second;
+		writeCacheField(out, it.first);
+		writeCacheField(out, entry.code);
+		writeCacheField(out, entry.funcdecls);
+		writeCacheField(out, entry.variables);
+		writeCacheField(out, entry.prepare_all);
+		writeCacheField(out, entry.warnings);
+		writeCacheField(out, std::to_string(entry.struct_preconditions.size()));
+		for (auto& pre : entry.struct_preconditions)
+		{
+			writeCacheField(out, pre.first);
+			writeCacheField(out, std::to_string(pre.second));
+		}
+		writeCacheField(out, std::to_string(entry.structures.size()));
+		for (auto& s : entry.structures)
+		{
+			writeCacheField(out, s.first);
+			writeCacheField(out, s.second.use_exist ? "1" : "0");
+			writeCacheField(out, s.second.code);
+		}
+	}
+	writestring(out, fn);
+}
+
+AnnotatedCode generateSqlFunctionCached(Database& db, AnnotatedCode input, const GenConfig& config, GeneratedData& gen_data, bool check, GenCache* cache)
+{
+	if (cache == nullptr)
+	{
+		return generateSqlFunction(db, input, config, gen_data, check);
+	}
+
+	std::string key = genCacheKey(*cache, input, config, check);
+
+	auto it = cache->entries.find(key);
+	if (it != cache->entries.end())
+	{
+		const GenCacheEntry& entry = it->second;
+		bool preconditions_ok = true;
+		for (auto& pre : entry.struct_preconditions)
+		{
+			if (getStructState(gen_data, pre.first) != pre.second)
+			{
+				preconditions_ok = false;
+				break;
+			}
+		}
+
+		if (preconditions_ok)
+		{
+			*config.out << "Cached func " << getafter(" ", input.annotations["func"]) << std::endl;
+			*config.out << entry.warnings;
+			gen_data.funcdecls += entry.funcdecls;
+			gen_data.variables += entry.variables;
+			gen_data.prepare_all += entry.prepare_all;
+			for (auto& s : entry.structures)
+			{
+				gen_data.structures[s.first] = s.second;
+			}
+			cache->used[key] = entry;
+			return AnnotatedCode(input.annotations, entry.code);
+		}
+	}
+
+	std::map<std::string, SStructure> prev_structures = gen_data.structures;
+	size_t funcdecls_size = gen_data.funcdecls.size();
+	size_t variables_size = gen_data.variables.size();
+	size_t prepare_all_size = gen_data.prepare_all.size();
+	gen_data.touched_structures.clear();
+
+	GenConfig capture_config = config;
+	std::ostringstream capture;
+	capture_config.out = &capture;
+	AnnotatedCode ret = generateSqlFunction(db, input, capture_config, gen_data, check);
+	*config.out << capture.str();
+
+	if (ret.code.empty())
+	{
+		return ret;
+	}
+
+	GenCacheEntry entry;
+	entry.code = ret.code;
+	std::istringstream lines(capture.str());
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		if (next(line, 0, "WARNING "))
+			entry.warnings += line + "\n";
+	}
+	entry.funcdecls = gen_data.funcdecls.substr(funcdecls_size);
+	entry.variables = gen_data.variables.substr(variables_size);
+	entry.prepare_all = gen_data.prepare_all.substr(prepare_all_size);
+	for (const std::string& name : gen_data.touched_structures)
+	{
+		auto prev_it = prev_structures.find(name);
+		entry.struct_preconditions[name] = prev_it == prev_structures.end() ? -1 : (prev_it->second.use_exist ? 1 : 0);
+
+		auto curr_it = gen_data.structures.find(name);
+		if (curr_it != gen_data.structures.end()
+			&& (prev_it == prev_structures.end()
+				|| prev_it->second.use_exist != curr_it->second.use_exist
+				|| prev_it->second.code != curr_it->second.code))
+		{
+			entry.structures[name] = curr_it->second;
+		}
+	}
+	cache->used[key] = entry;
+
+	return ret;
+}
+
 void setup1(Database& db, std::vector<AnnotatedCode>& annotated_code, GenConfig& config, const std::string& cppfile)
 {
 	for(size_t i=0;i<annotated_code.size();++i)
@@ -1211,12 +2299,16 @@ void setup1(Database& db, std::vector<AnnotatedCode>& annotated_code, GenConfig&
 				it = curr.annotations.find("cursor_type");
 				if (it != curr.annotations.end())
 					config.cursor_type = it->second;
+
+				it = curr.annotations.find("threads");
+				if (it != curr.annotations.end() && it->second == "shared")
+					config.shared_threads = true;
 			}
 		}
 	}
 }
 
-void generateCode1(Database& db, const GenConfig& config, std::vector<AnnotatedCode>& annotated_code, GeneratedData& generated_data)
+void generateCode1(Database& db, const GenConfig& config, std::vector<AnnotatedCode>& annotated_code, GeneratedData& generated_data, GenCache* cache)
 {
 	for(size_t i=0;i<annotated_code.size();++i)
 	{
@@ -1225,11 +2317,21 @@ void generateCode1(Database& db, const GenConfig& config, std::vector<AnnotatedC
 		{
 			if(curr.annotations.find("-SQLGenAccess")!=curr.annotations.end())
 			{
-				annotated_code[i]=generateSqlFunction(db, curr, config, generated_data, true);
+				PhaseTimer timer(config.stats!=nullptr ? &config.stats->generate_check_ms : nullptr);
+				annotated_code[i]=generateSqlFunctionCached(db, curr, config, generated_data, true, cache);
+				if(annotated_code[i].code.empty())
+					++generated_data.errors;
+				if(config.stats!=nullptr)
+					++config.stats->functions;
 			}
 			else if(curr.annotations.find("-SQLGenAccessNoCheck")!=curr.annotations.end())
 			{
-				annotated_code[i]=generateSqlFunction(db, curr, config, generated_data, false);
+				PhaseTimer timer(config.stats!=nullptr ? &config.stats->generate_nocheck_ms : nullptr);
+				annotated_code[i]=generateSqlFunctionCached(db, curr, config, generated_data, false, cache);
+				if(annotated_code[i].code.empty())
+					++generated_data.errors;
+				if(config.stats!=nullptr)
+					++config.stats->functions;
 			}
 		}
 	}
@@ -1263,10 +2365,18 @@ std::string replaceFunctionContent(std::string new_content, const std::string& d
 
 std::string getCode(const std::vector<AnnotatedCode>& annotated_code)
 {
+	size_t code_size=0;
+	for(const AnnotatedCode& curr : annotated_code)
+	{
+		code_size+=curr.source.size()+curr.code.size();
+	}
+
 	std::string code;
+	code.reserve(code_size);
 	for(size_t i=0;i<annotated_code.size();++i)
 	{
 		const AnnotatedCode& curr=annotated_code[i];
+		code+=curr.source;
 		code+=curr.code;
 	}
 	return code;
@@ -1297,15 +2407,34 @@ std::string getStructureCode(const GeneratedData& generated_data)
 	return code;
 }
 
-std::string placeData(const std::string& headerfile, const GenConfig& config, const GeneratedData generated_data)
+/**
+* Inline prepareAll() that prepares all statements up front. Statements
+* that cannot be prepared yet (e.g. table does not exist) are prepared
+* lazily on first use.
+*/
+std::string getPrepareAllCode(const GenConfig& config, const GeneratedData& generated_data)
+{
+	if(generated_data.prepare_all.empty())
+		return std::string();
+
+	const std::string& t=config.tab;
+	const std::string& nl=config.newline;
+	return t + "void prepareAll()" + nl
+		+ t + "{" + nl
+		+ generated_data.prepare_all
+		+ t + "}" + nl;
+}
+
+std::string placeData(const std::string& headerfile, const GenConfig& config, GeneratedData& generated_data)
 {
 	std::string t_headerfile=setbetween("//@-SQLGenFunctionsBegin", "//@-SQLGenFunctionsEnd", getStructureCode(generated_data)
 		+config.newline+config.newline
-		+generated_data.funcdecls+config.tab, headerfile, config);
+		+generated_data.funcdecls+getPrepareAllCode(config, generated_data)+config.tab, headerfile, config);
 
 	if(t_headerfile.empty())
 	{
-		std::cout << "ERROR: Cannot find \"//@-SQLGenFunctionsBegin\" or \"//@-SQLGenFunctionsEnd\" in Header-file" << std::endl;
+		*config.out << "ERROR: Cannot find \"//@-SQLGenFunctionsBegin\" or \"//@-SQLGenFunctionsEnd\" in Header-file" << std::endl;
+		++generated_data.errors;
 		return headerfile;
 	}
 
@@ -1313,23 +2442,62 @@ std::string placeData(const std::string& headerfile, const GenConfig& config, co
 
 	if(t_headerfile.empty())
 	{
-		std::cout << "ERROR: Cannot find \"//@-SQLGenVariablesBegin\" or \"//@-SQLGenVariablesEnd\" in Header-file" << std::endl;
+		*config.out << "ERROR: Cannot find \"//@-SQLGenVariablesBegin\" or \"//@-SQLGenVariablesEnd\" in Header-file" << std::endl;
+		++generated_data.errors;
 		return headerfile;
 	}
 
 	return t_headerfile;
 }
 
-void sqlgen_main(Database& db, std::string &cppfile, std::string &headerfile)
+bool sqlgen_main(Database& db, std::string &cppfile, std::string &headerfile, const std::string& cachefile, std::ostream& out, SqlGenStats* stats)
 {
-	std::vector<CPPToken> tokens=tokenizeFile(cppfile);
-	std::vector<AnnotatedCode> annotated_code=getAnnotatedCode(tokens);
+	std::vector<CPPToken> tokens;
+	{
+		PhaseTimer timer(stats!=nullptr ? &stats->tokenize_ms : nullptr);
+		tokens=tokenizeFile(cppfile);
+	}
+	std::vector<AnnotatedCode> annotated_code;
+	{
+		double parse_ms = 0;
+		double annotate_ms = 0;
+		{
+			PhaseTimer timer(&annotate_ms);
+			annotated_code=getAnnotatedCode(tokens, &parse_ms);
+		}
+		if(stats!=nullptr)
+		{
+			stats->parse_annotations_ms += parse_ms;
+			stats->annotate_ms += annotate_ms - parse_ms;
+		}
+	}
 	GeneratedData generated_data;
 	GenConfig config;
+	config.out = &out;
+	config.stats = stats;
 	setup1(db, annotated_code, config, cppfile);
-	generateCode1(db, config, annotated_code, generated_data);
+
+	std::unique_ptr<GenCache> cache;
+	if(!cachefile.empty())
+	{
+		cache = std::make_unique<GenCache>();
+		cache->schema_fingerprint = getSchemaFingerprint(db);
+		loadGenCache(cachefile, *cache);
+	}
+
+	generateCode1(db, config, annotated_code, generated_data, cache.get());
 	cppfile=getCode(annotated_code);
-	headerfile=placeData(headerfile, config, generated_data);
+	{
+		PhaseTimer timer(stats!=nullptr ? &stats->place_data_ms : nullptr);
+		headerfile=placeData(headerfile, config, generated_data);
+	}
+
+	if(cache)
+	{
+		saveGenCache(cachefile, *cache);
+	}
+
+	return generated_data.errors==0;
 }
 
 } //namespace sqlgen
@@ -1,9 +1,30 @@
 #pragma once
 #include <string>
+#include <iostream>
 
 namespace sqlgen
 {
 	class Database;
 
-	void sqlgen_main(Database& db, std::string& cppfile, std::string& headerfile);
+	//Time spent in each generator phase in milliseconds
+	struct SqlGenStats
+	{
+		double tokenize_ms = 0;
+		double annotate_ms = 0;
+		double parse_annotations_ms = 0;
+		double generate_check_ms = 0;
+		double generate_nocheck_ms = 0;
+		double place_data_ms = 0;
+		size_t functions = 0;
+	};
+
+	/**
+	* Generates the SQLGen functions in cppfile and their declarations in headerfile.
+	* If cachefile is set, functions whose annotations and schema did not change
+	* are taken from it instead of being generated again.
+	* Progress and errors are written to out. Returns false if there were errors.
+	* If stats is set, the time spent in each phase is added to it.
+	*/
+	bool sqlgen_main(Database& db, std::string& cppfile, std::string& headerfile, const std::string& cachefile = std::string(),
+		std::ostream& out = std::cout, SqlGenStats* stats = nullptr);
 }
\ No newline at end of file
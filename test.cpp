@@ -1,10 +1,919 @@
 #include "test.h"
 #include "Database.h"
+#include "DatabaseQuery.h"
+#include "DatabaseCache.h"
+#include "VectorTable.h"
+#include "ShardedDatabase.h"
+#include "ScatterGather.h"
+#include "sqlgen.h"
+#include "Importer.h"
+#include "Exporter.h"
+#include "DatabaseBlob.h"
 #include "sample/SampleGen.h"
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <cstdio>
+#include <filesystem>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <limits.h>
 
 using namespace sqlgen;
 
+namespace
+{
+    int failures = 0;
+
+    void check(bool cond, const std::string& what)
+    {
+        if(!cond)
+        {
+            std::cout << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    int64_t readInt(Database& db, const std::string& sql)
+    {
+        db_results res = db.read(sql);
+        if(res.empty() || res[0].empty())
+            return -1;
+        return std::stoll(res[0].begin()->second);
+    }
+
+    void testCarray()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT)");
+        db.write("INSERT INTO t VALUES (1, 'a'), (2, 'b'), (3, 'c'), (4, 'd')");
+
+        std::vector<int64_t> ids = { 1, 3, 5 };
+        DatabaseQuery q = db.prepare("SELECT COUNT(*) AS c FROM t WHERE id IN carray(?)");
+        q.bindArray(ids.data(), ids.size());
+        db_results res = q.read();
+        q.reset();
+        check(res.size() == 1 && res[0]["c"] == "2", "carray int64 IN");
+
+        std::vector<std::string> names = { "b", "d", "x" };
+        DatabaseQuery qn = db.prepare("SELECT group_concat(id) AS ids FROM (SELECT id FROM t WHERE name IN carray(?) ORDER BY id)");
+        qn.bindArray(names.data(), names.size());
+        res = qn.read();
+        qn.reset();
+        check(res.size() == 1 && res[0]["ids"] == "2,4", "carray text IN");
+
+        std::vector<int64_t> empty;
+        q.bindArray(empty.data(), empty.size());
+        res = q.read();
+        q.reset();
+        check(res.size() == 1 && res[0]["c"] == "0", "carray empty array");
+
+        bool thrown = false;
+        try
+        {
+            q.bindArray(ids.data(), static_cast<size_t>(INT_MAX) + 1);
+        }
+        catch(BindError&)
+        {
+            thrown = true;
+        }
+        q.reset();
+        check(thrown, "carray with more than INT_MAX elements throws");
+    }
+
+    struct VtRow
+    {
+        int64_t id;
+        std::string name;
+        int64_t size;
+    };
+
+    std::string queryPlan(Database& db, const std::string& sql)
+    {
+        std::string ret;
+        db_results res = db.read("EXPLAIN QUERY PLAN " + sql);
+        for (auto& row : res)
+            ret += row["detail"] + "\n";
+        return ret;
+    }
+
+    void testVectorTable()
+    {
+        Database db(":memory:");
+        std::vector<VtRow> rows;
+        for (int64_t i = 0; i < 100; ++i)
+            rows.push_back(VtRow{ i * 2, "n" + std::to_string(i % 10), i % 7 });
+
+        VectorTable<VtRow> vt(db, "vt");
+        vt.column("id", &VtRow::id, VectorTableKey_Sorted);
+        vt.column("name", &VtRow::name, VectorTableKey_Filter);
+        vt.column("size", &VtRow::size);
+        vt.setData(rows);
+
+        check(readInt(db, "SELECT COUNT(*) FROM vt") == 100, "vtab full scan");
+        check(readInt(db, "SELECT size FROM vt WHERE id=42") == 21 % 7, "vtab sorted eq");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE id=43") == 0, "vtab sorted eq miss");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE id>=10 AND id<20") == 5, "vtab sorted range");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE id>10 AND id<=20") == 5, "vtab sorted open range");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE name='n3'") == 10, "vtab filter eq");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE name='n3' AND id<100") == 5, "vtab filter and range");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE id=NULL") == 0, "vtab NULL constraint");
+        check(readInt(db, "SELECT COUNT(*) FROM vt WHERE size=3") == 14, "vtab non-key column");
+
+        //The table evaluates key column constraints itself (idxStr "col:op,"), non-key constraints are left to SQLite
+        check(queryPlan(db, "SELECT * FROM vt WHERE id=42").find("INDEX 0:0:2,") != std::string::npos, "vtab sorted eq pushed down");
+        check(queryPlan(db, "SELECT * FROM vt WHERE name='n3'").find("INDEX 0:1:2,") != std::string::npos, "vtab filter eq pushed down");
+        check(queryPlan(db, "SELECT * FROM vt WHERE size=3").find("INDEX 0:\n") != std::string::npos, "vtab non-key constraint not pushed down");
+
+        db.write("CREATE TABLE files(id INTEGER PRIMARY KEY, hash INTEGER)");
+        db.write("INSERT INTO files(hash) VALUES (4), (5), (6), (198)");
+        check(readInt(db, "SELECT COUNT(*) FROM files f JOIN vt ON f.hash=vt.id") == 3, "vtab join on sorted key");
+    }
+
+    void testResultCache()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE t(id INTEGER PRIMARY KEY, v INTEGER)");
+        db.write("CREATE TABLE other(id INTEGER PRIMARY KEY)");
+        db.write("CREATE TABLE w(k TEXT PRIMARY KEY, v INTEGER) WITHOUT ROWID");
+        db.write("INSERT INTO t VALUES (1, 10), (2, 20)");
+
+        ResultCache<int, int64_t> cache(db, 10, std::chrono::milliseconds(0), { "t" });
+        ResultCache<int, int64_t> wcache(db, 10, std::chrono::milliseconds(0), { "main.w" });
+        int loads = 0;
+        auto countT = [&]() {
+            return cache.getOrLoad(0, [&]() { ++loads; return readInt(db, "SELECT COUNT(*) FROM t"); });
+        };
+
+        check(countT() == 2 && countT() == 2 && loads == 1, "cache hit");
+
+        db.write("INSERT INTO other VALUES (1)");
+        check(countT() == 2 && loads == 1, "cache kept on change of other table");
+
+        db.write("INSERT INTO t VALUES (3, 30)");
+        check(countT() == 3 && loads == 2, "cache cleared on insert");
+
+        db.write("UPDATE t SET v=0 WHERE id=1");
+        countT();
+        check(loads == 3, "cache cleared on update");
+
+        //Truncate optimization, the update hook is not called
+        db.write("DELETE FROM t");
+        check(countT() == 0 && loads == 4, "cache cleared on DELETE without WHERE");
+
+        db.beginWriteTransaction();
+        db.write("INSERT INTO t VALUES (4, 40)");
+        check(countT() == 1, "cache sees own transaction");
+        db.rollbackTransaction();
+        check(countT() == 0, "cache cleared on rollback");
+
+        db.write("INSERT INTO w VALUES ('a', 1)");
+        int wloads = 0;
+        auto sumW = [&]() {
+            return wcache.getOrLoad(0, [&]() { ++wloads; return readInt(db, "SELECT SUM(v) FROM w"); });
+        };
+        check(sumW() == 1 && sumW() == 1 && wloads == 1, "WITHOUT ROWID cache hit");
+        db.write("UPDATE w SET v=5 WHERE k='a'");
+        check(sumW() == 5, "cache cleared on WITHOUT ROWID update");
+        db.write("INSERT INTO w VALUES ('b', 2)");
+        check(sumW() == 7, "cache cleared on WITHOUT ROWID insert");
+    }
+
+    void removeDatabase(const std::string& fn)
+    {
+        std::remove(fn.c_str());
+        std::remove((fn + "-wal").c_str());
+        std::remove((fn + "-shm").c_str());
+        std::remove((fn + "-journal").c_str());
+    }
+
+    void testReaderRouting()
+    {
+        const std::string fn = "test_readers.db";
+        removeDatabase(fn);
+        {
+            Database db(fn);
+            db.write("PRAGMA journal_mode=WAL");
+            db.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+            db.addReaders(1);
+
+            check(db.acquireReader().getSlot() != 0, "read outside transaction uses reader");
+
+            //Transaction started without beginWriteTransaction()
+            db.write("BEGIN");
+            db.write("INSERT INTO t VALUES (1)");
+            {
+                ReadConnection conn = db.acquireReader();
+                check(conn.getSlot() == 0, "read in raw BEGIN transaction stays on writer");
+                check(readInt(conn.database(), "SELECT COUNT(*) FROM t") == 1, "read in transaction sees own change");
+            }
+
+            size_t other_slot = 0;
+            int64_t other_count = -1;
+            std::thread other([&]() {
+                ReadConnection conn = db.acquireReader();
+                other_slot = conn.getSlot();
+                other_count = readInt(conn.database(), "SELECT COUNT(*) FROM t");
+            });
+            other.join();
+            check(other_slot != 0 && other_count == 0, "read of other thread uses reader");
+
+            db.write("COMMIT");
+            ReadConnection conn = db.acquireReader();
+            check(conn.getSlot() != 0 && readInt(conn.database(), "SELECT COUNT(*) FROM t") == 1, "read after commit uses reader");
+        }
+        removeDatabase(fn);
+    }
+
+    void testBulkLoadRestore()
+    {
+        const std::string fn = "test_bulkload.db";
+        removeDatabase(fn);
+        std::remove((fn + "-bulkload").c_str());
+        {
+            Database db(fn);
+            db.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+            db.write("INSERT INTO t VALUES (1)");
+
+            db.beginBulkLoad();
+            db.write("WITH RECURSIVE s(i) AS (SELECT 2 UNION ALL SELECT i+1 FROM s WHERE i<101) INSERT INTO t SELECT i FROM s");
+
+            bool thrown = false;
+            try
+            {
+                db.addReaders(1);
+            }
+            catch(BulkLoadError&)
+            {
+                thrown = true;
+            }
+            check(thrown, "addReaders() during bulk load throws");
+
+            //Must not swap back the copy of the running load
+            {
+                Database other(fn);
+            }
+            check(std::filesystem::exists(fn + "-bulkload") && readInt(db, "SELECT COUNT(*) FROM t") == 101,
+                "open during bulk load does not restore");
+
+            //Closed without endBulkLoad(), like a crashed process
+        }
+        {
+            Database db(fn);
+            check(readInt(db, "SELECT COUNT(*) FROM t") == 1, "unfinished bulk load is restored");
+            check(!std::filesystem::exists(fn + "-bulkload"), "copy removed after restore");
+
+            db.beginBulkLoad();
+            db.write("INSERT INTO t VALUES (2)");
+            db.endBulkLoad();
+        }
+        {
+            Database db(fn);
+            check(readInt(db, "SELECT COUNT(*) FROM t") == 2 && !std::filesystem::exists(fn + "-bulkload"),
+                "finished bulk load is kept");
+        }
+        removeDatabase(fn);
+        std::remove((fn + "-bulkload.lock").c_str());
+    }
+
+    void testSavepoints()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+        int rollbacks = 0;
+        size_t listener = db.addChangeListener([&](const char* db_name, const char* table) {
+            if (table == nullptr)
+                ++rollbacks;
+        });
+
+        db.beginWriteTransaction();
+        db.write("INSERT INTO t VALUES (1)");
+        {
+            ScopedManualCommitWriteTransaction inner(&db);
+            check(db.getTransactionDepth() == 2, "nested transaction depth");
+            db.write("INSERT INTO t VALUES (2)");
+            {
+                ScopedAutoCommitWriteTransaction innermost(&db);
+                db.write("INSERT INTO t VALUES (3)");
+            }
+            check(readInt(db, "SELECT COUNT(*) FROM t") == 3, "released savepoint keeps changes");
+            //Not committed: rolls back to the savepoint
+        }
+        check(db.getTransactionDepth() == 1 && db.isInTransaction(), "outer transaction still open after inner rollback");
+        check(readInt(db, "SELECT COUNT(*) FROM t") == 1, "inner rollback undoes only the savepoint");
+        check(rollbacks == 1, "savepoint rollback notifies change listeners");
+
+        {
+            ScopedManualCommitWriteTransaction inner(&db);
+            db.write("INSERT INTO t VALUES (4)");
+            inner.commit();
+        }
+        db.endTransaction();
+        check(!db.isInTransaction() && readInt(db, "SELECT COUNT(*) FROM t") == 2, "outer commit keeps released savepoints");
+
+        db.beginWriteTransaction();
+        db.beginWriteTransaction();
+        db.write("INSERT INTO t VALUES (5)");
+        db.endTransaction();
+        db.rollbackTransaction();
+        check(!db.isInTransaction() && readInt(db, "SELECT COUNT(*) FROM t") == 2, "outer rollback undoes released savepoints");
+
+        db.removeChangeListener(listener);
+    }
+
+    void testBusyTimeout()
+    {
+        const std::string fn = "test_busy.db";
+        removeDatabase(fn);
+        {
+            Database holder(fn);
+            Database waiter(fn);
+            Database other(fn);
+            holder.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+            holder.beginWriteTransaction();
+
+            //Ending transactions wakes up the waiter early, which must not shorten its timeout
+            std::atomic<bool> stop(false);
+            std::thread waker([&]() {
+                while (!stop)
+                {
+                    other.beginReadTransaction();
+                    other.endTransaction();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+
+            auto start = std::chrono::steady_clock::now();
+            DatabaseQuery q = waiter.prepare("BEGIN IMMEDIATE");
+            bool ok = q.write(300);
+            auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            q.reset();
+            stop = true;
+            waker.join();
+            holder.endTransaction();
+
+            check(!ok && waited >= 290, "busy timeout counts time waited (" + std::to_string(waited) + "ms)");
+        }
+        removeDatabase(fn);
+    }
+
+    void testTransactRetry()
+    {
+        const std::string fn = "test_transact.db";
+        removeDatabase(fn);
+        {
+            Database db(fn);
+            db.write("PRAGMA journal_mode=WAL");
+            db.write("CREATE TABLE counter(id INTEGER PRIMARY KEY, v INTEGER)");
+            db.write("INSERT INTO counter VALUES (1, 0)");
+            Database other(fn);
+
+            int attempts = 0;
+            int64_t result = db.transact([&]() {
+                ++attempts;
+                int64_t v = readInt(db, "SELECT v FROM counter WHERE id=1");
+                if (attempts == 1)
+                {
+                    //Commit after the read snapshot was taken. Upgrading to a write transaction gets SQLITE_BUSY_SNAPSHOT
+                    other.write("UPDATE counter SET v=v+10 WHERE id=1");
+                }
+                db.write("UPDATE counter SET v=" + std::to_string(v + 1) + " WHERE id=1");
+                return v + 1;
+            });
+
+            TransactionStats stats = db.getTransactionStats();
+            check(attempts == 2, "transact() retries after BUSY_SNAPSHOT");
+            check(result == 11 && readInt(db, "SELECT v FROM counter WHERE id=1") == 11, "retried transaction sees the other commit");
+            check(stats.conflicts == 1 && stats.commits == 1 && stats.failures == 0, "transact() stats after retry");
+            check(!db.isInTransaction(), "transact() leaves no open transaction");
+        }
+        removeDatabase(fn);
+    }
+
+    template<typename F>
+    bool throwsShardError(F& fut)
+    {
+        try
+        {
+            fut.get();
+        }
+        catch(ShardError&)
+        {
+            return true;
+        }
+        catch(...)
+        {
+        }
+        return false;
+    }
+
+    void testShardWriter()
+    {
+        const std::string fn = "test_shard.db";
+        removeDatabase(fn);
+        {
+            ShardOptions options;
+            options.schema = "CREATE TABLE IF NOT EXISTS t(id INTEGER PRIMARY KEY)";
+            ShardedDatabase shards({ fn }, options);
+
+            //Holds the writer thread, so the next writes are committed in one batch
+            auto blockWriter = [&shards](std::promise<void>& gate) {
+                std::shared_future<void> gate_future = gate.get_future().share();
+                auto started = std::make_shared<std::promise<void> >();
+                std::future<void> started_future = started->get_future();
+                std::future<void> ret = shards.submitWrite(0, [gate_future, started](Database&) {
+                    started->set_value();
+                    gate_future.wait();
+                });
+                started_future.wait();
+                return ret;
+            };
+
+            std::promise<void> gate;
+            std::future<void> blocker = blockWriter(gate);
+            std::future<void> w1 = shards.submitWrite(0, [](Database& db) { db.write("INSERT INTO t VALUES (1)"); });
+            std::future<void> w2 = shards.submitWrite(0, [](Database& db) {
+                db.write("INSERT INTO t VALUES (2)");
+                throw std::runtime_error("write 2 failed");
+            });
+            std::future<void> w3 = shards.submitWrite(0, [](Database& db) { db.write("INSERT INTO t VALUES (3)"); });
+            gate.set_value();
+            shards.flush();
+
+            bool w2_thrown = false;
+            try
+            {
+                w2.get();
+            }
+            catch(std::runtime_error& e)
+            {
+                w2_thrown = std::string(e.what()) == "write 2 failed";
+            }
+            blocker.get();
+            w1.get();
+            w3.get();
+            check(w2_thrown, "failed shard write gets its exception");
+            check(shards.getShard(0).read("SELECT group_concat(id) AS ids FROM (SELECT id FROM t ORDER BY id)")[0]["ids"] == "1,3",
+                "failed shard write only rolls back itself");
+
+            //A write that leaves the transaction, as SQLite does after SQLITE_FULL or SQLITE_IOERR
+            std::promise<void> gate2;
+            std::future<void> blocker2 = blockWriter(gate2);
+            std::future<void> v1 = shards.submitWrite(0, [](Database& db) { db.write("INSERT INTO t VALUES (10)"); });
+            std::future<void> v2 = shards.submitWrite(0, [](Database& db) {
+                db.write("INSERT INTO t VALUES (11)");
+                db.write("ROLLBACK");
+            });
+            std::future<void> v3 = shards.submitWrite(0, [](Database& db) { db.write("INSERT INTO t VALUES (12)"); });
+            gate2.set_value();
+            shards.flush();
+
+            blocker2.get();
+            check(throwsShardError(v1) && throwsShardError(v2) && throwsShardError(v3), "writes of an aborted batch fail");
+            check(readInt(shards.getShard(0), "SELECT COUNT(*) FROM t WHERE id>=10") == 0, "aborted batch writes nothing");
+
+            ShardWriterStats stats = shards.getWriterStats(0);
+            check(stats.writes == 8 && stats.failed == 4 && stats.transactions == 3, "shard writer stats");
+        }
+        removeDatabase(fn);
+    }
+
+    //Runs the generator on cpp with a DAO class "Dao". Returns the generated cpp file, or an empty string on errors
+    std::string generate(Database& db, const std::string& cpp)
+    {
+        std::string cppfile = cpp;
+        std::string header = "class Dao\n{\npublic:\n\t//@-SQLGenFunctionsBegin\n\t//@-SQLGenFunctionsEnd\n"
+            "private:\n\t//@-SQLGenVariablesBegin\n\t//@-SQLGenVariablesEnd\n};\n";
+        std::ostringstream out;
+        if (!sqlgen_main(db, cppfile, header, std::string(), out))
+        {
+            std::cout << out.str();
+            return std::string();
+        }
+        return cppfile;
+    }
+
+    std::string sqlFunction(const std::string& func, const std::string& ret, const std::string& sql)
+    {
+        return "/**\n* @-SQLGenAccess\n* @func " + func + "\n* @return " + ret + "\n* @sql\n*      " + sql + "\n*/\n";
+    }
+
+    bool contains(const std::string& str, const std::string& part)
+    {
+        return str.find(part) != std::string::npos;
+    }
+
+    void testArrayParameters()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+
+        std::string code = generate(db,
+            sqlFunction("vector<Ids> Dao::inList", "int64 id", "SELECT id FROM t WHERE id IN (:ids(int64[]))")
+            + sqlFunction("vector<Ids> Dao::fromCarray", "int64 value", "SELECT value FROM carray(:ids(int64[]))")
+            + sqlFunction("vector<Ids> Dao::inSubquery", "int64 id", "SELECT id FROM t WHERE id IN (SELECT value FROM carray( :ids(int64[]) ))"));
+
+        check(contains(code, "\"SELECT id FROM t WHERE id IN carray(?)\""), "IN (array) becomes IN carray(?)");
+        check(contains(code, "\"SELECT value FROM carray(?)\""), "carray(array) keeps its parentheses");
+        check(contains(code, "\"SELECT id FROM t WHERE id IN (SELECT value FROM carray( ? ))\""), "array in carray() of a subquery");
+        check(contains(code, "const std::vector<int64_t>& ids"), "array parameter type");
+    }
+
+    void testGeneratedRouting()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+
+        std::string checked = generate(db, sqlFunction("int64_t Dao::countChecked", "int64 c", "SELECT COUNT(*) AS c FROM t"));
+        check(contains(checked, "acquireReader()"), "checked SELECT runs on reader");
+
+        std::string unchecked = "/**\n* @-SQLGenAccessNoCheck\n* @func int64_t Dao::countUnchecked\n* @return int64 c\n* @sql\n*      SELECT COUNT(*) AS c FROM t\n*/\n";
+        unchecked = generate(db, unchecked);
+        check(contains(unchecked, "Dao::countUnchecked("), "unchecked SELECT generated");
+        check(!contains(unchecked, "acquireReader()"), "unchecked SELECT stays on writer");
+
+        std::string write = generate(db, sqlFunction("void Dao::clear", "", "DELETE FROM t"));
+        check(contains(write, "Dao::clear(") && !contains(write, "acquireReader()"), "write stays on writer");
+    }
+
+    std::string readColumn(Database& db, const std::string& sql)
+    {
+        std::string ret;
+        db_results res = db.read(sql);
+        for (auto& row : res)
+            ret += row.begin()->second + "|";
+        return ret;
+    }
+
+    void testImporter()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE csv(id INTEGER, name TEXT)");
+
+        Importer importer(db);
+        ImportStats stats = importer.importData("id,name\r\n1,\"a,b\"\r\n2,\"say \"\"hi\"\"\"\r\n3,\"two\r\nlines\"\r\n4,plain\r\n", "csv");
+        check(stats.rows == 4, "CSV row count");
+        check(readColumn(db, "SELECT name FROM csv ORDER BY id") == "a,b|say \"hi\"|two\r\nlines|plain|", "CSV quoted fields with CRLF");
+
+        db.write("CREATE TABLE single(v TEXT)");
+        ImportOptions options;
+        options.empty_as_null = true;
+        Importer null_importer(db, options);
+        stats = null_importer.importData("v\na\n\n\"\"\nb", "single");
+        check(stats.rows == 4, "blank line is a row");
+        check(readInt(db, "SELECT COUNT(*) FROM single WHERE v IS NULL") == 1, "blank line is NULL");
+        check(readInt(db, "SELECT COUNT(*) FROM single WHERE v=''") == 1, "quoted empty field is not NULL");
+
+        bool field_error = false;
+        try
+        {
+            importer.importData("id,name\n5,x\n6\n", "csv");
+        }
+        catch (const ImportError&)
+        {
+            field_error = true;
+        }
+        check(field_error, "wrong field count throws");
+        check(readInt(db, "SELECT COUNT(*) FROM csv WHERE id>=5") == 0, "failed import is rolled back");
+
+        db.write("CREATE TABLE chunked(v INTEGER)");
+        options = ImportOptions();
+        options.chunk_rows = 3;
+        options.batch_rows = 1;
+        Importer chunk_importer(db, options);
+        bool chunk_error = false;
+        try
+        {
+            chunk_importer.importData("v\n1\n2\n3\n4\n5,6\n", "chunked");
+        }
+        catch (const ImportError&)
+        {
+            chunk_error = true;
+        }
+        check(chunk_error, "wrong field count in later chunk throws");
+        check(readInt(db, "SELECT COUNT(*) FROM chunked") == 3, "completed chunks stay committed");
+    }
+
+    void testExportImport()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE src(id INTEGER, name TEXT, score REAL)");
+        db.write("INSERT INTO src VALUES (1, 'tab\there', 1.5), (2, 'two\nlines', NULL), (3, 'say \"hi\"', -2),"
+            " (4, '', 0.25), (5, NULL, 3), (6, '\"quoted start', 4)");
+
+        for (ExportFormat format : { ExportFormat_Csv, ExportFormat_Tsv })
+        {
+            std::string name = format == ExportFormat_Csv ? "CSV" : "TSV";
+            ExportOptions export_options;
+            export_options.format = format;
+            export_options.buffer_size = 16;
+            std::stringstream out;
+            DatabaseQuery query = db.prepare("SELECT id, name, score FROM src ORDER BY id");
+            ExportStats export_stats = Exporter(export_options).exportQuery(query, out);
+            check(export_stats.rows == 6, name + " export row count");
+
+            db.write("DROP TABLE IF EXISTS dst");
+            db.write("CREATE TABLE dst(id INTEGER, name TEXT, score REAL)");
+            ImportOptions import_options = Importer::optionsForFile(format == ExportFormat_Csv ? "dst.csv" : "dst.tsv");
+            import_options.empty_as_null = true;
+            Importer(db, import_options).importData(out.str(), "dst");
+
+            check(readInt(db, "SELECT COUNT(*) FROM dst") == 6, name + " import row count");
+            check(readInt(db, "SELECT COUNT(*) FROM src s JOIN dst d ON s.id=d.id AND s.name IS d.name AND s.score IS d.score") == 6,
+                name + " round trip keeps values, empty strings and NULLs");
+        }
+
+        db.write("CREATE TABLE bin(id INTEGER, data)");
+        db.write("INSERT INTO bin VALUES (1, x'00ff10'), (2, 'text'), (3, 2.5), (4, NULL), (-5, 9000000000)");
+        ExportOptions binary_options;
+        binary_options.format = ExportFormat_Binary;
+        std::stringstream binary;
+        DatabaseQuery query = db.prepare("SELECT id, data FROM bin ORDER BY rowid");
+        Exporter(binary_options).exportQuery(query, binary);
+
+        BinaryRowReader reader(binary);
+        check(reader.columns().size() == 2 && reader.columns()[1] == "data", "binary column names");
+        std::vector<std::vector<BinaryValue> > rows;
+        std::vector<BinaryValue> row;
+        while (reader.next(row))
+            rows.push_back(row);
+        check(rows.size() == 5, "binary row count");
+        if (rows.size() == 5)
+        {
+            check(rows[0][0].type == ColumnType_Integer && rows[0][0].i == 1, "binary integer");
+            check(rows[0][1].type == ColumnType_Blob && rows[0][1].data == std::string("\x00\xff\x10", 3), "binary blob");
+            check(rows[1][1].type == ColumnType_Text && rows[1][1].data == "text", "binary text");
+            check(rows[2][1].type == ColumnType_Float && rows[2][1].d == 2.5, "binary float");
+            check(rows[3][1].type == ColumnType_Null, "binary NULL");
+            check(rows[4][0].i == -5 && rows[4][1].i == 9000000000LL, "binary 64 bit integers");
+        }
+
+        std::string truncated = binary.str();
+        truncated.resize(truncated.size() - 3);
+        std::stringstream truncated_in(truncated);
+        BinaryRowReader truncated_reader(truncated_in);
+        bool truncated_error = false;
+        try
+        {
+            while (truncated_reader.next(row)) {}
+        }
+        catch (const ExportError&)
+        {
+            truncated_error = true;
+        }
+        check(truncated_error, "truncated binary row throws");
+    }
+
+    void testBlob()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE files(id INTEGER PRIMARY KEY, data BLOB)");
+        DatabaseQuery insert = db.prepare("INSERT INTO files(id, data) VALUES (?, ?)");
+        insert.bind(int64_t(1));
+        insert.bindZeroBlob(100);
+        insert.write();
+        insert.reset();
+        insert.bind(int64_t(2));
+        insert.bind(std::string("second"));
+        insert.write();
+        insert.reset();
+
+        std::string data;
+        for (size_t i = 0; i < 100; ++i)
+            data += static_cast<char>(i * 7);
+
+        DatabaseBlob blob(db, "files", "data", 1, true);
+        check(blob.size() == 100, "blob has zeroblob size");
+        std::stringstream in(data + "past the end");
+        check(blob.writeFrom(in, 0, 7) == 100, "chunked blob write stops at blob size");
+
+        std::stringstream out;
+        check(blob.readTo(out, 13) == 100 && out.str() == data, "chunked blob read");
+        size_t chunks = 0;
+        blob.readChunks([&](const char*, size_t size) { if (size > 0) ++chunks; }, 30);
+        check(chunks == 4, "blob read in chunks");
+
+        bool zero_chunk_error = false;
+        try
+        {
+            blob.readChunks([](const char*, size_t) {}, 0);
+        }
+        catch (const BlobError&)
+        {
+            zero_chunk_error = true;
+        }
+        check(zero_chunk_error, "read with chunk size 0 throws");
+
+        zero_chunk_error = false;
+        try
+        {
+            std::stringstream zero_in(data);
+            blob.writeFrom(zero_in, 0, 0);
+        }
+        catch (const BlobError&)
+        {
+            zero_chunk_error = true;
+        }
+        check(zero_chunk_error, "write with chunk size 0 throws");
+
+        bool past_end_error = false;
+        try
+        {
+            blob.write("x", 1, 100);
+        }
+        catch (const BlobError&)
+        {
+            past_end_error = true;
+        }
+        check(past_end_error, "write past end throws");
+
+        blob.reopen(2);
+        std::string second(blob.size(), '\0');
+        check(blob.getRowid() == 2 && blob.read(&second[0], second.size()) == 6 && second == "second", "reopen on other row");
+
+        bool reopen_error = false;
+        try
+        {
+            blob.reopen(3);
+        }
+        catch (const BlobError&)
+        {
+            reopen_error = true;
+        }
+        check(reopen_error && !blob.isOpen(), "reopen on missing row throws and closes");
+
+        db_results res = db.read("SELECT data FROM files WHERE id=1");
+        check(!res.empty() && res[0]["data"] == data, "blob data committed");
+    }
+
+    std::string scatterColumn(const std::vector<ScatterRow>& rows, size_t col)
+    {
+        std::string ret;
+        for (const ScatterRow& row : rows)
+            ret += (row[col].type == ColumnType_Null ? std::string("NULL") : std::to_string(row[col].i)) + "|";
+        return ret;
+    }
+
+    void testScatterGather()
+    {
+        const std::string fn = "test_scatter.db";
+        const std::string fn_a = "test_scatter_a.db";
+        const std::string fn_b = "test_scatter_b.db";
+        removeDatabase(fn);
+        removeDatabase(fn_a);
+        removeDatabase(fn_b);
+        {
+            Database db(fn, { { fn_a, "a" }, { fn_b, "b" } });
+            db.write("CREATE TABLE a.t(k INTEGER, v INTEGER)");
+            db.write("CREATE TABLE b.t(k INTEGER, v INTEGER)");
+            db.write("WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i+1 FROM n WHERE i<99)"
+                " INSERT INTO a.t SELECT i%5, i*3 FROM n");
+            db.write("WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i+1 FROM n WHERE i<149)"
+                " INSERT INTO b.t SELECT i%7, i*2+1 FROM n");
+            db.write("INSERT INTO b.t VALUES (1, NULL)");
+
+            ScatterGather sg;
+            sg.addPart(db, "a");
+            sg.addPart(db, "b");
+
+            bool no_readers_error = false;
+            try
+            {
+                sg.read("SELECT v FROM {schema}.t");
+            }
+            catch (const ScatterError&)
+            {
+                no_readers_error = true;
+            }
+            check(no_readers_error, "several parts on a connection without readers throw");
+
+            db.addReaders(2);
+
+            std::string all = "SELECT k, v FROM (SELECT k, v FROM a.t UNION ALL SELECT k, v FROM b.t)";
+
+            ScatterOptions options;
+            options.order_by = { ScatterSortKey{ 1, true } };
+            options.buffer_rows = 1;
+            std::vector<ScatterRow> merged = sg.read("SELECT k, v FROM {schema}.t ORDER BY v DESC", options);
+            check(merged.size() == 251 && scatterColumn(merged, 1) == readColumn(db, "SELECT IFNULL(v, 'NULL') FROM (" + all + ") ORDER BY v DESC"),
+                "k-way merge of two schemas");
+            check(sg.getColumns().size() == 2 && sg.getColumns()[1] == "v", "scatter column names");
+
+            options.order_by = { ScatterSortKey{ 1, false } };
+            options.limit = 5;
+            std::atomic<int> binds{ 0 };
+            ScatterStats stats;
+            std::vector<ScatterRow> limited;
+            stats = sg.execute("SELECT k, v FROM {schema}.t WHERE v>? ORDER BY v", [&limited](const ScatterRow& row) {
+                limited.push_back(row);
+                return true;
+            }, options, [&binds](DatabaseQuery& query) {
+                ++binds;
+                query.bind(int64_t(10));
+            });
+            check(binds == 2, "bind called for every part");
+            check(scatterColumn(limited, 1) == readColumn(db, "SELECT v FROM (" + all + ") WHERE v>10 ORDER BY v LIMIT 5"), "merge with limit");
+            check(stats.rows == 5 && stats.rows_read <= 10, "limit pushed down to parts");
+
+            ScatterOptions agg_options;
+            agg_options.aggregates = { ScatterAggregate_Group, ScatterAggregate_Count, ScatterAggregate_Sum, ScatterAggregate_Min, ScatterAggregate_Max };
+            agg_options.limit = 6;
+            std::vector<ScatterRow> groups = sg.read("SELECT k, COUNT(v), SUM(v), MIN(v), MAX(v) FROM {schema}.t GROUP BY k", agg_options);
+            std::string expected = "SELECT k, COUNT(v) AS c, SUM(v) AS s, MIN(v) AS mi, MAX(v) AS ma FROM (" + all + ") GROUP BY k ORDER BY k LIMIT 6";
+            check(groups.size() == 6, "aggregate limit applies to merged groups");
+            check(scatterColumn(groups, 0) == readColumn(db, "SELECT k FROM (" + expected + ")"), "aggregate group keys");
+            check(scatterColumn(groups, 1) == readColumn(db, "SELECT c FROM (" + expected + ")"), "aggregate COUNT");
+            check(scatterColumn(groups, 2) == readColumn(db, "SELECT s FROM (" + expected + ")"), "aggregate SUM");
+            check(scatterColumn(groups, 3) == readColumn(db, "SELECT mi FROM (" + expected + ")"), "aggregate MIN");
+            check(scatterColumn(groups, 4) == readColumn(db, "SELECT ma FROM (" + expected + ")"), "aggregate MAX");
+        }
+        removeDatabase(fn);
+        removeDatabase(fn_a);
+        removeDatabase(fn_b);
+    }
+
+    void testTokenizer()
+    {
+        Database db(":memory:");
+        db.write("CREATE TABLE t(id INTEGER PRIMARY KEY)");
+
+        auto func = [](const std::string& name) {
+            return sqlFunction("int64_t Dao::" + name, "int64 c", "SELECT COUNT(*) AS c FROM t");
+        };
+
+        std::string code = generate(db,
+            "const char* s = \"/* // \\\" /*\"; " + func("afterString")
+            + "const char* r = R\"(\")\"; " + func("afterRawString")
+            + "const char* rd = R\"x(\n)\" /* \n)x\"; " + func("afterMultilineRawString")
+            + "const char* annotation = R\"(\n" + func("inRawString") + ")\";\n"
+            + "char c = '\"'; " + func("afterCharLiteral")
+            + "char sl = '/'; char q = '\\''; " + func("afterEscapedCharLiteral")
+            + "int n = 1'000'000; " + func("afterDigitSeparator")
+            + "// continued \\\r\n" + func("inContinuedComment")
+            + "// continued \\\n" + func("inContinuedCommentLf")
+            + "// not continued\r\n" + func("afterComment"));
+
+        check(contains(code, "Dao::afterString("), "comment markers and escaped quote in string");
+        check(contains(code, "Dao::afterRawString("), "quote in raw string");
+        check(contains(code, "Dao::afterMultilineRawString("), "raw string with delimiter over several lines");
+        check(!contains(code, "Dao::inRawString("), "annotation in raw string is ignored");
+        check(contains(code, "Dao::afterCharLiteral("), "quote in char literal");
+        check(contains(code, "Dao::afterEscapedCharLiteral("), "slash and escaped quote in char literals");
+        check(contains(code, "Dao::afterDigitSeparator("), "digit separators");
+        check(!contains(code, "Dao::inContinuedComment("), "CRLF line continuation of comment");
+        check(!contains(code, "Dao::inContinuedCommentLf("), "LF line continuation of comment");
+        check(contains(code, "Dao::afterComment("), "CRLF line comment");
+    }
+
+    struct SumSquares
+    {
+        int64_t sum = 0;
+        void step(int64_t v) { sum += v * v; }
+        int64_t final() { return sum; }
+    };
+
+    struct WindowSum
+    {
+        int64_t sum = 0;
+        void step(int64_t v) { sum += v; }
+        void inverse(int64_t v) { sum -= v; }
+        int64_t value() { return sum; }
+        int64_t final() { return sum; }
+    };
+
+    void testFunctions()
+    {
+        Database db(":memory:");
+        db.registerFunction("twice", [](int64_t v) { return v * 2; }, FunctionFlag_Deterministic);
+        db.registerFunction("throws_int", [](int64_t v) -> int64_t { if (v > 1) throw 1; return v; });
+        db.registerAggregate<SumSquares>("sum_squares");
+        db.registerWindow<WindowSum>("window_sum");
+
+        db.write("CREATE TABLE f(a INTEGER)");
+        db.write("INSERT INTO f VALUES (1), (2), (3), (4)");
+        db.write("CREATE INDEX f_twice ON f(twice(a))");
+        check(readInt(db, "SELECT COUNT(*) FROM sqlite_master WHERE name='f_twice'") == 1, "deterministic function in index");
+        check(readInt(db, "SELECT a FROM f WHERE twice(a)=6") == 3, "query on function index");
+        check(queryPlan(db, "SELECT a FROM f WHERE twice(a)=6").find("f_twice") != std::string::npos, "function index used");
+
+        check(readInt(db, "SELECT throws_int(a) FROM f WHERE a=1") == 1, "function without exception");
+        check(db.read("SELECT throws_int(a) FROM f WHERE a=2").empty(), "non-std exception becomes SQL error");
+
+        check(readInt(db, "SELECT sum_squares(a) FROM f") == 30, "aggregate");
+        check(readInt(db, "SELECT sum_squares(a) FROM f WHERE a>10") == 0, "aggregate without rows");
+        check(readInt(db, "SELECT sum_squares(a) FROM f GROUP BY a%2 ORDER BY a%2") == 20, "aggregate per group");
+
+        db_results res = db.read("SELECT window_sum(a) OVER (ORDER BY a ROWS 1 PRECEDING) AS s FROM f ORDER BY a");
+        std::string sums;
+        for (auto& row : res)
+            sums += row["s"] + ",";
+        check(sums == "1,3,5,7,", "window function");
+    }
+}
+
 int test()
 {
     std::cout << "TEST" << std::endl;
@@ -27,5 +936,24 @@ int test()
         std::cout << "id=" << user.id << " name=" << user.name << " password=" << user.password << std::endl;
     }
 
-    return 0;
+    testCarray();
+    testArrayParameters();
+    testTokenizer();
+    testImporter();
+    testExportImport();
+    testBlob();
+    testScatterGather();
+    testGeneratedRouting();
+    testFunctions();
+    testVectorTable();
+    testResultCache();
+    testReaderRouting();
+    testBulkLoadRestore();
+    testSavepoints();
+    testBusyTimeout();
+    testTransactRetry();
+    testShardWriter();
+
+    std::cout << (failures == 0 ? "All checks passed" : std::to_string(failures) + " checks failed") << std::endl;
+    return failures == 0 ? 0 : 1;
 }
\ No newline at end of file